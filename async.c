@@ -0,0 +1,268 @@
+/*
+ * Asynchronous crypt engine (see async.h)
+ * -> bounded MPMC queue of job parts (Vyukov: every cell carries a sequence number that tells producers and
+ *    consumers whether it is free or filled for their lap), a semaphore counts published parts so idle workers sleep
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "async.h"
+#include "salsa20.h"
+
+struct job_part {
+	struct salsa20_job* job;
+	size_t start;
+	size_t length;
+};
+
+struct queue_cell {
+	atomic_size_t sequence;
+	struct job_part part;
+};
+
+struct salsa20_engine {
+	// producers and consumers on separate cache lines
+	_Alignas(64) atomic_size_t enqueuePosition;
+	_Alignas(64) atomic_size_t dequeuePosition;
+	_Alignas(64) struct queue_cell* cells;
+	size_t mask;
+	sem_t published;
+	atomic_bool stopping;
+	int eventFd;
+	// completed jobs without callback (pushed by workers, popped by the reaping thread)
+	_Atomic(struct salsa20_job*) completed;
+	pthread_t* workers;
+	int workerCount;
+};
+
+static bool queue_push(struct salsa20_engine* engine, const struct job_part* part) {
+	size_t position = atomic_load_explicit(&engine->enqueuePosition, memory_order_relaxed);
+	for (;;) {
+		struct queue_cell* cell = &engine->cells[position & engine->mask];
+		size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&engine->enqueuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+				cell->part = *part;
+				atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+				return true;
+			}
+		}
+		else if (difference < 0) {
+			// full
+			return false;
+		}
+		else {
+			position = atomic_load_explicit(&engine->enqueuePosition, memory_order_relaxed);
+		}
+	}
+}
+
+static bool queue_pop(struct salsa20_engine* engine, struct job_part* part) {
+	size_t position = atomic_load_explicit(&engine->dequeuePosition, memory_order_relaxed);
+	for (;;) {
+		struct queue_cell* cell = &engine->cells[position & engine->mask];
+		size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&engine->dequeuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+				*part = cell->part;
+				atomic_store_explicit(&cell->sequence, position + engine->mask + 1, memory_order_release);
+				return true;
+			}
+		}
+		else if (difference < 0) {
+			// empty (or the next cell is reserved but not yet filled)
+			return false;
+		}
+		else {
+			position = atomic_load_explicit(&engine->dequeuePosition, memory_order_relaxed);
+		}
+	}
+}
+
+/*
+ * Takes the part announced by a consumed semaphore count; the cell may still be in the middle of being filled
+ * Returns false only when stopping and the queue is empty
+ */
+static bool take_part(struct salsa20_engine* engine, struct job_part* part) {
+	while (!queue_pop(engine, part)) {
+		if (atomic_load(&engine->stopping) && atomic_load(&engine->enqueuePosition) == atomic_load(&engine->dequeuePosition)) {
+			return false;
+		}
+		sched_yield();
+	}
+	return true;
+}
+
+/*
+ * Runs one part, returns true if it was the last part of its job
+ */
+static bool run_part(const struct job_part* part) {
+	struct salsa20_job* job = part->job;
+	salsa20_crypt_offset(part->length, job->in + part->start, job->out + part->start, job->key, job->nonce, job->offset + part->start);
+	return atomic_fetch_sub_explicit(&job->pendingParts, 1, memory_order_acq_rel) == 1;
+}
+
+static void complete_job(struct salsa20_engine* engine, struct salsa20_job* job, uint64_t* notifications) {
+	if (job->callback != NULL) {
+		job->callback(job);
+		return;
+	}
+	struct salsa20_job* head = atomic_load_explicit(&engine->completed, memory_order_relaxed);
+	do {
+		job->completedNext = head;
+	} while (!atomic_compare_exchange_weak_explicit(&engine->completed, &head, job, memory_order_release, memory_order_relaxed));
+	(*notifications)++;
+}
+
+static void* run_engine_worker(void* argument) {
+	struct salsa20_engine* engine = (struct salsa20_engine*)argument;
+	struct job_part part;
+
+	for (;;) {
+		while (sem_wait(&engine->published) != 0 && errno == EINTR) {
+		}
+		if (!take_part(engine, &part)) {
+			return NULL;
+		}
+
+		// batch: keep taking already published parts while the batch is small, notify once at the end
+		uint64_t notifications = 0;
+		size_t batchBytes = 0;
+		bool isStopped = false;
+		for (;;) {
+			batchBytes += part.length;
+			if (run_part(&part)) {
+				complete_job(engine, part.job, &notifications);
+			}
+			if (batchBytes >= ASYNC_BATCH_BYTES || sem_trywait(&engine->published) != 0) {
+				break;
+			}
+			// the count taken was a stop token
+			if (!take_part(engine, &part)) {
+				isStopped = true;
+				break;
+			}
+		}
+		if (notifications > 0) {
+			// fails only if 2^64 - 2 completions are unread
+			ssize_t written = write(engine->eventFd, &notifications, sizeof(notifications));
+			(void)written;
+		}
+		if (isStopped) {
+			return NULL;
+		}
+	}
+}
+
+/*
+ * Engine with 'workers' threads and a queue of 'queueSize' parts (rounded up to a power of two)
+ * Returns NULL if a resource can not be created
+ */
+struct salsa20_engine* salsa20_engine_create(int workers, size_t queueSize) {
+	struct salsa20_engine* engine = (struct salsa20_engine*)aligned_alloc(64, (sizeof(struct salsa20_engine) + 63) / 64 * 64);
+	if (engine == NULL || workers <= 0) {
+		free(engine);
+		return NULL;
+	}
+	size_t capacity = 2;
+	while (capacity < queueSize) {
+		capacity *= 2;
+	}
+	atomic_init(&engine->enqueuePosition, 0);
+	atomic_init(&engine->dequeuePosition, 0);
+	atomic_init(&engine->stopping, false);
+	atomic_init(&engine->completed, NULL);
+	engine->mask = capacity - 1;
+	engine->cells = (struct queue_cell*)calloc(capacity, sizeof(struct queue_cell));
+	engine->workers = (pthread_t*)calloc(workers, sizeof(pthread_t));
+	engine->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (engine->cells == NULL || engine->workers == NULL || engine->eventFd < 0 || sem_init(&engine->published, 0, 0) != 0) {
+		if (engine->eventFd >= 0) close(engine->eventFd);
+		free(engine->cells);
+		free(engine->workers);
+		free(engine);
+		return NULL;
+	}
+	for (size_t i = 0; i < capacity; i++) {
+		atomic_init(&engine->cells[i].sequence, i);
+	}
+	engine->workerCount = 0;
+	for (int i = 0; i < workers; i++) {
+		if (pthread_create(&engine->workers[i], NULL, run_engine_worker, engine) != 0) {
+			break;
+		}
+		engine->workerCount++;
+	}
+	if (engine->workerCount == 0) {
+		salsa20_engine_destroy(engine);
+		return NULL;
+	}
+	return engine;
+}
+
+/*
+ * Queues a job (split into parts if it is large); waits for free queue cells if the queue is full
+ */
+void salsa20_engine_submit(struct salsa20_engine* engine, struct salsa20_job* job) {
+	size_t parts = job->length > 2 * ASYNC_PART_SIZE ? (job->length + ASYNC_PART_SIZE - 1) / ASYNC_PART_SIZE : 1;
+	atomic_store_explicit(&job->pendingParts, parts, memory_order_relaxed);
+	for (size_t i = 0; i < parts; i++) {
+		size_t start = i * ASYNC_PART_SIZE;
+		struct job_part part = { job, start, parts == 1 || job->length - start < ASYNC_PART_SIZE ? job->length - start : ASYNC_PART_SIZE };
+		while (!queue_push(engine, &part)) {
+			sched_yield();
+		}
+		sem_post(&engine->published);
+	}
+}
+
+/*
+ * Readable while completed jobs without callback wait for salsa20_engine_reap (read it to reset the counter)
+ */
+int salsa20_engine_eventfd(struct salsa20_engine* engine) {
+	return engine->eventFd;
+}
+
+/*
+ * Returns up to 'maxJobs' completed jobs without callback; must only be called from one thread at a time
+ */
+size_t salsa20_engine_reap(struct salsa20_engine* engine, struct salsa20_job** jobs, size_t maxJobs) {
+	size_t count = 0;
+	while (count < maxJobs) {
+		struct salsa20_job* head = atomic_load_explicit(&engine->completed, memory_order_acquire);
+		if (head == NULL) {
+			break;
+		}
+		// single consumer: 'head' can not be popped and pushed again meanwhile, so no ABA
+		if (atomic_compare_exchange_weak_explicit(&engine->completed, &head, head->completedNext, memory_order_acquire, memory_order_relaxed)) {
+			jobs[count++] = head;
+		}
+	}
+	return count;
+}
+
+/*
+ * Finishes all queued jobs, then stops the workers
+ */
+void salsa20_engine_destroy(struct salsa20_engine* engine) {
+	atomic_store(&engine->stopping, true);
+	for (int i = 0; i < engine->workerCount; i++) {
+		sem_post(&engine->published);
+	}
+	for (int i = 0; i < engine->workerCount; i++) {
+		pthread_join(engine->workers[i], NULL);
+	}
+	sem_destroy(&engine->published);
+	close(engine->eventFd);
+	free(engine->cells);
+	free(engine->workers);
+	free(engine);
+}
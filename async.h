@@ -0,0 +1,49 @@
+#ifndef TEAM152_ASYNC_H
+#define TEAM152_ASYNC_H 1
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous crypt engine
+ *
+ * Jobs go through a bounded lock-free MPMC queue to a pool of worker threads. Jobs larger than
+ * 2 * ASYNC_PART_SIZE are split into parts of ASYNC_PART_SIZE bytes that run on several workers,
+ * a worker takes further queued parts or small jobs (up to ASYNC_BATCH_BYTES) before it reports completions.
+ *
+ * A finished job either runs its callback (on a worker thread) or, without callback, is put on the
+ * completion list: the eventfd of the engine becomes readable and salsa20_engine_reap returns the job.
+ */
+#define ASYNC_PART_SIZE (256 << 10)
+#define ASYNC_BATCH_BYTES (64 << 10)
+#define ASYNC_DEFAULT_QUEUE_SIZE 4096
+
+struct salsa20_job;
+typedef void (*salsa20JobCallback)(struct salsa20_job* job);
+
+// filled in by the caller, must stay valid until the job is complete
+struct salsa20_job {
+	uint32_t key[8];
+	uint64_t nonce;
+	// keystream position of in[0]
+	uint64_t offset;
+	const uint8_t* in;
+	uint8_t* out;
+	size_t length;
+	salsa20JobCallback callback;
+	void* context;
+
+	// engine internal
+	atomic_size_t pendingParts;
+	struct salsa20_job* completedNext;
+};
+
+struct salsa20_engine;
+
+struct salsa20_engine* salsa20_engine_create(int workers, size_t queueSize);
+void salsa20_engine_submit(struct salsa20_engine* engine, struct salsa20_job* job);
+int salsa20_engine_eventfd(struct salsa20_engine* engine);
+size_t salsa20_engine_reap(struct salsa20_engine* engine, struct salsa20_job** jobs, size_t maxJobs);
+void salsa20_engine_destroy(struct salsa20_engine* engine);
+#endif
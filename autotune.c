@@ -0,0 +1,355 @@
+/*
+ * Autotuning: measures every kernel (and the multi-threaded multi-block path) per message size on this
+ * machine and stores the fastest plan per size in a small profile file; later runs pick their plan from it
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "autotune.h"
+#include "parallel.h"
+#include "salsa20.h"
+#include "utils.h"
+
+#define TUNE_PROFILE_VERSION 1
+#define TUNE_MIN_SAMPLE_NS 2000000ULL
+#define TUNE_TRIALS 5
+// a plan replaces the one of the next smaller size (the default plan at the smallest) only if it is this much faster
+#define TUNE_MIN_GAIN 0.05
+
+// indices 0-4 are the CLI versions (-V)
+const struct tune_kernel tuneKernels[] = {
+	{ "V0", salsa20_crypt },
+	{ "V1", salsa20_crypt_V1 },
+	{ "V2", salsa20_crypt_V2 },
+	{ "V3", salsa20_crypt_V3 },
+	{ "V4", salsa20_crypt_V4 },
+	{ "x4", salsa20_crypt_x4 },
+	{ "hybrid", salsa20_crypt_hybrid },
+};
+const size_t tuneKernelCount = sizeof(tuneKernels) / sizeof(tuneKernels[0]);
+
+static const uint64_t tuneSizes[] = { 64, 256, 1024, 4096, 16384, 65536, 262144, 1 << 20, 4 << 20, 16 << 20 };
+static const size_t tuneChunkSizes[] = { 64 << 10, 256 << 10, 1 << 20 };
+
+/*
+ * Profile location: $SALSA20_PROFILE, else $XDG_CACHE_HOME/salsa20/profile, else ~/.cache/salsa20/profile
+ */
+const char* tune_profile_path(void) {
+	static char path[4096];
+	const char* override = getenv("SALSA20_PROFILE");
+	const char* cache = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	if (override != NULL && *override != '\0') {
+		snprintf(path, sizeof(path), "%s", override);
+	}
+	else if (cache != NULL && *cache != '\0') {
+		snprintf(path, sizeof(path), "%s/salsa20/profile", cache);
+	}
+	else {
+		snprintf(path, sizeof(path), "%s/.cache/salsa20/profile", home != NULL ? home : ".");
+	}
+	return path;
+}
+
+/*
+ * CPU model name from /proc/cpuinfo, a profile is only used on the CPU it was measured on
+ */
+void tune_read_cpu_model(char* model, size_t size) {
+	snprintf(model, size, "unknown");
+	FILE* file = fopen("/proc/cpuinfo", "r");
+	if (file == NULL) {
+		return;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char* colon = strchr(line, ':');
+		if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+			colon += colon[1] == ' ' ? 2 : 1;
+			colon[strcspn(colon, "\n")] = '\0';
+			snprintf(model, size, "%s", colon);
+			break;
+		}
+	}
+	fclose(file);
+}
+
+static const struct tune_kernel* find_kernel(const char* name) {
+	for (size_t i = 0; i < tuneKernelCount; i++) {
+		if (strcmp(tuneKernels[i].name, name) == 0) {
+			return &tuneKernels[i];
+		}
+	}
+	return NULL;
+}
+
+struct tune_plan tune_plan_for_version(long long version) {
+	return (struct tune_plan){ &tuneKernels[version], 1, 0 };
+}
+
+/*
+ * Runs the plan: single-threaded kernel, or the multi-block kernel over chunks on several threads
+ */
+void tune_crypt(const struct tune_plan* plan, size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) {
+	if (plan->threads > 1 && mlen > plan->chunkSize) {
+		parallel_crypt_buffer(mlen, msg, cipher, key, iv, plan->threads, plan->chunkSize);
+	}
+	else {
+		plan->kernel->crypt(mlen, msg, cipher, key, iv);
+	}
+}
+
+/*
+ * Best throughput in bytes/s of TUNE_TRIALS samples, each at least TUNE_MIN_SAMPLE_NS long
+ */
+static double measure_plan(const struct tune_plan* plan, size_t size, const uint8_t* msg, uint8_t* cipher) {
+	uint32_t key[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	uint64_t repetitions = 1;
+	uint64_t elapsed;
+
+	// warm up and find a repetition count that makes one sample long enough to time
+	for (;;) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t r = 0; r < repetitions; r++) {
+			tune_crypt(plan, size, msg, cipher, key, r);
+		}
+		elapsed = monotonic_ns() - start;
+		if (elapsed >= TUNE_MIN_SAMPLE_NS) break;
+		repetitions *= 2;
+	}
+
+	uint64_t best = elapsed;
+	for (int trial = 1; trial < TUNE_TRIALS; trial++) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t r = 0; r < repetitions; r++) {
+			tune_crypt(plan, size, msg, cipher, key, r);
+		}
+		elapsed = monotonic_ns() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	return (double)size * repetitions * 1e9 / best;
+}
+
+static bool same_plan(const struct tune_plan* a, const struct tune_plan* b) {
+	return a->kernel == b->kernel && a->threads == b->threads && a->chunkSize == b->chunkSize;
+}
+
+/*
+ * Keeps the faster plan in 'fastest' and remembers the throughput of the incumbent and the default plan
+ */
+static void tune_candidate(struct tune_entry* fastest, const struct tune_plan* plan, double throughput, const struct tune_plan* incumbent, double* incumbentThroughput, double* defaultThroughput) {
+	struct tune_plan defaultPlan = tune_plan_for_version(0);
+	if (same_plan(plan, incumbent)) {
+		*incumbentThroughput = throughput;
+	}
+	if (same_plan(plan, &defaultPlan)) {
+		*defaultThroughput = throughput;
+	}
+	if (throughput > fastest->bytesPerSecond) {
+		fastest->plan = *plan;
+		fastest->bytesPerSecond = throughput;
+	}
+}
+
+/*
+ * Measures all candidate plans for every tuned size and keeps the fastest one per size; a plan that is not at least
+ * TUNE_MIN_GAIN faster than the plan of the next smaller size keeps that plan, so measurement noise does not
+ * switch kernels between adjacent sizes
+ */
+void tune_run(struct tune_profile* profile, int maxThreads) {
+	const size_t sizeCount = sizeof(tuneSizes) / sizeof(tuneSizes[0]);
+	const size_t maxSize = tuneSizes[sizeCount - 1];
+	uint8_t* msg = (uint8_t*)malloc(maxSize);
+	uint8_t* cipher = (uint8_t*)malloc(maxSize);
+	memset(profile, 0, sizeof(*profile));
+	profile->entries = (struct tune_entry*)calloc(sizeCount, sizeof(struct tune_entry));
+	if (msg == NULL || cipher == NULL || profile->entries == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	for (size_t i = 0; i < maxSize; i++) {
+		msg[i] = (uint8_t)(i * 31);
+	}
+	tune_read_cpu_model(profile->cpu, sizeof(profile->cpu));
+
+	struct tune_plan incumbent = tune_plan_for_version(0);
+	for (size_t s = 0; s < sizeCount; s++) {
+		const size_t size = tuneSizes[s];
+		struct tune_entry fastest = { size, { NULL, 0, 0 }, 0 };
+		double incumbentThroughput = 0;
+		double defaultThroughput = 0;
+
+		for (size_t k = 0; k < tuneKernelCount; k++) {
+			struct tune_plan plan = { &tuneKernels[k], 1, 0 };
+			double throughput = measure_plan(&plan, size, msg, cipher);
+			tune_candidate(&fastest, &plan, throughput, &incumbent, &incumbentThroughput, &defaultThroughput);
+		}
+
+		// 2, 4, 8, ... threads and maxThreads itself, every thread gets at least one chunk
+		for (int threads = 2; threads <= maxThreads; threads = threads < maxThreads && threads * 2 > maxThreads ? maxThreads : threads * 2) {
+			for (size_t c = 0; c < sizeof(tuneChunkSizes) / sizeof(tuneChunkSizes[0]); c++) {
+				if (tuneChunkSizes[c] * threads > size) continue;
+				struct tune_plan plan = { find_kernel("x4"), threads, tuneChunkSizes[c] };
+				double throughput = measure_plan(&plan, size, msg, cipher);
+				tune_candidate(&fastest, &plan, throughput, &incumbent, &incumbentThroughput, &defaultThroughput);
+			}
+		}
+
+		// the incumbent was not a candidate at this size: compare with the default plan instead
+		if (incumbentThroughput == 0) {
+			incumbent = tune_plan_for_version(0);
+			incumbentThroughput = defaultThroughput;
+		}
+		struct tune_entry* best = &profile->entries[s];
+		if (fastest.bytesPerSecond > incumbentThroughput * (1 + TUNE_MIN_GAIN)) {
+			*best = fastest;
+		}
+		else {
+			*best = (struct tune_entry){ size, incumbent, incumbentThroughput };
+		}
+		incumbent = best->plan;
+		profile->entryCount++;
+		printf("%10zu bytes: %-3s x%-3d %8.1f MB/s\n", size, best->plan.kernel->name, best->plan.threads, best->bytesPerSecond / 1e6);
+		fflush(stdout);
+	}
+	free(msg);
+	free(cipher);
+}
+
+/*
+ * Creates the parent directories of 'path'
+ */
+static void make_parent_directories(const char* path) {
+	char directory[4096];
+	snprintf(directory, sizeof(directory), "%s", path);
+	for (char* slash = strchr(directory + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(directory, 0755);
+		*slash = '/';
+	}
+}
+
+int tune_profile_save(const struct tune_profile* profile) {
+	const char* path = tune_profile_path();
+	make_parent_directories(path);
+	FILE* file = fopen(path, "w");
+	if (file == NULL) {
+		return -1;
+	}
+	fprintf(file, "# salsa20 machine profile, written by --tune\n");
+	fprintf(file, "version %d\n", TUNE_PROFILE_VERSION);
+	fprintf(file, "cpu %s\n", profile->cpu);
+	fprintf(file, "# size kernel threads chunk MB/s\n");
+	for (size_t i = 0; i < profile->entryCount; i++) {
+		const struct tune_entry* entry = &profile->entries[i];
+		fprintf(file, "%llu %s %d %zu %.1f\n", (unsigned long long)entry->size, entry->plan.kernel->name,
+			entry->plan.threads, entry->plan.chunkSize, entry->bytesPerSecond / 1e6);
+	}
+	return fclose(file);
+}
+
+/*
+ * Loads the profile; false if it is missing, unreadable, of another version or measured on another CPU
+ */
+bool tune_profile_load(struct tune_profile* profile) {
+	memset(profile, 0, sizeof(*profile));
+	FILE* file = fopen(tune_profile_path(), "r");
+	if (file == NULL) {
+		return false;
+	}
+	char cpu[128];
+	tune_read_cpu_model(cpu, sizeof(cpu));
+
+	char line[512];
+	bool valid = false;
+	size_t capacity = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		int version;
+		unsigned long long size;
+		char name[16];
+		int threads;
+		size_t chunkSize;
+		double throughput;
+		if (line[0] == '#' || line[0] == '\0') {
+			continue;
+		}
+		if (sscanf(line, "version %d", &version) == 1) {
+			valid = version == TUNE_PROFILE_VERSION;
+		}
+		else if (strncmp(line, "cpu ", 4) == 0) {
+			snprintf(profile->cpu, sizeof(profile->cpu), "%.127s", line + 4);
+		}
+		else if (sscanf(line, "%llu %15s %d %zu %lf", &size, name, &threads, &chunkSize, &throughput) == 5) {
+			const struct tune_kernel* kernel = find_kernel(name);
+			// unknown kernels come from other builds
+			if (kernel == NULL || threads < 1 || (threads > 1 && chunkSize == 0)) {
+				continue;
+			}
+			if (profile->entryCount == capacity) {
+				capacity = capacity ? capacity * 2 : 16;
+				profile->entries = (struct tune_entry*)realloc(profile->entries, capacity * sizeof(struct tune_entry));
+				if (profile->entries == NULL) {
+					throw_perror("An error occurred when allocating memory");
+				}
+			}
+			profile->entries[profile->entryCount++] = (struct tune_entry){ size, { kernel, threads, chunkSize }, throughput * 1e6 };
+		}
+	}
+	fclose(file);
+
+	if (!valid || profile->entryCount == 0 || strcmp(profile->cpu, cpu) != 0) {
+		tune_profile_free(profile);
+		return false;
+	}
+	return true;
+}
+
+void tune_profile_free(struct tune_profile* profile) {
+	free(profile->entries);
+	profile->entries = NULL;
+	profile->entryCount = 0;
+}
+
+/*
+ * Plan of the largest tuned size not above 'size' (the smallest entry for tiny messages)
+ */
+struct tune_plan tune_plan_for_size(const struct tune_profile* profile, uint64_t size) {
+	const struct tune_entry* chosen = &profile->entries[0];
+	for (size_t i = 1; i < profile->entryCount; i++) {
+		if (profile->entries[i].size <= size && profile->entries[i].size >= chosen->size) {
+			chosen = &profile->entries[i];
+		}
+	}
+	return chosen->plan;
+}
+
+void tune_print_plan(const struct tune_plan* plan, uint64_t size) {
+	if (plan->threads > 1) {
+		printf("Plan for %llu bytes: kernel %s on %d threads, chunks of %zu bytes\n", (unsigned long long)size, plan->kernel->name, plan->threads, plan->chunkSize);
+	}
+	else {
+		printf("Plan for %llu bytes: kernel %s, single-threaded\n", (unsigned long long)size, plan->kernel->name);
+	}
+}
+
+/*
+ * Prints the measured sizes and the crossover points where the chosen plan changes
+ */
+void tune_print_profile(const struct tune_profile* profile) {
+	printf("Profile %s (cpu: %s)\n", tune_profile_path(), profile->cpu);
+	printf("%12s %8s %8s %10s %12s\n", "size", "kernel", "threads", "chunk", "MB/s");
+	for (size_t i = 0; i < profile->entryCount; i++) {
+		const struct tune_entry* entry = &profile->entries[i];
+		printf("%12llu %8s %8d %10zu %12.1f\n", (unsigned long long)entry->size, entry->plan.kernel->name,
+			entry->plan.threads, entry->plan.chunkSize, entry->bytesPerSecond / 1e6);
+	}
+	printf("Crossover points:\n");
+	for (size_t i = 0; i < profile->entryCount; i++) {
+		const struct tune_plan* plan = &profile->entries[i].plan;
+		const struct tune_plan* previous = i > 0 ? &profile->entries[i - 1].plan : NULL;
+		if (previous == NULL || previous->kernel != plan->kernel || previous->threads != plan->threads) {
+			printf("  from %llu bytes: %s x%d\n", (unsigned long long)(i == 0 ? 0 : profile->entries[i].size), plan->kernel->name, plan->threads);
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef TEAM152_AUTOTUNE_H
+#define TEAM152_AUTOTUNE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*salsa20CryptFunction)(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv);
+
+struct tune_kernel {
+	const char* name;
+	salsa20CryptFunction crypt;
+};
+
+/*
+ * How to encrypt a message: one kernel single-threaded, or the multi-block kernel on 'threads' threads in chunks
+ */
+struct tune_plan {
+	const struct tune_kernel* kernel;
+	int threads;
+	size_t chunkSize;
+};
+
+// one measured message size of the machine profile, valid from 'size' bytes up to the next entry
+struct tune_entry {
+	uint64_t size;
+	struct tune_plan plan;
+	double bytesPerSecond;
+};
+
+struct tune_profile {
+	char cpu[128];
+	struct tune_entry* entries;
+	size_t entryCount;
+};
+
+extern const struct tune_kernel tuneKernels[];
+extern const size_t tuneKernelCount;
+
+void tune_read_cpu_model(char* model, size_t size);
+const char* tune_profile_path(void);
+bool tune_profile_load(struct tune_profile* profile);
+void tune_profile_free(struct tune_profile* profile);
+void tune_run(struct tune_profile* profile, int maxThreads);
+int tune_profile_save(const struct tune_profile* profile);
+struct tune_plan tune_plan_for_size(const struct tune_profile* profile, uint64_t size);
+struct tune_plan tune_plan_for_version(long long version);
+void tune_crypt(const struct tune_plan* plan, size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv);
+void tune_print_profile(const struct tune_profile* profile);
+void tune_print_plan(const struct tune_plan* plan, uint64_t size);
+#endif
@@ -0,0 +1,791 @@
+/*
+ * Microbenchmarks for the salsa20 core functions
+ * -> cycles per block measured with serialized rdtsc/rdtscp
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "salsa20.h"
+#include "autotune.h"
+#include "benchmark.h"
+#include "keystream_cache.h"
+#include "async.h"
+#include "crc32c.h"
+#include "fanout.h"
+#include "utils.h"
+#include "stats.h"
+
+#define BENCH_TRIALS 11
+#define BENCH_LANES 8
+#define BENCH_STREAM_SIZE (16 << 10)
+#define BENCH_STREAM_CALLS 64
+#define STATS_BENCH_TRIALS 15
+#define STATS_BENCH_SAMPLE_NS 10000000ULL
+#define STATS_BENCH_MAX_OVERHEAD 1.0
+#define GATHER_BENCH_TRIALS 5
+#define GATHER_BENCH_SAMPLE_NS 20000000ULL
+
+typedef void (*salsa20CoreFunction)(uint32_t output[16], const uint32_t input[16]);
+
+struct core_kernel {
+	const char* name;
+	salsa20CoreFunction core;
+};
+
+static const struct core_kernel coreKernels[] = {
+	{ "salsa20_core", salsa20_core },
+	{ "salsa20_core_V1", salsa20_core_V1 },
+	{ "salsa20_core_V2", salsa20_core_V2 },
+	{ "salsa20_core_V3", salsa20_core_V3 },
+	{ "salsa20_core_V4", salsa20_core_V4 },
+};
+
+/*
+ * Read the time stamp counter after all previous instructions have completed
+ * (lfence keeps rdtsc from executing ahead of the measured code)
+ */
+static inline uint64_t tsc_start(void) {
+	uint32_t low, high;
+	__asm__ volatile("lfence\n\trdtsc" : "=a"(low), "=d"(high) : : "memory");
+	return ((uint64_t)high << 32) | low;
+}
+
+/*
+ * Read the time stamp counter after the measured code has retired
+ * (rdtscp waits for previous instructions, lfence keeps later ones from starting early)
+ */
+static inline uint64_t tsc_stop(void) {
+	uint32_t low, high, aux;
+	__asm__ volatile("rdtscp\n\tlfence" : "=a"(low), "=d"(high), "=c"(aux) : : "memory");
+	return ((uint64_t)high << 32) | low;
+}
+
+/*
+ * Tell the compiler the memory behind 'p' is read, so the stores producing it can not be removed
+ */
+static inline void escape(void* p) {
+	__asm__ volatile("" : : "g"(p) : "memory");
+}
+
+static int compare_uint64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Estimate the TSC frequency in GHz against CLOCK_MONOTONIC (busy wait of ~50ms)
+ */
+static double tsc_ghz(void) {
+	struct timespec t1;
+	struct timespec t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	uint64_t c1 = tsc_start();
+	double elapsed;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		elapsed = (t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec);
+	} while (elapsed < 5e7);
+	uint64_t c2 = tsc_stop();
+	return (c2 - c1) / elapsed;
+}
+
+/*
+ * Latency: every block is computed from the previous output, so no two cores can overlap
+ */
+static uint64_t measure_latency(salsa20CoreFunction core, uint64_t iterations) {
+	uint32_t a[16] = { 0x61707865, 1, 2, 3, 4, 0x3320646e, 5, 6, 7, 8, 0x79622d32, 9, 10, 11, 12, 0x6b206574 };
+	uint32_t b[16];
+
+	uint64_t start = tsc_start();
+	for (uint64_t i = 0; i < iterations; i += 2) {
+		core(b, a);
+		escape(b);
+		core(a, b);
+		escape(a);
+	}
+	return tsc_stop() - start;
+}
+
+/*
+ * Throughput: BENCH_LANES independent inputs per iteration, the outputs never feed back
+ */
+static uint64_t measure_throughput(salsa20CoreFunction core, uint64_t iterations) {
+	uint32_t input[BENCH_LANES][16];
+	uint32_t output[BENCH_LANES][16];
+	for (int lane = 0; lane < BENCH_LANES; lane++) {
+		for (int i = 0; i < 16; i++) {
+			input[lane][i] = lane * 16 + i;
+		}
+	}
+
+	uint64_t start = tsc_start();
+	for (uint64_t i = 0; i < iterations; i += BENCH_LANES) {
+		for (int lane = 0; lane < BENCH_LANES; lane++) {
+			core(output[lane], input[lane]);
+		}
+		escape(output);
+	}
+	return tsc_stop() - start;
+}
+
+/*
+ * Median of BENCH_TRIALS runs in TSC ticks per block
+ */
+static double median_per_block(uint64_t (*measure)(salsa20CoreFunction, uint64_t), salsa20CoreFunction core, uint64_t iterations) {
+	uint64_t samples[BENCH_TRIALS];
+	// warm up caches and branch predictors
+	measure(core, iterations / 8 + BENCH_LANES);
+	for (int i = 0; i < BENCH_TRIALS; i++) {
+		samples[i] = measure(core, iterations);
+	}
+	qsort(samples, BENCH_TRIALS, sizeof(samples[0]), compare_uint64);
+	return (double)samples[BENCH_TRIALS / 2] / iterations;
+}
+
+/*
+ * Median of BENCH_TRIALS runs of BENCH_STREAM_CALLS in-place crypt calls on BENCH_STREAM_SIZE bytes, in TSC ticks per byte
+ */
+static double median_per_byte(salsa20CryptFunction crypt, uint8_t* buffer) {
+	uint32_t key[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	uint64_t samples[BENCH_TRIALS];
+	crypt(BENCH_STREAM_SIZE, buffer, buffer, key, 0);
+	for (int i = 0; i < BENCH_TRIALS; i++) {
+		uint64_t start = tsc_start();
+		for (int c = 0; c < BENCH_STREAM_CALLS; c++) {
+			crypt(BENCH_STREAM_SIZE, buffer, buffer, key, c);
+			escape(buffer);
+		}
+		samples[i] = tsc_stop() - start;
+	}
+	qsort(samples, BENCH_TRIALS, sizeof(samples[0]), compare_uint64);
+	return (double)samples[BENCH_TRIALS / 2] / ((uint64_t)BENCH_STREAM_CALLS * BENCH_STREAM_SIZE);
+}
+
+/*
+ * Key rotation of a ciphertext as two crypt passes (decrypt, then encrypt with the next nonce) and as one transcrypt pass
+ */
+static void rotate_two_passes(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) {
+	salsa20_crypt_x4(mlen, msg, cipher, key, iv);
+	salsa20_crypt_x4(mlen, cipher, cipher, key, iv + 1);
+}
+
+static void rotate_transcrypt(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) {
+	salsa20_transcrypt(mlen, msg, cipher, key, iv, key, iv + 1, 0);
+}
+
+/*
+ * Runs latency and throughput measurements for every exported core and prints one row per kernel,
+ * then the throughput of whole crypt calls for the SIMD kernels
+ */
+void run_core_benchmark(uint64_t iterations) {
+	// both loops advance in whole groups of BENCH_LANES blocks
+	iterations = (iterations + BENCH_LANES - 1) / BENCH_LANES * BENCH_LANES;
+	const double ghz = tsc_ghz();
+
+	printf("TSC frequency: %.3f GHz | %llu blocks per trial | median of %d trials\n",
+		ghz, (unsigned long long)iterations, BENCH_TRIALS);
+	printf("%-18s %14s %14s %12s %12s\n", "kernel", "lat cyc/blk", "tput cyc/blk", "tput cyc/B", "tput ns/blk");
+
+	for (size_t i = 0; i < sizeof(coreKernels) / sizeof(coreKernels[0]); i++) {
+		double latency = median_per_block(measure_latency, coreKernels[i].core, iterations);
+		double throughput = median_per_block(measure_throughput, coreKernels[i].core, iterations);
+		printf("%-18s %14.1f %14.1f %12.2f %12.1f\n",
+			coreKernels[i].name, latency, throughput, throughput / 64, throughput / ghz);
+	}
+
+	// whole crypt calls on a buffer that stays in L1: the multi-block kernels against the single-block SIMD ones
+	static const struct tune_kernel streamKernels[] = {
+		{ "salsa20_crypt_V1", salsa20_crypt_V1 },
+		{ "salsa20_crypt_V4", salsa20_crypt_V4 },
+		{ "salsa20_crypt_x4", salsa20_crypt_x4 },
+		{ "salsa20_crypt_hybrid", salsa20_crypt_hybrid },
+		{ "rotate (x4 twice)", rotate_two_passes },
+		{ "rotate (transcrypt)", rotate_transcrypt },
+	};
+	uint8_t* buffer = (uint8_t*)calloc(1, BENCH_STREAM_SIZE);
+	if (buffer == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+	printf("\n%-22s %12s %12s\n", "crypt (16 KiB)", "cyc/B", "GB/s");
+	for (size_t i = 0; i < sizeof(streamKernels) / sizeof(streamKernels[0]); i++) {
+		double perByte = median_per_byte(streamKernels[i].crypt, buffer);
+		printf("%-22s %12.2f %12.2f\n", streamKernels[i].name, perByte, ghz / perByte);
+	}
+	free(buffer);
+	printf("(cycles are TSC reference cycles, independent of turbo frequency)\n");
+}
+
+/*
+ * Fastest of STATS_BENCH_TRIALS samples in ns per crypt call, each sample at least STATS_BENCH_SAMPLE_NS long
+ */
+static double best_ns_per_call(salsa20CryptFunction crypt, size_t size, const uint8_t* msg, uint8_t* cipher) {
+	uint32_t key[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	uint64_t calls = 1;
+	uint64_t elapsed;
+	for (;;) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t c = 0; c < calls; c++) {
+			crypt(size, msg, cipher, key, c);
+		}
+		elapsed = monotonic_ns() - start;
+		if (elapsed >= STATS_BENCH_SAMPLE_NS) break;
+		calls *= 2;
+	}
+	uint64_t best = elapsed;
+	for (int trial = 1; trial < STATS_BENCH_TRIALS; trial++) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t c = 0; c < calls; c++) {
+			crypt(size, msg, cipher, key, c);
+		}
+		elapsed = monotonic_ns() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	return (double)best / calls;
+}
+
+/*
+ * Call with and without the instrumentation of a crypt function around an empty body; the difference is what
+ * the instrumentation adds to every crypt call (zero when it is compiled out)
+ */
+static __attribute__((noinline)) void instrumented_call(size_t mlen) {
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_V0, mlen);
+	__asm__ volatile("" : : "r"(mlen) : "memory");
+	SALSA20_CRYPT_END(SALSA20_KERNEL_V0, mlen);
+}
+
+static __attribute__((noinline)) void empty_call(size_t mlen) {
+	__asm__ volatile("" : : "r"(mlen) : "memory");
+}
+
+/*
+ * Fastest of STATS_BENCH_TRIALS samples in ns per call of 'call'
+ */
+static double best_ns_per_empty(void (*call)(size_t)) {
+	const uint64_t calls = 1 << 20;
+	double best = 0;
+	for (int trial = 0; trial < STATS_BENCH_TRIALS; trial++) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t c = 0; c < calls; c++) {
+			call(c);
+		}
+		double ns = (double)(monotonic_ns() - start) / calls;
+		if (trial == 0 || ns < best) best = ns;
+	}
+	return best;
+}
+
+/*
+ * Overhead of the instrumentation per crypt call of every kernel for small to large messages:
+ * the cost of one instrumented call (measured in isolation, so the noise of timing two separate builds does not
+ * swamp a difference of a few ns) relative to the time of the crypt call itself
+ * Returns non-zero if the overhead exceeds STATS_BENCH_MAX_OVERHEAD percent for any kernel and size
+ */
+int run_stats_benchmark(void) {
+	static const size_t sizes[] = { 64, 1024, 65536, 1 << 20 };
+	const size_t sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+	uint8_t* msg = (uint8_t*)calloc(1, sizes[sizeCount - 1]);
+	uint8_t* cipher = (uint8_t*)malloc(sizes[sizeCount - 1]);
+	if (msg == NULL || cipher == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+
+	// interleaved, so both see the same machine state
+	double instrumented = 0;
+	double empty = 0;
+	for (int round = 0; round < 4; round++) {
+		double i = best_ns_per_empty(instrumented_call);
+		double e = best_ns_per_empty(empty_call);
+		if (round == 0 || i < instrumented) instrumented = i;
+		if (round == 0 || e < empty) empty = e;
+	}
+	double cost = instrumented > empty ? instrumented - empty : 0;
+
+	printf("instrumentation: stats %s, probes %s | %.2f ns per crypt call (%.2f ns instrumented - %.2f ns empty call)\n",
+		salsa20_stats_enabled() ? "on" : "off",
+#ifdef SALSA20_PROBES
+		"on",
+#else
+		"off",
+#endif
+		cost, instrumented, empty);
+	printf("%-8s %8s %12s %10s\n", "kernel", "bytes", "ns/call", "overhead");
+
+	int failed = 0;
+	for (size_t k = 0; k < tuneKernelCount; k++) {
+		for (size_t s = 0; s < sizeCount; s++) {
+			double ns = best_ns_per_call(tuneKernels[k].crypt, sizes[s], msg, cipher);
+			double overhead = cost / ns * 100;
+			printf("%-8s %8zu %12.1f %9.2f%%%s\n", tuneKernels[k].name, sizes[s], ns, overhead,
+				overhead > STATS_BENCH_MAX_OVERHEAD ? "  !" : "");
+			failed += overhead > STATS_BENCH_MAX_OVERHEAD;
+			fflush(stdout);
+		}
+	}
+	printf("%d row(s) above %.1f%% overhead\n", failed, STATS_BENCH_MAX_OVERHEAD);
+	free(msg);
+	free(cipher);
+	return failed > 0;
+}
+
+/*
+ * Page indices 0..pages-1 drawn from a Zipf distribution with exponent 'exponent' (page 0 is the hottest)
+ */
+static void zipf_sequence(uint32_t* sequence, uint64_t count, uint32_t pages, double exponent) {
+	double* cdf = (double*)malloc(pages * sizeof(double));
+	if (cdf == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+	double sum = 0;
+	for (uint32_t i = 0; i < pages; i++) {
+		sum += 1.0 / pow(i + 1, exponent);
+		cdf[i] = sum;
+	}
+	// xorshift64*
+	uint64_t state = 0x2545f4914f6cdd1dULL;
+	for (uint64_t n = 0; n < count; n++) {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		double u = (double)((state * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 53) * sum;
+		uint32_t low = 0;
+		uint32_t high = pages - 1;
+		while (low < high) {
+			uint32_t middle = (low + high) / 2;
+			if (cdf[middle] < u) low = middle + 1;
+			else high = middle;
+		}
+		sequence[n] = low;
+	}
+	free(cdf);
+}
+
+/*
+ * Zipfian page reads of a large object, decrypted with and without the keystream cache
+ */
+void run_cache_benchmark(uint64_t reads) {
+	static const size_t pageSizes[] = { 4096, 16384 };
+	const uint32_t pages = 65536;
+	const double exponent = 0.99;
+	const size_t capacity = 32 << 20;
+	uint32_t key[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	uint32_t* sequence = (uint32_t*)malloc(reads * sizeof(uint32_t));
+	uint8_t* page = (uint8_t*)calloc(1, pageSizes[1]);
+	uint8_t* plain = (uint8_t*)malloc(pageSizes[1]);
+	if (sequence == NULL || page == NULL || plain == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+	zipf_sequence(sequence, reads, pages, exponent);
+
+	printf("%llu Zipf(%.2f) reads over %u pages | cache of %zu MiB, runs of %d bytes\n",
+		(unsigned long long)reads, exponent, pages, capacity >> 20, KEYSTREAM_CACHE_DEFAULT_RUN_SIZE);
+	printf("%-10s %14s %14s %9s %10s %11s\n", "page size", "uncached r/s", "cached r/s", "speedup", "hit rate", "evictions");
+	for (size_t p = 0; p < sizeof(pageSizes) / sizeof(pageSizes[0]); p++) {
+		const size_t pageSize = pageSizes[p];
+
+		uint64_t start = monotonic_ns();
+		for (uint64_t n = 0; n < reads; n++) {
+			salsa20_crypt_offset(pageSize, page, plain, key, 12, (uint64_t)sequence[n] * pageSize);
+		}
+		double uncached = reads * 1e9 / (monotonic_ns() - start);
+
+		struct keystream_cache* cache = keystream_cache_create(capacity, KEYSTREAM_CACHE_DEFAULT_RUN_SIZE, 16);
+		if (cache == NULL) {
+			perror("An error occurred when creating the keystream cache");
+			exit(EXIT_FAILURE);
+		}
+		start = monotonic_ns();
+		for (uint64_t n = 0; n < reads; n++) {
+			keystream_cache_crypt(cache, pageSize, page, plain, key, 12, (uint64_t)sequence[n] * pageSize);
+		}
+		double cached = reads * 1e9 / (monotonic_ns() - start);
+
+		struct keystream_cache_stats stats;
+		keystream_cache_get_stats(cache, &stats);
+		printf("%-10zu %14.0f %14.0f %8.2fx %9.1f%% %11llu\n", pageSize, uncached, cached, cached / uncached,
+			100.0 * stats.hits / (stats.hits + stats.misses), (unsigned long long)stats.evictions);
+		keystream_cache_destroy(cache);
+	}
+	free(sequence);
+	free(page);
+	free(plain);
+}
+
+struct bench_job {
+	struct salsa20_job job;
+	atomic_bool done;
+};
+
+struct bench_submitter {
+	struct salsa20_engine* engine;
+	const uint8_t* input;
+	size_t size;
+	uint64_t jobs;
+	int window;
+	uint64_t submitNs;
+};
+
+static void bench_job_done(struct salsa20_job* job) {
+	atomic_store_explicit(&((struct bench_job*)job)->done, true, memory_order_release);
+}
+
+/*
+ * Keeps 'window' jobs in flight and times every submit call
+ */
+static void* run_bench_submitter(void* argument) {
+	struct bench_submitter* submitter = (struct bench_submitter*)argument;
+	struct bench_job* jobs = (struct bench_job*)calloc(submitter->window, sizeof(struct bench_job));
+	uint8_t* output = (uint8_t*)malloc(submitter->window * submitter->size);
+	if (jobs == NULL || output == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < submitter->window; i++) {
+		atomic_init(&jobs[i].done, true);
+		for (int k = 0; k < 8; k++) jobs[i].job.key[k] = k + 1;
+		jobs[i].job.in = submitter->input;
+		jobs[i].job.out = output + i * submitter->size;
+		jobs[i].job.length = submitter->size;
+		jobs[i].job.callback = bench_job_done;
+	}
+	for (uint64_t n = 0; n < submitter->jobs; n++) {
+		struct bench_job* slot = &jobs[n % submitter->window];
+		while (!atomic_load_explicit(&slot->done, memory_order_acquire)) {
+			sched_yield();
+		}
+		atomic_store_explicit(&slot->done, false, memory_order_relaxed);
+		slot->job.nonce = n;
+		uint64_t start = monotonic_ns();
+		salsa20_engine_submit(submitter->engine, &slot->job);
+		submitter->submitNs += monotonic_ns() - start;
+	}
+	for (int i = 0; i < submitter->window; i++) {
+		while (!atomic_load_explicit(&jobs[i].done, memory_order_acquire)) {
+			sched_yield();
+		}
+	}
+	free(jobs);
+	free(output);
+	return NULL;
+}
+
+/*
+ * Submission overhead and throughput of the async engine with 1 to 16 concurrent submitters,
+ * for small jobs (batched by the workers) and large jobs (split across the workers)
+ */
+void run_async_benchmark(int workers) {
+	static const size_t sizes[] = { 1024, 1 << 20 };
+	static const int submitterCounts[] = { 1, 2, 4, 8, 16 };
+	uint8_t* input = (uint8_t*)calloc(1, sizes[1]);
+	struct salsa20_engine* engine = salsa20_engine_create(workers, ASYNC_DEFAULT_QUEUE_SIZE);
+	if (input == NULL || engine == NULL) {
+		perror("An error occurred when creating the engine");
+		exit(EXIT_FAILURE);
+	}
+
+	// a timed submit includes one pair of clock reads
+	uint64_t clockStart = monotonic_ns();
+	for (int i = 0; i < 100000; i++) {
+		uint64_t t = monotonic_ns();
+		__asm__ volatile("" : : "r"(t) : "memory");
+	}
+	double clockNs = (double)(monotonic_ns() - clockStart) / 100000;
+
+	printf("%d worker(s) | submit time is per call, without the clock read (%.1f ns)\n", workers, clockNs);
+	printf("%-10s %10s %12s %12s %12s\n", "job size", "submitters", "ns/submit", "jobs/s", "MB/s");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (size_t c = 0; c < sizeof(submitterCounts) / sizeof(submitterCounts[0]); c++) {
+			const int count = submitterCounts[c];
+			const uint64_t totalJobs = sizes[s] >= (1 << 20) ? 512 : 200000;
+			struct bench_submitter submitters[16];
+			pthread_t threads[16];
+
+			uint64_t start = monotonic_ns();
+			for (int i = 0; i < count; i++) {
+				submitters[i] = (struct bench_submitter){ engine, input, sizes[s], totalJobs / count, sizes[s] >= (1 << 20) ? 4 : 64, 0 };
+				if (pthread_create(&threads[i], NULL, run_bench_submitter, &submitters[i]) != 0) {
+					perror("An error occurred when creating a thread");
+					exit(EXIT_FAILURE);
+				}
+			}
+			uint64_t submitNs = 0;
+			uint64_t jobs = 0;
+			for (int i = 0; i < count; i++) {
+				pthread_join(threads[i], NULL);
+				submitNs += submitters[i].submitNs;
+				jobs += submitters[i].jobs;
+			}
+			double seconds = (monotonic_ns() - start) / 1e9;
+			double perSubmit = (double)submitNs / jobs - clockNs;
+			printf("%-10zu %10d %12.1f %12.0f %12.1f\n", sizes[s], count, perSubmit > 0 ? perSubmit : 0,
+				jobs / seconds, jobs * sizes[s] / seconds / 1e6);
+			fflush(stdout);
+		}
+	}
+	salsa20_engine_destroy(engine);
+	free(input);
+}
+
+enum crc_variant {
+	CRC_TWO_PASS,
+	CRC_FUSED,
+	CRC_BOTH_THREE_PASS,
+	CRC_BOTH_FUSED
+};
+
+/*
+ * One crypt of 'size' bytes with checksums as 'variant' does it
+ */
+static uint32_t crypt_with_crc(enum crc_variant variant, size_t size, const uint8_t* msg, uint8_t* cipher, uint32_t key[8], uint64_t iv) {
+	uint32_t msgCrc = 0;
+	switch (variant) {
+	case CRC_TWO_PASS:
+		salsa20_crypt_offset(size, msg, cipher, key, iv, 0);
+		return crc32c(0, cipher, size);
+	case CRC_FUSED:
+		return salsa20_crypt_crc32c(size, msg, cipher, key, iv, 0, NULL);
+	case CRC_BOTH_THREE_PASS:
+		msgCrc = crc32c(0, msg, size);
+		salsa20_crypt_offset(size, msg, cipher, key, iv, 0);
+		return crc32c(0, cipher, size) ^ msgCrc;
+	case CRC_BOTH_FUSED:
+		return salsa20_crypt_crc32c(size, msg, cipher, key, iv, 0, &msgCrc) ^ msgCrc;
+	}
+	return 0;
+}
+
+/*
+ * Separate passes against the fused crypt + CRC32C for buffers in L1, L2 and main memory;
+ * 'traffic' is the number of bytes every variant reads or writes per message byte
+ */
+void run_crc_benchmark(void) {
+	static const size_t sizes[] = { 16 << 10, 256 << 10, 64 << 20 };
+	static const struct {
+		const char* name;
+		enum crc_variant variant;
+		int traffic;
+	} variants[] = {
+		{ "crypt, crc(out)", CRC_TWO_PASS, 3 },
+		{ "fused crc(out)", CRC_FUSED, 2 },
+		{ "crc(in), crypt, crc(out)", CRC_BOTH_THREE_PASS, 4 },
+		{ "fused crc(in) + crc(out)", CRC_BOTH_FUSED, 2 },
+	};
+	uint32_t key[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	uint8_t* msg = (uint8_t*)malloc(sizes[2]);
+	uint8_t* cipher = (uint8_t*)malloc(sizes[2]);
+	if (msg == NULL || cipher == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+	memset(msg, 0x5a, sizes[2]);
+	memset(cipher, 0, sizes[2]);
+
+	printf("crc32 instruction: %s\n", crc32c_hardware() ? "yes" : "no (separate table-driven passes)");
+	printf("%-10s %-26s %10s %12s\n", "size", "variant", "GB/s", "traffic B/B");
+	uint32_t sink = 0;
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		// ~128 MiB per sample
+		const uint64_t calls = ((uint64_t)128 << 20) / sizes[s];
+		for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+			uint64_t best = 0;
+			for (int trial = 0; trial < 5; trial++) {
+				uint64_t start = monotonic_ns();
+				for (uint64_t c = 0; c < calls; c++) {
+					sink ^= crypt_with_crc(variants[v].variant, sizes[s], msg, cipher, key, c);
+				}
+				uint64_t elapsed = monotonic_ns() - start;
+				if (trial == 0 || elapsed < best) best = elapsed;
+			}
+			printf("%-10zu %-26s %10.2f %12d\n", sizes[s], variants[v].name, (double)calls * sizes[s] / best, variants[v].traffic);
+			fflush(stdout);
+		}
+	}
+	// keep the checksums alive
+	__asm__ volatile("" : : "r"(sink));
+	free(msg);
+	free(cipher);
+}
+
+/*
+ * N independent passes (one per recipient, as N CLI runs would do) against one fan-out pass over a 64 MiB input,
+ * both writing into per-recipient output buffers of one chunk
+ */
+void run_fanout_benchmark(int count) {
+	const size_t inputSize = 64 << 20;
+	const size_t chunkSize = 1 << 20;
+	uint8_t* input = (uint8_t*)malloc(inputSize);
+	uint8_t* outputs = (uint8_t*)malloc((size_t)count * chunkSize);
+	struct salsa20_recipient* recipients = (struct salsa20_recipient*)calloc(count, sizeof(struct salsa20_recipient));
+	if (input == NULL || outputs == NULL || recipients == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+	memset(input, 0x3c, inputSize);
+	memset(outputs, 0, (size_t)count * chunkSize);
+	for (int r = 0; r < count; r++) {
+		for (int k = 0; k < 8; k++) recipients[r].key[k] = r * 8 + k;
+		recipients[r].nonce = r;
+		recipients[r].cipher = outputs + (size_t)r * chunkSize;
+	}
+
+	printf("%d recipient(s), %zu MiB input, %zu KiB chunks, best of 3\n", count, inputSize >> 20, chunkSize >> 10);
+	printf("%-24s %10s %14s %14s\n", "variant", "seconds", "input GB/s", "output GB/s");
+	double seconds[2];
+	for (int variant = 0; variant < 2; variant++) {
+		uint64_t best = 0;
+		for (int trial = 0; trial < 3; trial++) {
+			uint64_t start = monotonic_ns();
+			if (variant == 0) {
+				for (int r = 0; r < count; r++) {
+					for (size_t offset = 0; offset < inputSize; offset += chunkSize) {
+						salsa20_crypt_offset(chunkSize, input + offset, recipients[r].cipher, recipients[r].key, recipients[r].nonce, offset);
+					}
+				}
+			}
+			else {
+				for (size_t offset = 0; offset < inputSize; offset += chunkSize) {
+					salsa20_crypt_fanout(chunkSize, input + offset, recipients, count, offset);
+				}
+			}
+			uint64_t elapsed = monotonic_ns() - start;
+			if (trial == 0 || elapsed < best) best = elapsed;
+		}
+		seconds[variant] = best / 1e9;
+		printf("%-24s %10.3f %14.2f %14.2f\n", variant == 0 ? "independent passes" : "fan-out", seconds[variant],
+			inputSize / seconds[variant] / 1e9, (double)inputSize * count / seconds[variant] / 1e9);
+	}
+	printf("speedup: %.2fx\n", seconds[0] / seconds[1]);
+
+	// the same through files: N runs that each read the input file against one fan-out run (outputs to /dev/null)
+	char path[] = "/tmp/salsa20_fanout_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || !write_all(fd, input, inputSize)) {
+		perror("An error occurred when writing the input file");
+		exit(EXIT_FAILURE);
+	}
+	char** nullPaths = (char**)malloc(count * sizeof(char*));
+	if (nullPaths == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+	for (int r = 0; r < count; r++) {
+		nullPaths[r] = "/dev/null";
+	}
+	for (int variant = 0; variant < 2; variant++) {
+		uint64_t best = 0;
+		for (int trial = 0; trial < 3; trial++) {
+			uint64_t start = monotonic_ns();
+			if (variant == 0) {
+				for (int r = 0; r < count; r++) {
+					run_fanout_crypt(path, &recipients[r], nullPaths, 1, chunkSize);
+				}
+			}
+			else {
+				run_fanout_crypt(path, recipients, nullPaths, count, chunkSize);
+			}
+			uint64_t elapsed = monotonic_ns() - start;
+			if (trial == 0 || elapsed < best) best = elapsed;
+		}
+		seconds[variant] = best / 1e9;
+		printf("%-24s %10.3f %14.2f %14.2f\n", variant == 0 ? "independent file runs" : "fan-out file run", seconds[variant],
+			inputSize / seconds[variant] / 1e9, (double)inputSize * count / seconds[variant] / 1e9);
+	}
+	printf("speedup: %.2fx\n", seconds[0] / seconds[1]);
+	close(fd);
+	unlink(path);
+	free(nullPaths);
+	free(input);
+	free(outputs);
+	free(recipients);
+}
+
+/*
+ * One pass over the selected rows: a crypt call per row, or one gather call
+ */
+static void gather_pass(bool isGather, uint32_t key[8], const struct salsa20_gather_record* records, size_t count) {
+	if (isGather) {
+		salsa20_crypt_gather(key, 0, records, count);
+		return;
+	}
+	for (size_t r = 0; r < count; r++) {
+		salsa20_crypt_offset(records[r].length, records[r].in, records[r].out, key, 0, records[r].counter * 64);
+	}
+}
+
+/*
+ * Fastest of GATHER_BENCH_TRIALS samples in ns per pass, each sample at least GATHER_BENCH_SAMPLE_NS long
+ */
+static double gather_ns_per_pass(bool isGather, uint32_t key[8], const struct salsa20_gather_record* records, size_t count) {
+	uint64_t passes = 1;
+	uint64_t best = 0;
+	for (;;) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t p = 0; p < passes; p++) {
+			gather_pass(isGather, key, records, count);
+		}
+		best = monotonic_ns() - start;
+		if (best >= GATHER_BENCH_SAMPLE_NS) break;
+		passes *= 2;
+	}
+	for (int trial = 1; trial < GATHER_BENCH_TRIALS; trial++) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t p = 0; p < passes; p++) {
+			gather_pass(isGather, key, records, count);
+		}
+		uint64_t elapsed = monotonic_ns() - start;
+		if (elapsed < best) best = elapsed;
+	}
+	return (double)best / passes;
+}
+
+/*
+ * Decryption of a filtered set of rows of a column (cells of 64 to 512 bytes at counter = row * blocks per cell):
+ * rows per second with one crypt call per row against one salsa20_crypt_gather call
+ */
+void run_gather_benchmark(size_t rows) {
+	static const size_t cellSizes[] = { 64, 128, 256, 512 };
+	static const double selectivities[] = { 0.01, 0.1, 1.0 };
+	const size_t maxCell = cellSizes[sizeof(cellSizes) / sizeof(cellSizes[0]) - 1];
+	uint32_t key[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	uint8_t* column = (uint8_t*)calloc(rows, maxCell);
+	struct salsa20_gather_record* records = (struct salsa20_gather_record*)malloc(rows * sizeof(struct salsa20_gather_record));
+	if (column == NULL || records == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%zu rows per column, best of %d\n", rows, GATHER_BENCH_TRIALS);
+	printf("%-8s %9s %9s %16s %16s %9s\n", "cell", "selected", "rows", "per-row rows/s", "gather rows/s", "speedup");
+	for (size_t c = 0; c < sizeof(cellSizes) / sizeof(cellSizes[0]); c++) {
+		const size_t cellSize = cellSizes[c];
+		for (size_t t = 0; t < sizeof(selectivities) / sizeof(selectivities[0]); t++) {
+			// the same pseudo-random selection for every cell size, in row order like the output of a filter
+			uint64_t state = 0x9e3779b97f4a7c15ULL;
+			size_t count = 0;
+			for (size_t row = 0; row < rows; row++) {
+				state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+				if ((double)(state >> 11) / (1ULL << 53) < selectivities[t]) {
+					records[count++] = (struct salsa20_gather_record){ row * (cellSize / 64), column + row * cellSize, column + row * cellSize, cellSize };
+				}
+			}
+			if (count == 0) continue;
+			double perRow = gather_ns_per_pass(false, key, records, count);
+			double gather = gather_ns_per_pass(true, key, records, count);
+			printf("%5zu B %8.0f%% %9zu %16.0f %16.0f %8.2fx\n", cellSize, selectivities[t] * 100, count,
+				count / perRow * 1e9, count / gather * 1e9, perRow / gather);
+		}
+	}
+	free(column);
+	free(records);
+}
@@ -0,0 +1,14 @@
+#ifndef TEAM152_BENCHMARK_H
+#define TEAM152_BENCHMARK_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+void run_core_benchmark(uint64_t iterations);
+int run_stats_benchmark(void);
+void run_cache_benchmark(uint64_t reads);
+void run_async_benchmark(int workers);
+void run_crc_benchmark(void);
+void run_fanout_benchmark(int count);
+void run_gather_benchmark(size_t rows);
+#endif
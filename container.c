@@ -0,0 +1,589 @@
+/*
+ * Chunked encrypted container (format in container.h)
+ * -> the keystream position of every chunk follows from its index, so chunks can be
+ *    encrypted and decrypted independently, in parallel or one at a time
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "container.h"
+#include "crc32c.h"
+#include "salsa20.h"
+#include "trace.h"
+#include "utils.h"
+
+static const char containerMagic[8] = { 'S', 'L', 'S', '2', '0', 'C', 'F', '1' };
+static const char footerMagic[8] = { 'S', 'L', 'S', '2', '0', 'E', 'N', 'D' };
+
+struct container_writer {
+	int fd;
+	uint32_t key[8];
+	uint64_t nonce;
+	uint32_t chunkSize;
+	uint8_t* buffer;
+	size_t buffered;
+	struct container_index_entry* index;
+	uint64_t chunkCount;
+	uint64_t indexCapacity;
+	uint64_t length;
+	bool failed;
+};
+
+static void store_u32(uint8_t* p, uint32_t value) {
+	memcpy(p, &value, sizeof(value));
+}
+
+static void store_u64(uint8_t* p, uint64_t value) {
+	memcpy(p, &value, sizeof(value));
+}
+
+static uint32_t load_u32(const uint8_t* p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint64_t load_u64(const uint8_t* p) {
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static bool valid_chunk_size(uint64_t chunkSize) {
+	return chunkSize > 0 && chunkSize % 64 == 0 && chunkSize <= CONTAINER_MAX_CHUNK_SIZE;
+}
+
+static void encode_header(uint8_t header[CONTAINER_HEADER_SIZE], uint32_t chunkSize, uint64_t nonce) {
+	memset(header, 0, CONTAINER_HEADER_SIZE);
+	memcpy(header, containerMagic, sizeof(containerMagic));
+	store_u32(header + 8, CONTAINER_VERSION);
+	store_u32(header + 12, chunkSize);
+	store_u64(header + 16, nonce);
+}
+
+/*
+ * Serializes index and footer into one buffer of chunkCount * 8 + 32 bytes
+ */
+static uint8_t* encode_trailer(const struct container_index_entry* index, uint64_t chunkCount, uint64_t length, size_t* size) {
+	const size_t indexSize = chunkCount * CONTAINER_INDEX_ENTRY_SIZE;
+	uint8_t* trailer = (uint8_t*)calloc(1, indexSize + CONTAINER_FOOTER_SIZE);
+	if (trailer == NULL) {
+		return NULL;
+	}
+	for (uint64_t i = 0; i < chunkCount; i++) {
+		store_u32(trailer + i * CONTAINER_INDEX_ENTRY_SIZE, index[i].length);
+		store_u32(trailer + i * CONTAINER_INDEX_ENTRY_SIZE + 4, index[i].crc);
+	}
+	uint8_t* footer = trailer + indexSize;
+	memcpy(footer, footerMagic, sizeof(footerMagic));
+	store_u64(footer + 8, chunkCount);
+	store_u64(footer + 16, length);
+	store_u32(footer + 24, crc32c(0, trailer, indexSize));
+	*size = indexSize + CONTAINER_FOOTER_SIZE;
+	return trailer;
+}
+
+/*
+ * Starts a container on 'fd' (written sequentially, so pipes work), returns NULL with errno set on failure
+ */
+struct container_writer* container_writer_open(int fd, uint32_t key[8], uint64_t nonce, uint32_t chunkSize) {
+	if (!valid_chunk_size(chunkSize)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct container_writer* writer = (struct container_writer*)calloc(1, sizeof(struct container_writer));
+	if (writer == NULL) {
+		return NULL;
+	}
+	writer->buffer = (uint8_t*)malloc(chunkSize);
+	if (writer->buffer == NULL) {
+		free(writer);
+		return NULL;
+	}
+	writer->fd = fd;
+	memcpy(writer->key, key, sizeof(writer->key));
+	writer->nonce = nonce;
+	writer->chunkSize = chunkSize;
+
+	uint8_t header[CONTAINER_HEADER_SIZE];
+	encode_header(header, chunkSize, nonce);
+	if (!write_all(fd, header, sizeof(header))) {
+		free(writer->buffer);
+		free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+/*
+ * Encrypts 'length' bytes of 'plain' (may be the writer's own buffer) as the next chunk and writes it
+ */
+static int writer_emit_chunk(struct container_writer* writer, const uint8_t* plain, size_t length) {
+	if (writer->chunkCount == writer->indexCapacity) {
+		uint64_t capacity = writer->indexCapacity ? writer->indexCapacity * 2 : 64;
+		struct container_index_entry* index = (struct container_index_entry*)realloc(writer->index, capacity * sizeof(struct container_index_entry));
+		if (index == NULL) {
+			return -1;
+		}
+		writer->index = index;
+		writer->indexCapacity = capacity;
+	}
+	TRACE_BEGIN(cryptStart);
+	uint32_t crc = salsa20_crypt_crc32c(length, plain, writer->buffer, writer->key, writer->nonce, writer->chunkCount * writer->chunkSize, NULL);
+	TRACE_END("crypt chunk", cryptStart, length);
+	writer->index[writer->chunkCount] = (struct container_index_entry){ length, crc };
+	if (!write_all(writer->fd, writer->buffer, length)) {
+		return -1;
+	}
+	writer->chunkCount++;
+	writer->length += length;
+	return 0;
+}
+
+/*
+ * Appends plaintext; full chunks are encrypted and written as soon as they are complete
+ */
+int container_writer_write(struct container_writer* writer, const uint8_t* data, size_t length) {
+	if (writer->failed) {
+		errno = EIO;
+		return -1;
+	}
+	while (length > 0) {
+		// whole chunks are encrypted straight from the caller's data
+		if (writer->buffered == 0 && length >= writer->chunkSize) {
+			if (writer_emit_chunk(writer, data, writer->chunkSize) != 0) {
+				writer->failed = true;
+				return -1;
+			}
+			data += writer->chunkSize;
+			length -= writer->chunkSize;
+			continue;
+		}
+		size_t take = writer->chunkSize - writer->buffered < length ? writer->chunkSize - writer->buffered : length;
+		memcpy(writer->buffer + writer->buffered, data, take);
+		writer->buffered += take;
+		data += take;
+		length -= take;
+		if (writer->buffered == writer->chunkSize) {
+			writer->buffered = 0;
+			if (writer_emit_chunk(writer, writer->buffer, writer->chunkSize) != 0) {
+				writer->failed = true;
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Writes the last (partial) chunk, the index and the footer, then frees the writer (the fd stays open)
+ */
+int container_writer_close(struct container_writer* writer) {
+	int result = writer->failed ? -1 : 0;
+	if (result == 0 && writer->buffered > 0 && writer_emit_chunk(writer, writer->buffer, writer->buffered) != 0) {
+		result = -1;
+	}
+	if (result == 0) {
+		size_t size;
+		uint8_t* trailer = encode_trailer(writer->index, writer->chunkCount, writer->length, &size);
+		if (trailer == NULL || !write_all(writer->fd, trailer, size)) {
+			result = -1;
+		}
+		free(trailer);
+	}
+	free(writer->buffer);
+	free(writer->index);
+	free(writer);
+	return result;
+}
+
+/*
+ * Reads and checks header, footer and index; NULL with errno EBADMSG if the file is no complete container
+ */
+struct container_reader* container_reader_open(int fd, uint32_t key[8]) {
+	struct stat fileStat;
+	uint8_t header[CONTAINER_HEADER_SIZE];
+	uint8_t footer[CONTAINER_FOOTER_SIZE];
+	if (fstat(fd, &fileStat) != 0) {
+		return NULL;
+	}
+	if ((uint64_t)fileStat.st_size < CONTAINER_HEADER_SIZE + CONTAINER_FOOTER_SIZE
+		|| !pread_all(fd, header, sizeof(header), 0)
+		|| !pread_all(fd, footer, sizeof(footer), fileStat.st_size - CONTAINER_FOOTER_SIZE)) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	const uint32_t chunkSize = load_u32(header + 12);
+	const uint64_t chunkCount = load_u64(footer + 8);
+	const uint64_t length = load_u64(footer + 16);
+	if (memcmp(header, containerMagic, sizeof(containerMagic)) != 0 || load_u32(header + 8) != CONTAINER_VERSION
+		|| !valid_chunk_size(chunkSize) || memcmp(footer, footerMagic, sizeof(footerMagic)) != 0
+		|| chunkCount != (length + chunkSize - 1) / chunkSize
+		|| chunkCount > ((uint64_t)fileStat.st_size / CONTAINER_INDEX_ENTRY_SIZE)
+		|| (uint64_t)fileStat.st_size != CONTAINER_HEADER_SIZE + length + chunkCount * CONTAINER_INDEX_ENTRY_SIZE + CONTAINER_FOOTER_SIZE) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	const size_t indexSize = chunkCount * CONTAINER_INDEX_ENTRY_SIZE;
+	uint8_t* rawIndex = (uint8_t*)malloc(indexSize ? indexSize : 1);
+	struct container_reader* reader = (struct container_reader*)calloc(1, sizeof(struct container_reader));
+	if (rawIndex == NULL || reader == NULL) {
+		free(rawIndex);
+		free(reader);
+		return NULL;
+	}
+	reader->index = (struct container_index_entry*)malloc((chunkCount ? chunkCount : 1) * sizeof(struct container_index_entry));
+	if (reader->index == NULL || !pread_all(fd, rawIndex, indexSize, CONTAINER_HEADER_SIZE + length)
+		|| crc32c(0, rawIndex, indexSize) != load_u32(footer + 24)) {
+		free(rawIndex);
+		free(reader->index);
+		free(reader);
+		errno = EBADMSG;
+		return NULL;
+	}
+	for (uint64_t i = 0; i < chunkCount; i++) {
+		reader->index[i].length = load_u32(rawIndex + i * CONTAINER_INDEX_ENTRY_SIZE);
+		reader->index[i].crc = load_u32(rawIndex + i * CONTAINER_INDEX_ENTRY_SIZE + 4);
+		uint64_t expected = i + 1 < chunkCount ? chunkSize : length - i * chunkSize;
+		if (reader->index[i].length != expected) {
+			free(rawIndex);
+			free(reader->index);
+			free(reader);
+			errno = EBADMSG;
+			return NULL;
+		}
+	}
+	free(rawIndex);
+
+	reader->fd = fd;
+	memcpy(reader->key, key, sizeof(reader->key));
+	reader->nonce = load_u64(header + 16);
+	reader->chunkSize = chunkSize;
+	reader->chunkCount = chunkCount;
+	reader->length = length;
+	return reader;
+}
+
+/*
+ * Reads, verifies and decrypts chunk 'chunk' into 'out' (room for chunkSize bytes); thread-safe
+ * Returns the chunk length, -1 with errno EBADMSG on a checksum mismatch
+ */
+ssize_t container_read_chunk(struct container_reader* reader, uint64_t chunk, uint8_t* out) {
+	if (chunk >= reader->chunkCount) {
+		errno = EINVAL;
+		return -1;
+	}
+	const uint64_t offset = chunk * reader->chunkSize;
+	const uint32_t length = reader->index[chunk].length;
+	if (!pread_all(reader->fd, out, length, CONTAINER_HEADER_SIZE + offset)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	// checked in the same pass as the decryption, a corrupted chunk is wiped
+	if (salsa20_crypt_crc32c_input(length, out, out, reader->key, reader->nonce, offset) != reader->index[chunk].crc) {
+		memset(out, 0, length);
+		errno = EBADMSG;
+		return -1;
+	}
+	return length;
+}
+
+/*
+ * Decrypts 'length' plaintext bytes at 'offset', touching only the chunks that overlap the range
+ * Returns the number of bytes read (short at the end of the data), -1 on error
+ */
+ssize_t container_pread(struct container_reader* reader, uint8_t* out, size_t length, uint64_t offset) {
+	if (offset >= reader->length) {
+		return 0;
+	}
+	if (length > reader->length - offset) {
+		length = reader->length - offset;
+	}
+	uint8_t* scratch = NULL;
+	size_t done = 0;
+	while (done < length) {
+		const uint64_t position = offset + done;
+		const uint64_t chunk = position / reader->chunkSize;
+		const size_t skip = position % reader->chunkSize;
+		const size_t available = reader->index[chunk].length - skip;
+		const size_t take = available < length - done ? available : length - done;
+
+		if (skip == 0 && take == reader->index[chunk].length) {
+			// whole chunk: decrypt straight into the caller's buffer
+			if (container_read_chunk(reader, chunk, out + done) < 0) {
+				free(scratch);
+				return -1;
+			}
+		}
+		else {
+			// partial chunk: the checksum covers the whole chunk, so it goes through scratch memory
+			if (scratch == NULL && (scratch = (uint8_t*)malloc(reader->chunkSize)) == NULL) {
+				return -1;
+			}
+			if (container_read_chunk(reader, chunk, scratch) < 0) {
+				free(scratch);
+				return -1;
+			}
+			memcpy(out + done, scratch + skip, take);
+		}
+		done += take;
+	}
+	free(scratch);
+	return done;
+}
+
+void container_reader_close(struct container_reader* reader) {
+	free(reader->index);
+	free(reader);
+}
+
+struct container_job {
+	int inputFd;
+	int outputFd;
+	uint32_t* key;
+	uint64_t nonce;
+	uint32_t chunkSize;
+	uint64_t length;
+	uint64_t chunkCount;
+	struct container_index_entry* index;
+	struct container_reader* reader;
+	atomic_uint_fast64_t next;
+	atomic_bool failed;
+	atomic_bool corrupted;
+};
+
+static void* run_pack_worker(void* argument) {
+	struct container_job* job = (struct container_job*)argument;
+	uint8_t* buffer = (uint8_t*)malloc(job->chunkSize);
+	if (buffer == NULL) {
+		atomic_store(&job->failed, true);
+		return NULL;
+	}
+	uint64_t chunk;
+	while (!atomic_load(&job->failed) && (chunk = atomic_fetch_add(&job->next, 1)) < job->chunkCount) {
+		const uint64_t offset = chunk * job->chunkSize;
+		const size_t length = job->length - offset < job->chunkSize ? job->length - offset : job->chunkSize;
+		if (!pread_all(job->inputFd, buffer, length, offset)) {
+			atomic_store(&job->failed, true);
+			break;
+		}
+		TRACE_BEGIN(cryptStart);
+		uint32_t crc = salsa20_crypt_crc32c(length, buffer, buffer, job->key, job->nonce, offset, NULL);
+		TRACE_END("crypt chunk", cryptStart, length);
+		job->index[chunk] = (struct container_index_entry){ length, crc };
+		if (!pwrite_all(job->outputFd, buffer, length, CONTAINER_HEADER_SIZE + offset)) {
+			atomic_store(&job->failed, true);
+		}
+	}
+	free(buffer);
+	return NULL;
+}
+
+static void* run_unpack_worker(void* argument) {
+	struct container_job* job = (struct container_job*)argument;
+	uint8_t* buffer = (uint8_t*)malloc(job->chunkSize);
+	if (buffer == NULL) {
+		atomic_store(&job->failed, true);
+		return NULL;
+	}
+	uint64_t chunk;
+	while (!atomic_load(&job->failed) && (chunk = atomic_fetch_add(&job->next, 1)) < job->chunkCount) {
+		TRACE_BEGIN(cryptStart);
+		ssize_t length = container_read_chunk(job->reader, chunk, buffer);
+		TRACE_END("crypt chunk", cryptStart, length > 0 ? length : 0);
+		if (length < 0) {
+			atomic_store(&job->corrupted, errno == EBADMSG);
+			atomic_store(&job->failed, true);
+			break;
+		}
+		if (!pwrite_all(job->outputFd, buffer, length, chunk * job->chunkSize)) {
+			atomic_store(&job->failed, true);
+		}
+	}
+	free(buffer);
+	return NULL;
+}
+
+static void run_container_workers(struct container_job* job, int threads, void* (*worker)(void*)) {
+	pthread_t* handles = (pthread_t*)malloc(threads * sizeof(pthread_t));
+	if (handles == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&handles[i], NULL, worker, job) != 0) {
+			throw_error("An error occurred when creating a thread");
+		}
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(handles[i], NULL);
+	}
+	free(handles);
+}
+
+/*
+ * Packs a file into a container; regular files are encrypted by 'threads' workers,
+ * anything else ("-" for stdin, pipes) is streamed through a container_writer
+ */
+void container_pack(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, uint32_t chunkSize, int threads) {
+	if (!valid_chunk_size(chunkSize)) {
+		throw_error("Chunk size must be a positive multiple of 64 and at most 1 GiB");
+	}
+	int inputFd = strcmp(inputPath, "-") == 0 ? STDIN_FILENO : open(inputPath, O_RDONLY | O_CLOEXEC);
+	if (inputFd < 0) {
+		throw_perror("Error when opening input file");
+	}
+	int outputFd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (outputFd < 0) {
+		throw_perror("An error occurred when opening output file");
+	}
+	struct stat inputStat;
+	if (fstat(inputFd, &inputStat) != 0) {
+		throw_perror("Error when getting information about file");
+	}
+
+	if (!S_ISREG(inputStat.st_mode)) {
+		struct container_writer* writer = container_writer_open(outputFd, key, nonce, chunkSize);
+		uint8_t* buffer = (uint8_t*)malloc(chunkSize);
+		if (writer == NULL || buffer == NULL) {
+			throw_perror("An error occurred when writing the container header");
+		}
+		ssize_t count;
+		while ((count = read(inputFd, buffer, chunkSize)) != 0) {
+			if (count < 0) {
+				if (errno == EINTR) continue;
+				throw_perror("An error occurred when reading input file");
+			}
+			if (container_writer_write(writer, buffer, count) != 0) {
+				throw_perror("An error occurred when writing output");
+			}
+		}
+		if (container_writer_close(writer) != 0) {
+			throw_perror("An error occurred when writing output");
+		}
+		free(buffer);
+	}
+	else {
+		struct container_job job = { 0 };
+		job.inputFd = inputFd;
+		job.outputFd = outputFd;
+		job.key = key;
+		job.nonce = nonce;
+		job.chunkSize = chunkSize;
+		job.length = inputStat.st_size;
+		job.chunkCount = (job.length + chunkSize - 1) / chunkSize;
+		job.index = (struct container_index_entry*)malloc((job.chunkCount ? job.chunkCount : 1) * sizeof(struct container_index_entry));
+		if (job.index == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+		uint8_t header[CONTAINER_HEADER_SIZE];
+		encode_header(header, chunkSize, nonce);
+		if (!pwrite_all(outputFd, header, sizeof(header), 0)) {
+			throw_perror("An error occurred when writing output");
+		}
+
+		run_container_workers(&job, threads, run_pack_worker);
+		if (atomic_load(&job.failed)) {
+			throw_perror("An error occurred when reading or writing a chunk");
+		}
+
+		size_t size;
+		uint8_t* trailer = encode_trailer(job.index, job.chunkCount, job.length, &size);
+		if (trailer == NULL || !pwrite_all(outputFd, trailer, size, CONTAINER_HEADER_SIZE + job.length)) {
+			throw_perror("An error occurred when writing output");
+		}
+		free(trailer);
+		free(job.index);
+	}
+
+	if (close(outputFd) != 0) {
+		throw_perror("An error occurred when closing the output file");
+	}
+	if (inputFd != STDIN_FILENO) {
+		close(inputFd);
+	}
+}
+
+static struct container_reader* open_container(const char* inputPath, uint32_t key[8], int* inputFd) {
+	*inputFd = open(inputPath, O_RDONLY | O_CLOEXEC);
+	if (*inputFd < 0) {
+		throw_perror("Error when opening input file");
+	}
+	struct container_reader* reader = container_reader_open(*inputFd, key);
+	if (reader == NULL) {
+		if (errno == EBADMSG) {
+			throw_error("Input is not a complete container (wrong format, truncated or not closed)");
+		}
+		throw_perror("An error occurred when reading the container");
+	}
+	return reader;
+}
+
+/*
+ * Decrypts a whole container with 'threads' workers
+ */
+void container_unpack(const char* inputPath, const char* outputPath, uint32_t key[8], int threads) {
+	int inputFd;
+	struct container_reader* reader = open_container(inputPath, key, &inputFd);
+	int outputFd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (outputFd < 0 || ftruncate(outputFd, reader->length) != 0) {
+		throw_perror("An error occurred when opening output file");
+	}
+
+	struct container_job job = { 0 };
+	job.outputFd = outputFd;
+	job.chunkSize = reader->chunkSize;
+	job.chunkCount = reader->chunkCount;
+	job.reader = reader;
+	run_container_workers(&job, threads, run_unpack_worker);
+	if (atomic_load(&job.corrupted)) {
+		throw_error("A chunk of the container is corrupted (checksum mismatch)");
+	}
+	if (atomic_load(&job.failed)) {
+		throw_perror("An error occurred when reading or writing a chunk");
+	}
+
+	if (close(outputFd) != 0) {
+		throw_perror("An error occurred when closing the output file");
+	}
+	container_reader_close(reader);
+	close(inputFd);
+}
+
+/*
+ * Decrypts only chunk 'chunk' of a container (one pread of the chunk)
+ */
+void container_unpack_chunk(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t chunk) {
+	int inputFd;
+	struct container_reader* reader = open_container(inputPath, key, &inputFd);
+	if (chunk >= reader->chunkCount) {
+		throw_error("Chunk index is out of range");
+	}
+	uint8_t* buffer = (uint8_t*)malloc(reader->chunkSize);
+	if (buffer == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	ssize_t length = container_read_chunk(reader, chunk, buffer);
+	if (length < 0) {
+		throw_error("The chunk is corrupted (checksum mismatch)");
+	}
+
+	int outputFd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (outputFd < 0 || !write_all(outputFd, buffer, length)) {
+		throw_perror("An error occurred when writing output");
+	}
+	if (close(outputFd) != 0) {
+		throw_perror("An error occurred when closing the output file");
+	}
+	free(buffer);
+	container_reader_close(reader);
+	close(inputFd);
+}
@@ -0,0 +1,54 @@
+#ifndef TEAM152_CONTAINER_H
+#define TEAM152_CONTAINER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Chunked container (all integers little-endian)
+ *
+ * header   "SLS20CF1" | uint32 version | uint32 chunkSize | uint64 nonce | uint64 reserved      (32 bytes)
+ * chunks   ciphertext of chunk i at CONTAINER_HEADER_SIZE + i * chunkSize, only the last may be shorter;
+ *          its keystream starts at byte i * chunkSize (block counter i * chunkSize / 64)
+ * index    per chunk: uint32 length | uint32 CRC32C of the ciphertext                           (8 bytes each)
+ * footer   "SLS20END" | uint64 chunkCount | uint64 length | uint32 CRC32C of the index | uint32 reserved (32 bytes)
+ *
+ * The footer is written last, a file without it was truncated or never closed.
+ */
+#define CONTAINER_HEADER_SIZE 32
+#define CONTAINER_INDEX_ENTRY_SIZE 8
+#define CONTAINER_FOOTER_SIZE 32
+#define CONTAINER_VERSION 1
+#define CONTAINER_MAX_CHUNK_SIZE (1U << 30)
+
+struct container_index_entry {
+	uint32_t length;
+	uint32_t crc;
+};
+
+struct container_writer;
+
+struct container_reader {
+	int fd;
+	uint32_t key[8];
+	uint64_t nonce;
+	uint32_t chunkSize;
+	uint64_t chunkCount;
+	uint64_t length;
+	struct container_index_entry* index;
+};
+
+struct container_writer* container_writer_open(int fd, uint32_t key[8], uint64_t nonce, uint32_t chunkSize);
+int container_writer_write(struct container_writer* writer, const uint8_t* data, size_t length);
+int container_writer_close(struct container_writer* writer);
+
+struct container_reader* container_reader_open(int fd, uint32_t key[8]);
+ssize_t container_read_chunk(struct container_reader* reader, uint64_t chunk, uint8_t* out);
+ssize_t container_pread(struct container_reader* reader, uint8_t* out, size_t length, uint64_t offset);
+void container_reader_close(struct container_reader* reader);
+
+void container_pack(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, uint32_t chunkSize, int threads);
+void container_unpack(const char* inputPath, const char* outputPath, uint32_t key[8], int threads);
+void container_unpack_chunk(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t chunk);
+#endif
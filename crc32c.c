@@ -0,0 +1,86 @@
+/*
+ * CRC32C (Castagnoli, reflected polynomial 0x82F63B78)
+ * -> SSE4.2 crc32 instruction (eight bytes per instruction) if the CPU has it,
+ *    else table driven, eight bytes per step (slicing-by-8)
+ */
+#include <nmmintrin.h>
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+static uint32_t crc32cTable[8][256];
+static pthread_once_t crc32cTableOnce = PTHREAD_ONCE_INIT;
+static bool isCrc32cHardware = false;
+static pthread_once_t crc32cHardwareOnce = PTHREAD_ONCE_INIT;
+
+static void fill_crc32c_table(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		}
+		crc32cTable[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			crc32cTable[t][i] = (crc32cTable[t - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][i] & 0xff];
+		}
+	}
+}
+
+static void detect_crc32c_hardware(void) {
+	__builtin_cpu_init();
+	isCrc32cHardware = __builtin_cpu_supports("sse4.2");
+}
+
+/*
+ * True if the CPU has the SSE4.2 crc32 instruction
+ */
+bool crc32c_hardware(void) {
+	pthread_once(&crc32cHardwareOnce, detect_crc32c_hardware);
+	return isCrc32cHardware;
+}
+
+/*
+ * crc32c with the crc32 instruction; 'crc' is the raw register value (not inverted)
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* bytes, size_t length) {
+	uint64_t state = crc;
+	for (; length >= 8; length -= 8, bytes += 8) {
+		uint64_t word;
+		memcpy(&word, bytes, sizeof(word));
+		state = _mm_crc32_u64(state, word);
+	}
+	crc = (uint32_t)state;
+	for (; length > 0; length--, bytes++) {
+		crc = _mm_crc32_u8(crc, *bytes);
+	}
+	return crc;
+}
+
+/*
+ * Continues 'crc' (0 for a new checksum) over 'length' bytes of data
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+	if (crc32c_hardware()) {
+		return ~crc32c_sse42(~crc, (const uint8_t*)data, length);
+	}
+	pthread_once(&crc32cTableOnce, fill_crc32c_table);
+	const uint8_t* bytes = (const uint8_t*)data;
+	crc = ~crc;
+
+	for (; length >= 8; length -= 8, bytes += 8) {
+		uint64_t word;
+		memcpy(&word, bytes, sizeof(word));
+		word ^= crc;
+		crc = crc32cTable[7][word & 0xff] ^ crc32cTable[6][(word >> 8) & 0xff]
+			^ crc32cTable[5][(word >> 16) & 0xff] ^ crc32cTable[4][(word >> 24) & 0xff]
+			^ crc32cTable[3][(word >> 32) & 0xff] ^ crc32cTable[2][(word >> 40) & 0xff]
+			^ crc32cTable[1][(word >> 48) & 0xff] ^ crc32cTable[0][word >> 56];
+	}
+	for (; length > 0; length--, bytes++) {
+		crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *bytes) & 0xff];
+	}
+	return ~crc;
+}
@@ -0,0 +1,10 @@
+#ifndef TEAM152_CRC32C_H
+#define TEAM152_CRC32C_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+bool crc32c_hardware(void);
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Multi-recipient fan-out: one input encrypted under many (key, nonce) pairs into one output each
+ * -> every chunk of the input is read once and encrypted for all recipients (salsa20_crypt_fanout) before the next
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "fanout.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * Reads 'inputPath' in chunks of 'chunkSize' bytes and writes it encrypted for recipient r to outputPaths[r]
+ * (the cipher pointers of the recipients are set here); with many recipients the chunk is shrunk to a multiple of
+ * 64 bytes so that all output buffers fit into FANOUT_BUFFER_BUDGET
+ */
+void run_fanout_crypt(const char* inputPath, struct salsa20_recipient recipients[], char* const outputPaths[], int count, size_t chunkSize) {
+	if (chunkSize == 0) {
+		throw_error("Chunk size must be positive");
+	}
+	// salsa20_crypt_fanout works in slices of 16 KiB anyway, a larger chunk only saves system calls
+	const size_t maxChunkSize = (size_t)FANOUT_BUFFER_BUDGET / count / 64 * 64;
+	if (chunkSize > maxChunkSize) {
+		chunkSize = maxChunkSize;
+	}
+	int inputFd = open(inputPath, O_RDONLY | O_CLOEXEC);
+	if (inputFd < 0) {
+		throw_perror("Error when opening input file");
+	}
+	int* outputFds = (int*)malloc(count * sizeof(int));
+	uint8_t* input = (uint8_t*)malloc(chunkSize);
+	uint8_t* outputs = (uint8_t*)malloc((size_t)count * chunkSize);
+	if (outputFds == NULL || input == NULL || outputs == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	for (int r = 0; r < count; r++) {
+		outputFds[r] = open(outputPaths[r], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (outputFds[r] < 0) {
+			throw_perror("An error occurred when opening output file");
+		}
+		recipients[r].cipher = outputs + (size_t)r * chunkSize;
+	}
+
+	for (uint64_t offset = 0;; ) {
+		TRACE_BEGIN(readStart);
+		size_t size = 0;
+		while (size < chunkSize) {
+			ssize_t result = read(inputFd, input + size, chunkSize - size);
+			if (result < 0 && errno == EINTR) continue;
+			if (result < 0) {
+				throw_perror("An error occurred when reading input file");
+			}
+			if (result == 0) break;
+			size += result;
+		}
+		TRACE_END("read chunk", readStart, size);
+		if (size == 0) {
+			break;
+		}
+
+		TRACE_BEGIN(cryptStart);
+		salsa20_crypt_fanout(size, input, recipients, count, offset);
+		TRACE_END("crypt chunk", cryptStart, size * count);
+
+		TRACE_BEGIN(writeStart);
+		for (int r = 0; r < count; r++) {
+			if (!write_all(outputFds[r], recipients[r].cipher, size)) {
+				throw_perror("An error occurred when writing output");
+			}
+		}
+		TRACE_END("write chunk", writeStart, size * count);
+		offset += size;
+	}
+
+	for (int r = 0; r < count; r++) {
+		if (close(outputFds[r]) != 0) {
+			throw_perror("An error occurred when closing output file");
+		}
+	}
+	close(inputFd);
+	free(outputFds);
+	free(input);
+	free(outputs);
+}
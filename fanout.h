@@ -0,0 +1,13 @@
+#ifndef TEAM152_FANOUT_H
+#define TEAM152_FANOUT_H 1
+
+#include <stddef.h>
+#include "salsa20.h"
+
+// upper bound of --recipient options
+#define FANOUT_MAX_RECIPIENTS 1024
+// upper bound of the output buffers of all recipients together, larger chunks are shrunk to fit
+#define FANOUT_BUFFER_BUDGET (64 << 20)
+
+void run_fanout_crypt(const char* inputPath, struct salsa20_recipient recipients[], char* const outputPaths[], int count, size_t chunkSize);
+#endif
@@ -0,0 +1,157 @@
+/*
+ * Follow mode for growing (log) files
+ * -> byte i of the output is byte i of the input XOR keystream byte i, so the length of the output is the
+ *    processed offset: it survives restarts, and a run that is killed midway resumes at exactly the bytes it wrote.
+ *    Only the bytes behind that offset are read and encrypted (a partially used last block continues at its
+ *    position), inotify wakes the loop up when the input grows.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "follow.h"
+#include "salsa20.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * Encrypts input bytes [offset, end of input) in chunks of 'chunkSize' bytes and writes them behind the output
+ * Returns the new offset
+ */
+static uint64_t catch_up(int inputFd, int outputFd, uint8_t* buffer, uint32_t key[8], uint64_t nonce, uint64_t offset, size_t chunkSize) {
+	struct stat inputStat;
+	if (fstat(inputFd, &inputStat) != 0) {
+		throw_perror("Error when getting information about file");
+	}
+	if ((uint64_t)inputStat.st_size < offset) {
+		throw_error("Input file is shorter than the output (truncated or replaced?)");
+	}
+
+	for (uint64_t end = inputStat.st_size; offset < end;) {
+		size_t size = end - offset < chunkSize ? end - offset : chunkSize;
+
+		TRACE_BEGIN(readStart);
+		if (!pread_all(inputFd, buffer, size, offset)) {
+			throw_perror("An error occurred when reading input file");
+		}
+		TRACE_END("read chunk", readStart, size);
+
+		TRACE_BEGIN(cryptStart);
+		salsa20_crypt_offset(size, buffer, buffer, key, nonce, offset);
+		TRACE_END("crypt chunk", cryptStart, size);
+
+		TRACE_BEGIN(writeStart);
+		if (!pwrite_all(outputFd, buffer, size, offset)) {
+			throw_perror("An error occurred when writing output");
+		}
+		TRACE_END("write chunk", writeStart, size);
+		offset += size;
+	}
+	return offset;
+}
+
+/*
+ * Opens the input and the output (created if missing) and returns the processed offset (length of the output)
+ */
+static uint64_t open_follow(const char* inputPath, const char* outputPath, int* inputFd, int* outputFd) {
+	*inputFd = open(inputPath, O_RDONLY | O_CLOEXEC);
+	if (*inputFd < 0) {
+		throw_perror("Error when opening input file");
+	}
+	*outputFd = open(outputPath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (*outputFd < 0) {
+		throw_perror("An error occurred when opening output file");
+	}
+	struct stat outputStat;
+	if (fstat(*outputFd, &outputStat) != 0) {
+		throw_perror("Error when getting information about file");
+	}
+	return outputStat.st_size;
+}
+
+static uint8_t* allocate_chunk(size_t chunkSize) {
+	if (chunkSize == 0) {
+		throw_error("Chunk size must be positive");
+	}
+	uint8_t* buffer = (uint8_t*)malloc(chunkSize);
+	if (buffer == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	return buffer;
+}
+
+/*
+ * Encrypts/decrypts everything appended to 'inputPath' since the last run into 'outputPath' once
+ * Returns the new processed offset
+ */
+uint64_t follow_crypt_appended(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, size_t chunkSize) {
+	int inputFd;
+	int outputFd;
+	uint8_t* buffer = allocate_chunk(chunkSize);
+	uint64_t offset = open_follow(inputPath, outputPath, &inputFd, &outputFd);
+	offset = catch_up(inputFd, outputFd, buffer, key, nonce, offset, chunkSize);
+	free(buffer);
+	close(inputFd);
+	if (close(outputFd) != 0) {
+		throw_perror("An error occurred when closing output file");
+	}
+	return offset;
+}
+
+/*
+ * Encrypts/decrypts what was appended to 'inputPath' since the last run, then waits for appends and encrypts them
+ * as they arrive, until the input is deleted or moved away (log rotation) or the process is killed
+ */
+void run_follow_crypt(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, size_t chunkSize) {
+	int inputFd;
+	int outputFd;
+	uint8_t* buffer = allocate_chunk(chunkSize);
+
+	// watch before the first catch-up, so no append between both is missed
+	int notifyFd = inotify_init1(IN_CLOEXEC);
+	if (notifyFd < 0) {
+		throw_perror("An error occurred when initializing inotify");
+	}
+	if (inotify_add_watch(notifyFd, inputPath, IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		throw_perror("An error occurred when watching input file");
+	}
+	uint64_t offset = open_follow(inputPath, outputPath, &inputFd, &outputFd);
+	printf("Following %s from offset %llu\n", inputPath, (unsigned long long)offset);
+	fflush(stdout);
+
+	// room for at least one event with a name (events of a watched file carry none)
+	char events[sizeof(struct inotify_event) + 256] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool isGone = false;
+	while (!isGone) {
+		offset = catch_up(inputFd, outputFd, buffer, key, nonce, offset, chunkSize);
+
+		ssize_t length = read(notifyFd, events, sizeof(events));
+		if (length < 0 && errno == EINTR) {
+			continue;
+		}
+		if (length <= 0) {
+			throw_perror("An error occurred when reading inotify events");
+		}
+		for (char* position = events; position < events + length;) {
+			struct inotify_event* event = (struct inotify_event*)position;
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				isGone = true;
+			}
+			position += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	// the open descriptor still reads the rotated file: take what was written before the rotation
+	offset = catch_up(inputFd, outputFd, buffer, key, nonce, offset, chunkSize);
+	printf("Input was moved or deleted, stopped at offset %llu\n", (unsigned long long)offset);
+	free(buffer);
+	close(notifyFd);
+	close(inputFd);
+	if (close(outputFd) != 0) {
+		throw_perror("An error occurred when closing output file");
+	}
+}
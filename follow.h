@@ -0,0 +1,9 @@
+#ifndef TEAM152_FOLLOW_H
+#define TEAM152_FOLLOW_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t follow_crypt_appended(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, size_t chunkSize);
+void run_follow_crypt(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, size_t chunkSize);
+#endif
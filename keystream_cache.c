@@ -0,0 +1,311 @@
+/*
+ * Sharded LRU cache of keystream runs (see keystream_cache.h)
+ * -> every shard owns a fixed array of entries with their keystream, a hash table of chained buckets
+ *    and a doubly linked LRU list (head = most recently used), all protected by the shard lock
+ */
+#include <emmintrin.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "keystream_cache.h"
+#include "salsa20.h"
+
+struct cache_entry {
+	uint32_t key[8];
+	uint64_t nonce;
+	uint64_t run;
+	uint64_t hash;
+	bool used;
+	// bucket chain, or the free list while unused
+	struct cache_entry* hashNext;
+	struct cache_entry* lruPrev;
+	struct cache_entry* lruNext;
+	uint8_t* keystream;
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry* entries;
+	size_t entryCount;
+	struct cache_entry** buckets;
+	size_t bucketMask;
+	struct cache_entry* lruHead;
+	struct cache_entry* lruTail;
+	struct cache_entry* freeList;
+	uint8_t* keystream;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t runs;
+	// keep neighbouring shard locks on different cache lines
+	char padding[64];
+};
+
+struct keystream_cache {
+	size_t runSize;
+	int shardCount;
+	struct cache_shard* shards;
+};
+
+/*
+ * 64-bit hash of (key, nonce, run)
+ */
+static uint64_t hash_run(const uint32_t key[8], uint64_t nonce, uint64_t run) {
+	uint64_t hash = nonce * 0x9e3779b97f4a7c15ULL ^ run * 0xc2b2ae3d27d4eb4fULL;
+	for (int i = 0; i < 8; i++) {
+		hash = (hash ^ key[i]) * 0x100000001b3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static struct cache_entry** bucket_of(struct cache_shard* shard, uint64_t hash) {
+	return &shard->buckets[(hash >> 16) & shard->bucketMask];
+}
+
+static struct cache_entry* lookup(struct cache_shard* shard, uint64_t hash, const uint32_t key[8], uint64_t nonce, uint64_t run) {
+	for (struct cache_entry* entry = *bucket_of(shard, hash); entry != NULL; entry = entry->hashNext) {
+		if (entry->hash == hash && entry->run == run && entry->nonce == nonce && memcmp(entry->key, key, sizeof(entry->key)) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void lru_unlink(struct cache_shard* shard, struct cache_entry* entry) {
+	if (entry->lruPrev != NULL) entry->lruPrev->lruNext = entry->lruNext;
+	else shard->lruHead = entry->lruNext;
+	if (entry->lruNext != NULL) entry->lruNext->lruPrev = entry->lruPrev;
+	else shard->lruTail = entry->lruPrev;
+}
+
+static void lru_push_front(struct cache_shard* shard, struct cache_entry* entry) {
+	entry->lruPrev = NULL;
+	entry->lruNext = shard->lruHead;
+	if (shard->lruHead != NULL) shard->lruHead->lruPrev = entry;
+	else shard->lruTail = entry;
+	shard->lruHead = entry;
+}
+
+/*
+ * Removes a cached run, wipes its keystream and returns the entry to the free list
+ */
+static void remove_entry(struct cache_shard* shard, struct cache_entry* entry, size_t runSize) {
+	struct cache_entry** link = bucket_of(shard, entry->hash);
+	while (*link != entry) {
+		link = &(*link)->hashNext;
+	}
+	*link = entry->hashNext;
+	lru_unlink(shard, entry);
+	memset(entry->keystream, 0, runSize);
+	memset(entry->key, 0, sizeof(entry->key));
+	entry->used = false;
+	entry->hashNext = shard->freeList;
+	shard->freeList = entry;
+	shard->runs--;
+}
+
+static void insert_entry(struct cache_shard* shard, uint64_t hash, const uint32_t key[8], uint64_t nonce, uint64_t run, const uint8_t* keystream, size_t runSize) {
+	if (shard->freeList == NULL) {
+		remove_entry(shard, shard->lruTail, runSize);
+		shard->evictions++;
+	}
+	struct cache_entry* entry = shard->freeList;
+	shard->freeList = entry->hashNext;
+	memcpy(entry->key, key, sizeof(entry->key));
+	entry->nonce = nonce;
+	entry->run = run;
+	entry->hash = hash;
+	entry->used = true;
+	memcpy(entry->keystream, keystream, runSize);
+	struct cache_entry** bucket = bucket_of(shard, hash);
+	entry->hashNext = *bucket;
+	*bucket = entry;
+	lru_push_front(shard, entry);
+	shard->runs++;
+}
+
+/*
+ * cipher = msg ^ keystream, 16 bytes per SIMD XOR
+ */
+static void xor_keystream(uint8_t* cipher, const uint8_t* msg, const uint8_t* keystream, size_t length) {
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		_mm_storeu_si128((__m128i*) (cipher + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*) (msg + i)), _mm_loadu_si128((const __m128i*) (keystream + i))));
+	}
+	for (; i < length; i++) {
+		cipher[i] = msg[i] ^ keystream[i];
+	}
+}
+
+/*
+ * Cache of at most 'capacity' bytes of keystream in runs of 'runSize' bytes (multiple of 64), split into 'shards' shards
+ * Returns NULL on invalid arguments or if memory can not be allocated
+ */
+struct keystream_cache* keystream_cache_create(size_t capacity, size_t runSize, int shards) {
+	if (runSize == 0 || runSize % 64 != 0 || runSize > KEYSTREAM_CACHE_MAX_RUN_SIZE || shards <= 0) {
+		return NULL;
+	}
+	struct keystream_cache* cache = (struct keystream_cache*)calloc(1, sizeof(struct keystream_cache));
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->runSize = runSize;
+	cache->shardCount = shards;
+	cache->shards = (struct cache_shard*)calloc(shards, sizeof(struct cache_shard));
+	if (cache->shards == NULL) {
+		free(cache);
+		return NULL;
+	}
+
+	// at least one run per shard
+	size_t entryCount = capacity / runSize / shards;
+	entryCount = entryCount > 0 ? entryCount : 1;
+	size_t bucketCount = 1;
+	while (bucketCount < entryCount * 2) {
+		bucketCount *= 2;
+	}
+	for (int s = 0; s < shards; s++) {
+		struct cache_shard* shard = &cache->shards[s];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->entryCount = entryCount;
+		shard->entries = (struct cache_entry*)calloc(entryCount, sizeof(struct cache_entry));
+		shard->buckets = (struct cache_entry**)calloc(bucketCount, sizeof(struct cache_entry*));
+		shard->bucketMask = bucketCount - 1;
+		shard->keystream = (uint8_t*)aligned_alloc(64, entryCount * runSize);
+		if (shard->entries == NULL || shard->buckets == NULL || shard->keystream == NULL) {
+			cache->shardCount = s + 1;
+			keystream_cache_destroy(cache);
+			return NULL;
+		}
+		for (size_t i = 0; i < entryCount; i++) {
+			shard->entries[i].keystream = shard->keystream + i * runSize;
+			shard->entries[i].hashNext = shard->freeList;
+			shard->freeList = &shard->entries[i];
+		}
+	}
+	return cache;
+}
+
+void keystream_cache_destroy(struct keystream_cache* cache) {
+	if (cache == NULL) {
+		return;
+	}
+	for (int s = 0; s < cache->shardCount; s++) {
+		struct cache_shard* shard = &cache->shards[s];
+		if (shard->keystream != NULL) {
+			memset(shard->keystream, 0, shard->entryCount * cache->runSize);
+		}
+		free(shard->keystream);
+		free(shard->entries);
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache->shards);
+	free(cache);
+}
+
+/*
+ * Encryption / Decryption of a message that starts 'offset' bytes into the keystream of (key, iv),
+ * every run of the range comes from the cache or is computed and cached
+ */
+void keystream_cache_crypt(struct keystream_cache* cache, size_t mlen, const uint8_t* msg, uint8_t* cipher, uint32_t key[8], uint64_t iv, uint64_t offset) {
+	const size_t runSize = cache->runSize;
+	uint8_t* scratch = NULL;
+
+	for (size_t done = 0; done < mlen;) {
+		uint64_t run = (offset + done) / runSize;
+		size_t skip = (offset + done) % runSize;
+		size_t length = mlen - done < runSize - skip ? mlen - done : runSize - skip;
+		uint64_t hash = hash_run(key, iv, run);
+		struct cache_shard* shard = &cache->shards[hash % cache->shardCount];
+
+		pthread_mutex_lock(&shard->lock);
+		struct cache_entry* entry = lookup(shard, hash, key, iv, run);
+		if (entry != NULL) {
+			shard->hits++;
+			if (shard->lruHead != entry) {
+				lru_unlink(shard, entry);
+				lru_push_front(shard, entry);
+			}
+			xor_keystream(cipher + done, msg + done, entry->keystream + skip, length);
+			pthread_mutex_unlock(&shard->lock);
+			done += length;
+			continue;
+		}
+		shard->misses++;
+		pthread_mutex_unlock(&shard->lock);
+
+		// computed outside the lock, another thread may cache the same run meanwhile
+		if (scratch == NULL) {
+			scratch = (uint8_t*)aligned_alloc(64, runSize);
+			if (scratch == NULL) {
+				salsa20_crypt_offset(mlen - done, msg + done, cipher + done, key, iv, offset + done);
+				return;
+			}
+		}
+		memset(scratch, 0, runSize);
+		salsa20_crypt_offset(runSize, scratch, scratch, key, iv, run * runSize);
+		xor_keystream(cipher + done, msg + done, scratch + skip, length);
+
+		pthread_mutex_lock(&shard->lock);
+		if (lookup(shard, hash, key, iv, run) == NULL) {
+			insert_entry(shard, hash, key, iv, run, scratch, runSize);
+		}
+		pthread_mutex_unlock(&shard->lock);
+		done += length;
+	}
+
+	if (scratch != NULL) {
+		memset(scratch, 0, runSize);
+		free(scratch);
+	}
+}
+
+/*
+ * Drops every cached run of 'key' (all nonces), returns the number of runs dropped
+ */
+uint64_t keystream_cache_evict_key(struct keystream_cache* cache, uint32_t key[8]) {
+	uint64_t evicted = 0;
+	for (int s = 0; s < cache->shardCount; s++) {
+		struct cache_shard* shard = &cache->shards[s];
+		pthread_mutex_lock(&shard->lock);
+		for (size_t i = 0; i < shard->entryCount; i++) {
+			struct cache_entry* entry = &shard->entries[i];
+			if (entry->used && memcmp(entry->key, key, sizeof(entry->key)) == 0) {
+				remove_entry(shard, entry, cache->runSize);
+				evicted++;
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return evicted;
+}
+
+void keystream_cache_clear(struct keystream_cache* cache) {
+	for (int s = 0; s < cache->shardCount; s++) {
+		struct cache_shard* shard = &cache->shards[s];
+		pthread_mutex_lock(&shard->lock);
+		while (shard->lruHead != NULL) {
+			remove_entry(shard, shard->lruHead, cache->runSize);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void keystream_cache_get_stats(struct keystream_cache* cache, struct keystream_cache_stats* stats) {
+	memset(stats, 0, sizeof(*stats));
+	for (int s = 0; s < cache->shardCount; s++) {
+		struct cache_shard* shard = &cache->shards[s];
+		pthread_mutex_lock(&shard->lock);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->runs += shard->runs;
+		stats->capacityRuns += shard->entryCount;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
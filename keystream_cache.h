@@ -0,0 +1,37 @@
+#ifndef TEAM152_KEYSTREAM_CACHE_H
+#define TEAM152_KEYSTREAM_CACHE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Keystream cache for repeated random-access reads of hot ranges
+ *
+ * The keystream of (key, nonce) is cached in aligned runs of 'runSize' bytes (run r covers the keystream bytes
+ * [r * runSize, (r + 1) * runSize)). The cache is split into shards by the hash of (key, nonce, run), every shard
+ * is a fixed-size LRU with its own lock, so memory stays bounded by 'capacity' bytes of keystream.
+ * A hit costs one XOR of the cached keystream into the output, a miss computes the run with the multi-block kernel.
+ *
+ * Cached keystream is as secret as the key: evict the key (keystream_cache_evict_key) when it is retired.
+ */
+#define KEYSTREAM_CACHE_DEFAULT_RUN_SIZE 4096
+#define KEYSTREAM_CACHE_MAX_RUN_SIZE (1 << 20)
+
+struct keystream_cache;
+
+struct keystream_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	// runs currently cached and their capacity
+	uint64_t runs;
+	uint64_t capacityRuns;
+};
+
+struct keystream_cache* keystream_cache_create(size_t capacity, size_t runSize, int shards);
+void keystream_cache_destroy(struct keystream_cache* cache);
+void keystream_cache_crypt(struct keystream_cache* cache, size_t mlen, const uint8_t* msg, uint8_t* cipher, uint32_t key[8], uint64_t iv, uint64_t offset);
+uint64_t keystream_cache_evict_key(struct keystream_cache* cache, uint32_t key[8]);
+void keystream_cache_clear(struct keystream_cache* cache);
+void keystream_cache_get_stats(struct keystream_cache* cache, struct keystream_cache_stats* stats);
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Load generator for the salsa20 daemon
+ * -> every connection keeps 'depth' requests in flight and records the latency of each response
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "salsa20.h"
+#include "server.h"
+#include "utils.h"
+
+struct loadgen_worker {
+	const struct loadgen_options* options;
+	int index;
+	uint64_t* latencies;
+	size_t latencyCount;
+	size_t latencyCapacity;
+	uint64_t mismatches;
+	bool failed;
+};
+
+static bool send_all(int fd, const uint8_t* buffer, size_t length) {
+	while (length > 0) {
+		ssize_t written = send(fd, buffer, length, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		buffer += written;
+		length -= written;
+	}
+	return true;
+}
+
+static bool receive_all(int fd, uint8_t* buffer, size_t length) {
+	while (length > 0) {
+		ssize_t received = recv(fd, buffer, length, 0);
+		if (received <= 0) {
+			if (received < 0 && errno == EINTR) continue;
+			return false;
+		}
+		buffer += received;
+		length -= received;
+	}
+	return true;
+}
+
+static void record_latency(struct loadgen_worker* worker, uint64_t latency) {
+	if (worker->latencyCount == worker->latencyCapacity) {
+		worker->latencyCapacity = worker->latencyCapacity ? worker->latencyCapacity * 2 : 4096;
+		worker->latencies = (uint64_t*)realloc(worker->latencies, worker->latencyCapacity * sizeof(uint64_t));
+		if (worker->latencies == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+	}
+	worker->latencies[worker->latencyCount++] = latency;
+}
+
+static void* run_connection(void* argument) {
+	struct loadgen_worker* worker = (struct loadgen_worker*)argument;
+	const struct loadgen_options* options = worker->options;
+	const size_t payloadSize = options->payloadSize;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	strcpy(address.sun_path, options->socketPath);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		perror("An error occurred when connecting to the server");
+		worker->failed = true;
+		return NULL;
+	}
+
+	// one frame per connection, sent repeatedly; its ciphertext is known in advance
+	uint32_t key[8];
+	uint64_t nonce = 0x9e3779b97f4a7c15ULL * (worker->index + 1);
+	uint8_t* frame = (uint8_t*)malloc(SERVER_REQUEST_HEADER_SIZE + payloadSize);
+	uint8_t* expected = (uint8_t*)malloc(payloadSize + 1);
+	uint8_t* response = (uint8_t*)malloc(payloadSize + 1);
+	uint64_t* sendTimes = (uint64_t*)malloc(options->depth * sizeof(uint64_t));
+	if (frame == NULL || expected == NULL || response == NULL || sendTimes == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	for (int k = 0; k < 8; k++) {
+		key[k] = 0x01000193U * (worker->index + 1) + k;
+	}
+	uint32_t length = payloadSize;
+	memcpy(frame, &length, 4);
+	memcpy(frame + 4, key, 32);
+	memcpy(frame + 36, &nonce, 8);
+	uint8_t* payload = frame + SERVER_REQUEST_HEADER_SIZE;
+	for (size_t i = 0; i < payloadSize; i++) {
+		payload[i] = (uint8_t)(i * 131 + worker->index);
+	}
+	salsa20_crypt(payloadSize, payload, expected, key, nonce);
+
+	const uint64_t end = monotonic_ns() + (uint64_t)(options->duration * 1e9);
+	size_t head = 0;
+	size_t inFlight = 0;
+	bool sending = true;
+
+	// fill the pipeline, then send one request per received response until the time is up
+	while (sending || inFlight > 0) {
+		while (sending && inFlight < (size_t)options->depth) {
+			sendTimes[(head + inFlight) % options->depth] = monotonic_ns();
+			if (!send_all(fd, frame, SERVER_REQUEST_HEADER_SIZE + payloadSize)) {
+				worker->failed = true;
+				goto done;
+			}
+			inFlight++;
+		}
+		uint32_t responseLength;
+		if (!receive_all(fd, (uint8_t*)&responseLength, 4) || responseLength != payloadSize
+			|| !receive_all(fd, response, payloadSize)) {
+			worker->failed = true;
+			goto done;
+		}
+		uint64_t received = monotonic_ns();
+		record_latency(worker, received - sendTimes[head]);
+		if (memcmp(response, expected, payloadSize) != 0) {
+			worker->mismatches++;
+		}
+		head = (head + 1) % options->depth;
+		inFlight--;
+		sending = received < end;
+	}
+
+done:
+	close(fd);
+	free(frame);
+	free(expected);
+	free(response);
+	free(sendTimes);
+	return NULL;
+}
+
+static int compare_uint64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Runs the configured number of connections against a running daemon and prints requests/sec and latency percentiles
+ */
+void run_loadgen(const struct loadgen_options* options) {
+	if (options->connections <= 0 || options->depth <= 0) {
+		throw_error("Connections and pipeline depth must be positive");
+	}
+	if (options->payloadSize == 0) {
+		throw_error("Payload size must be positive");
+	}
+	if (options->payloadSize > SERVER_MAX_PAYLOAD) {
+		throw_error("Payload size is too big");
+	}
+	if (options->duration <= 0) {
+		throw_error("Duration must be positive");
+	}
+	struct sockaddr_un address;
+	if (strlen(options->socketPath) >= sizeof(address.sun_path)) {
+		throw_error("Socket path is too long");
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	struct loadgen_worker* workers = (struct loadgen_worker*)calloc(options->connections, sizeof(struct loadgen_worker));
+	pthread_t* threads = (pthread_t*)calloc(options->connections, sizeof(pthread_t));
+	if (workers == NULL || threads == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+
+	const uint64_t start = monotonic_ns();
+	for (int i = 0; i < options->connections; i++) {
+		workers[i].options = options;
+		workers[i].index = i;
+		if (pthread_create(&threads[i], NULL, run_connection, &workers[i]) != 0) {
+			throw_error("An error occurred when creating a thread");
+		}
+	}
+	for (int i = 0; i < options->connections; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	const double elapsed = (monotonic_ns() - start) * 1e-9;
+
+	// merge all latencies for the percentiles
+	size_t total = 0;
+	uint64_t mismatches = 0;
+	int failed = 0;
+	for (int i = 0; i < options->connections; i++) {
+		total += workers[i].latencyCount;
+		mismatches += workers[i].mismatches;
+		failed += workers[i].failed;
+	}
+	uint64_t* latencies = (uint64_t*)malloc((total ? total : 1) * sizeof(uint64_t));
+	if (latencies == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	size_t position = 0;
+	for (int i = 0; i < options->connections; i++) {
+		memcpy(latencies + position, workers[i].latencies, workers[i].latencyCount * sizeof(uint64_t));
+		position += workers[i].latencyCount;
+		free(workers[i].latencies);
+	}
+	qsort(latencies, total, sizeof(uint64_t), compare_uint64);
+
+	printf("connections: %d | depth: %d | payload: %zu bytes | duration: %.2f s\n",
+		options->connections, options->depth, options->payloadSize, elapsed);
+	printf("requests: %zu | requests/sec: %.0f | MB/s: %.1f\n",
+		total, total / elapsed, total * (double)options->payloadSize / elapsed / 1e6);
+	if (total > 0) {
+		printf("latency us: p50 %.1f | p99 %.1f | p99.9 %.1f | max %.1f\n",
+			latencies[total / 2] * 1e-3, latencies[total * 99 / 100] * 1e-3,
+			latencies[total * 999 / 1000] * 1e-3, latencies[total - 1] * 1e-3);
+	}
+	if (mismatches > 0 || failed > 0) {
+		printf("errors: %llu wrong responses, %d failed connections\n", (unsigned long long)mismatches, failed);
+	}
+
+	free(latencies);
+	free(workers);
+	free(threads);
+	if (mismatches > 0 || failed > 0) {
+		exit(1);
+	}
+}
@@ -6,14 +6,75 @@
 #include <time.h> // timespec
 #include <stdlib.h> // EXIT_SUCCESS
 #include <stdbool.h>
+#include <unistd.h> // sysconf
 #include "utils.h"
 #include "salsa20.h"
 #include "tests.h"
+#include "benchmark.h"
+#include "trace.h"
+#include "server.h"
+#include "parallel.h"
+#include "container.h"
+#include "autotune.h"
+#include "range.h"
+#include "follow.h"
+#include "fanout.h"
+#include "stats.h"
+#include "regression.h"
+
+// values of long options without a short option
+enum {
+	OPTION_BENCH_CORE = 256,
+	OPTION_TRACE,
+	OPTION_SERVE,
+	OPTION_LOADGEN,
+	OPTION_THREADS,
+	OPTION_CONNECTIONS,
+	OPTION_DEPTH,
+	OPTION_SIZE,
+	OPTION_DURATION,
+	OPTION_NUMA,
+	OPTION_CHUNK_SIZE,
+	OPTION_PACK,
+	OPTION_UNPACK,
+	OPTION_UNPACK_CHUNK,
+	OPTION_TUNE,
+	OPTION_PLAN,
+	OPTION_OFFSET,
+	OPTION_LENGTH,
+	OPTION_SHARDS,
+	OPTION_STATS,
+	OPTION_BENCH_STATS,
+	OPTION_BENCH_CACHE,
+	OPTION_BENCH_ASYNC,
+	OPTION_FOLLOW,
+	OPTION_BENCH_CRC,
+	OPTION_RECIPIENT,
+	OPTION_BENCH_FANOUT,
+	OPTION_NEW_KEY,
+	OPTION_NEW_NONCE,
+	OPTION_BENCH_SAVE,
+	OPTION_BENCH_COMPARE,
+	OPTION_BENCH_THRESHOLD,
+	OPTION_BENCH_GATHER,
+};
+
+/*
+ * Prints the phase breakdown (-P) and writes the trace file (--trace) if requested
+ */
+static void finish_trace(bool isPhaseTimingSet, const char* traceFileString) {
+	if (isPhaseTimingSet) {
+		trace_print_summary();
+	}
+	if (traceFileString != NULL && trace_write_chrome(traceFileString) != 0) {
+		throw_perror("An error occurred when writing the trace file");
+	}
+}
 
 int main(int argc, char* argv[]) {
 
 	// Function Pointer
-	void (*salsa20CryptFunctions[])(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) = { salsa20_crypt, salsa20_crypt_V1, salsa20_crypt_V2, salsa20_crypt_V3};
+	void (*salsa20CryptFunctions[])(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) = { salsa20_crypt, salsa20_crypt_V1, salsa20_crypt_V2, salsa20_crypt_V3, salsa20_crypt_V4 };
 
 	const int versionCount = sizeof(salsa20CryptFunctions) / sizeof(salsa20CryptFunctions[0]);
 
@@ -25,26 +86,139 @@ int main(int argc, char* argv[]) {
 		'h' // val
 	};
 
+	const struct option benchCoreOption = {
+		"bench-core", // name
+		2, // has_arg? (optional: blocks per trial)
+		NULL, // flag
+		OPTION_BENCH_CORE // val
+	};
+
+	const struct option traceOption = {
+		"trace", // name
+		1, // has_arg?
+		NULL, // flag
+		OPTION_TRACE // val
+	};
+
+	// daemon and load generator (name, has_arg, flag, val)
+	const struct option serveOption = { "serve", 1, NULL, OPTION_SERVE };
+	const struct option loadgenOption = { "loadgen", 1, NULL, OPTION_LOADGEN };
+	const struct option threadsOption = { "threads", 1, NULL, OPTION_THREADS };
+	const struct option connectionsOption = { "connections", 1, NULL, OPTION_CONNECTIONS };
+	const struct option depthOption = { "depth", 1, NULL, OPTION_DEPTH };
+	const struct option sizeOption = { "size", 1, NULL, OPTION_SIZE };
+	const struct option durationOption = { "duration", 1, NULL, OPTION_DURATION };
+
+	// NUMA-aware parallel mode
+	const struct option numaOption = { "numa", 0, NULL, OPTION_NUMA };
+	const struct option chunkSizeOption = { "chunk-size", 1, NULL, OPTION_CHUNK_SIZE };
+
+	// chunked container
+	const struct option packOption = { "pack", 0, NULL, OPTION_PACK };
+	const struct option unpackOption = { "unpack", 0, NULL, OPTION_UNPACK };
+	const struct option unpackChunkOption = { "unpack-chunk", 1, NULL, OPTION_UNPACK_CHUNK };
+
+	// autotuning
+	const struct option tuneOption = { "tune", 0, NULL, OPTION_TUNE };
+	const struct option planOption = { "plan", 0, NULL, OPTION_PLAN };
+
+	// byte ranges
+	const struct option offsetOption = { "offset", 1, NULL, OPTION_OFFSET };
+	const struct option lengthOption = { "length", 1, NULL, OPTION_LENGTH };
+	const struct option shardsOption = { "shards", 1, NULL, OPTION_SHARDS };
+
+	// growing files
+	const struct option followOption = { "follow", 0, NULL, OPTION_FOLLOW };
+
+	// instrumentation (stats.h)
+	const struct option statsOption = { "stats", 0, NULL, OPTION_STATS };
+	const struct option benchStatsOption = { "bench-stats", 0, NULL, OPTION_BENCH_STATS };
+
+	// keystream cache
+	const struct option benchCacheOption = { "bench-cache", 2, NULL, OPTION_BENCH_CACHE };
+
+	// async engine
+	const struct option benchAsyncOption = { "bench-async", 0, NULL, OPTION_BENCH_ASYNC };
+
+	// fused crypt + CRC32C
+	const struct option benchCrcOption = { "bench-crc", 0, NULL, OPTION_BENCH_CRC };
+
+	// multi-recipient fan-out
+	const struct option recipientOption = { "recipient", 1, NULL, OPTION_RECIPIENT };
+	const struct option benchFanoutOption = { "bench-fanout", 2, NULL, OPTION_BENCH_FANOUT };
+
+	// key rotation (transcrypt)
+	const struct option newKeyOption = { "new-key", 1, NULL, OPTION_NEW_KEY };
+	const struct option newNonceOption = { "new-nonce", 1, NULL, OPTION_NEW_NONCE };
+
+	// benchmark regression gate
+	const struct option benchSaveOption = { "bench-save", 1, NULL, OPTION_BENCH_SAVE };
+	const struct option benchCompareOption = { "bench-compare", 1, NULL, OPTION_BENCH_COMPARE };
+	const struct option benchThresholdOption = { "bench-threshold", 1, NULL, OPTION_BENCH_THRESHOLD };
+
+	// sparse records
+	const struct option benchGatherOption = { "bench-gather", 2, NULL, OPTION_BENCH_GATHER };
+
 	const struct option emptyOption = { 0,0,0,0 };
-	const struct option longOptions[] = { helpOption, emptyOption };
+	const struct option longOptions[] = {
+		helpOption, benchCoreOption, traceOption,
+		serveOption, loadgenOption, threadsOption, connectionsOption, depthOption, sizeOption, durationOption,
+		numaOption, chunkSizeOption,
+		packOption, unpackOption, unpackChunkOption,
+		tuneOption, planOption,
+		offsetOption, lengthOption, shardsOption, followOption, recipientOption, newKeyOption, newNonceOption,
+		statsOption, benchStatsOption, benchCacheOption, benchAsyncOption, benchCrcOption, benchFanoutOption,
+		benchSaveOption, benchCompareOption, benchThresholdOption, benchGatherOption,
+		emptyOption
+	};
 
 	// Variables
 	long long version = 0;
 	long long benchmarkRepetitions = 0;
 	char* inputFileString = NULL;
 	char* outputFileString = "out.txt";
+	char* traceFileString = NULL;
 	uint32_t key[8] = {0};
 	uint64_t nonce = 0;
 	bool isBenchmarkSet = false;
 	bool isKeySet = false;
 	bool isNonceSet = false;
+	bool isPhaseTimingSet = false;
+	char* serveSocketString = NULL;
+	long long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	struct loadgen_options loadgenOptions = { NULL, 4, 1, 1024, 5.0 };
+	bool isNumaSet = false;
+	unsigned long long chunkSize = PARALLEL_DEFAULT_CHUNK_SIZE;
+	bool isPackSet = false;
+	bool isUnpackSet = false;
+	long long unpackChunk = -1;
+	bool isVersionSet = false;
+	bool isPlanSet = false;
+	bool isRangeSet = false;
+	unsigned long long rangeOffset = 0;
+	unsigned long long rangeLength = 0;
+	long long shardCount = 0;
+	bool isTuneSet = false;
+	bool isBenchAsyncSet = false;
+	bool isFollowSet = false;
+	struct salsa20_recipient* recipients = NULL;
+	char** recipientOutputs = NULL;
+	int recipientCount = 0;
+	uint32_t newKey[8] = {0};
+	uint64_t newNonce = 0;
+	bool isNewKeySet = false;
+	bool isNewNonceSet = false;
+	char* benchSaveString = NULL;
+	char* benchCompareString = NULL;
+	double benchThreshold = REGRESSION_DEFAULT_THRESHOLD;
 
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, "TV:B:k:i:o:h", longOptions, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "TV:B:k:i:o:Ph", longOptions, NULL)) != -1) {
 		switch (opt) {
 		case 'V':
 			version = get_long_long(optarg, "Supplied version number is not a number");	
+			isVersionSet = true;
 			break;
 		case 'B':
 			benchmarkRepetitions = get_long_long(optarg, "Supplied repetiton number is not correct");
@@ -64,6 +238,186 @@ int main(int argc, char* argv[]) {
 		case 'o':
 			outputFileString = optarg;
 			break;
+		case 'P':
+			isPhaseTimingSet = true;
+			break;
+		case OPTION_TRACE:
+			traceFileString = optarg;
+			break;
+		case OPTION_SERVE:
+			serveSocketString = optarg;
+			break;
+		case OPTION_LOADGEN:
+			loadgenOptions.socketPath = optarg;
+			break;
+		case OPTION_THREADS:
+			threadCount = get_long_long(optarg, "Supplied thread count is not a number");
+			if (threadCount <= 0 || threadCount > 4096) {
+				throw_error("Thread count must be between 1 and 4096");
+			}
+			break;
+		case OPTION_CONNECTIONS:
+			loadgenOptions.connections = get_long_long(optarg, "Supplied connection count is not a number");
+			break;
+		case OPTION_DEPTH:
+			loadgenOptions.depth = get_long_long(optarg, "Supplied pipeline depth is not a number");
+			break;
+		case OPTION_SIZE:
+			loadgenOptions.payloadSize = get_unsigned_long_long(optarg, "Supplied payload size is not a number");
+			break;
+		case OPTION_DURATION:
+			loadgenOptions.duration = get_double(optarg, "Supplied duration is not a number");
+			break;
+		case OPTION_NUMA:
+			isNumaSet = true;
+			break;
+		case OPTION_CHUNK_SIZE:
+			chunkSize = get_unsigned_long_long(optarg, "Supplied chunk size is not a number");
+			break;
+		case OPTION_PACK:
+			isPackSet = true;
+			break;
+		case OPTION_UNPACK:
+			isUnpackSet = true;
+			break;
+		case OPTION_TUNE:
+			isTuneSet = true;
+			break;
+		case OPTION_PLAN:
+			isPlanSet = true;
+			break;
+		case OPTION_OFFSET:
+			isRangeSet = true;
+			rangeOffset = get_unsigned_long_long(optarg, "Supplied offset is not a number");
+			break;
+		case OPTION_LENGTH:
+			isRangeSet = true;
+			rangeLength = get_unsigned_long_long(optarg, "Supplied length is not a number");
+			if (rangeLength == 0) {
+				throw_error("Length must be positive");
+			}
+			break;
+		case OPTION_FOLLOW:
+			isFollowSet = true;
+			break;
+		case OPTION_SHARDS:
+			shardCount = get_long_long(optarg, "Supplied shard count is not a number");
+			if (shardCount <= 0 || shardCount > 4096) {
+				throw_error("Shard count must be between 1 and 4096");
+			}
+			break;
+		case OPTION_UNPACK_CHUNK:
+			isUnpackSet = true;
+			unpackChunk = get_long_long(optarg, "Supplied chunk index is not a number");
+			if (unpackChunk < 0) {
+				throw_error("Chunk index can not be negative");
+			}
+			break;
+		case OPTION_STATS:
+			// printed on every way out, including the modes that exit on their own
+			atexit(salsa20_stats_print);
+			break;
+		case OPTION_BENCH_STATS:
+			exit(run_stats_benchmark() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+		case OPTION_RECIPIENT: {
+			// <KEY>:<NONCE>:<OUTPUT>
+			char* nonceString = strchr(optarg, ':');
+			char* outputString = nonceString != NULL ? strchr(nonceString + 1, ':') : NULL;
+			if (outputString == NULL || outputString[1] == '\0') {
+				throw_error("A recipient must be given as <KEY>:<NONCE>:<OUTPUT>");
+			}
+			if (recipientCount == FANOUT_MAX_RECIPIENTS) {
+				throw_error("Too many recipients specified");
+			}
+			if (recipients == NULL) {
+				recipients = (struct salsa20_recipient*)calloc(FANOUT_MAX_RECIPIENTS, sizeof(struct salsa20_recipient));
+				recipientOutputs = (char**)calloc(FANOUT_MAX_RECIPIENTS, sizeof(char*));
+				if (recipients == NULL || recipientOutputs == NULL) {
+					throw_perror("An error occurred when allocating memory");
+				}
+			}
+			*nonceString = '\0';
+			*outputString = '\0';
+			parseKey(optarg, recipients[recipientCount].key);
+			recipients[recipientCount].nonce = parseNonce(nonceString + 1);
+			recipientOutputs[recipientCount] = outputString + 1;
+			recipientCount++;
+			break;
+		}
+		case OPTION_NEW_KEY:
+			parseKey(optarg, newKey);
+			isNewKeySet = true;
+			break;
+		case OPTION_NEW_NONCE:
+			newNonce = parseNonce(optarg);
+			isNewNonceSet = true;
+			break;
+		case OPTION_BENCH_SAVE:
+			benchSaveString = optarg;
+			break;
+		case OPTION_BENCH_COMPARE:
+			benchCompareString = optarg;
+			break;
+		case OPTION_BENCH_THRESHOLD:
+			benchThreshold = get_double(optarg, "Supplied threshold is not a number");
+			if (benchThreshold < 0) {
+				throw_error("Threshold can not be negative");
+			}
+			break;
+		case OPTION_BENCH_GATHER:
+			if (optarg != NULL) {
+				long long rows = get_long_long(optarg, "Supplied row count is not a number");
+				if (rows <= 0) {
+					throw_error("Too few rows specified");
+				}
+				run_gather_benchmark(rows);
+			}
+			else {
+				run_gather_benchmark(1 << 16);
+			}
+			exit(0);
+		case OPTION_BENCH_FANOUT:
+			if (optarg != NULL) {
+				long long count = get_long_long(optarg, "Supplied recipient count is not a number");
+				if (count <= 0 || count > FANOUT_MAX_RECIPIENTS) {
+					throw_error("Recipient count must be between 1 and 1024");
+				}
+				run_fanout_benchmark(count);
+			}
+			else {
+				run_fanout_benchmark(8);
+			}
+			exit(0);
+		case OPTION_BENCH_CRC:
+			run_crc_benchmark();
+			exit(0);
+		case OPTION_BENCH_ASYNC:
+			isBenchAsyncSet = true;
+			break;
+		case OPTION_BENCH_CACHE:
+			if (optarg != NULL) {
+				long long reads = get_long_long(optarg, "Supplied read count is not a number");
+				if (reads <= 0) {
+					throw_error("Too few reads specified");
+				}
+				run_cache_benchmark(reads);
+			}
+			else {
+				run_cache_benchmark(200000);
+			}
+			exit(0);
+		case OPTION_BENCH_CORE:
+			if (optarg != NULL) {
+				long long blocks = get_long_long(optarg, "Supplied block count is not a number");
+				if (blocks <= 0) {
+					throw_error("Too few blocks specified");
+				}
+				run_core_benchmark(blocks);
+			}
+			else {
+				run_core_benchmark(1 << 16);
+			}
+			exit(0);
 		case 'h':
 			print_help();
 			if (argc == 2) return EXIT_SUCCESS;
@@ -74,7 +428,61 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
-	if (version < 0 || version > versionCount) {
+	// modes without key, nonce and input file
+	if (serveSocketString != NULL) {
+		run_server(serveSocketString, threadCount);
+	}
+	if (loadgenOptions.socketPath != NULL) {
+		run_loadgen(&loadgenOptions);
+		return EXIT_SUCCESS;
+	}
+
+	// after parsing, so --bench-threshold applies
+	if (benchSaveString != NULL) {
+		if (regression_save(benchSaveString) != 0) {
+			throw_perror("An error occurred when writing the baseline");
+		}
+		return EXIT_SUCCESS;
+	}
+	if (benchCompareString != NULL) {
+		int regressions = regression_compare(benchCompareString, benchThreshold);
+		if (regressions < 0) {
+			throw_perror("An error occurred when reading the baseline");
+		}
+		return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	// after parsing, so --threads applies
+	if (isBenchAsyncSet) {
+		run_async_benchmark(threadCount);
+		return EXIT_SUCCESS;
+	}
+
+	if (isTuneSet) {
+		struct tune_profile profile;
+		printf("Tuning (up to %lld threads), this takes a few seconds...\n", threadCount);
+		tune_run(&profile, threadCount);
+		if (tune_profile_save(&profile) != 0) {
+			throw_perror("An error occurred when writing the profile");
+		}
+		tune_print_profile(&profile);
+		tune_profile_free(&profile);
+		return EXIT_SUCCESS;
+	}
+
+	// --plan without input: show the stored profile
+	if (isPlanSet && optind >= argc) {
+		struct tune_profile profile;
+		if (!tune_profile_load(&profile)) {
+			printf("No profile for this CPU at %s, run --tune first (version 0 is used)\n", tune_profile_path());
+			return EXIT_SUCCESS;
+		}
+		tune_print_profile(&profile);
+		tune_profile_free(&profile);
+		return EXIT_SUCCESS;
+	}
+
+	if (version < 0 || version >= versionCount) {
 		char error[71] = {0};
 		snprintf(error, 71, "%s %d", "Version does not exist, make sure to specify a version between 0 and", versionCount - 1);
 		throw_error(error);
@@ -82,10 +490,26 @@ int main(int argc, char* argv[]) {
 	if (benchmarkRepetitions < 0) {
 		throw_error("Too few repetitions specified");
 	}
+	// fan-out: keys and nonces come with the recipients
+	if (recipientCount > 0) {
+		if (optind + 1 != argc) {
+			throw_error("Exactly one input file must be specified");
+		}
+		if (isPhaseTimingSet || traceFileString != NULL) {
+			trace_enable(1 << 20);
+		}
+		run_fanout_crypt(argv[optind], recipients, recipientOutputs, recipientCount, chunkSize);
+		finish_trace(isPhaseTimingSet, traceFileString);
+		free(recipients);
+		free(recipientOutputs);
+		return EXIT_SUCCESS;
+	}
+
 	if(!isKeySet) {
 		throw_error("Key is not specified");
 	}
-	if(!isNonceSet) {
+	// the nonce of a container is stored in its header
+	if(!isNonceSet && !isUnpackSet) {
 		throw_error("Initialization vector is not specified");
 	}
 	if (optind >= argc) {
@@ -95,15 +519,77 @@ int main(int argc, char* argv[]) {
 		throw_error("Too many (positional) arguments specified");
 	}
 	inputFileString = argv[optind];
+	// key rotation: -k/-i decrypt, --new-key/--new-nonce encrypt, in one pass
+	if (isNewKeySet != isNewNonceSet) {
+		throw_error("--new-key and --new-nonce must be specified together");
+	}
+	if (isNewKeySet && (isFollowSet || isPackSet || isUnpackSet)) {
+		throw_error("--new-key can not be combined with --follow, --pack or --unpack");
+	}
+	uint32_t* rekey = isNewKeySet ? newKey : NULL;
+
+	// one event per phase plus one per crypt call (chunked modes: up to three per chunk and pass)
+	if (isPhaseTimingSet || traceFileString != NULL) {
+		trace_enable(isNumaSet || isPackSet || isUnpackSet || isRangeSet || shardCount > 0 || isFollowSet ? 1 << 20 : benchmarkRepetitions + 16);
+	}
+
+	if (isFollowSet) {
+		if (isNumaSet || isPackSet || isUnpackSet || isRangeSet || shardCount > 0) {
+			throw_error("--follow can not be combined with --numa, --pack, --unpack, --offset, --length or --shards");
+		}
+		run_follow_crypt(inputFileString, outputFileString, key, nonce, chunkSize);
+		finish_trace(isPhaseTimingSet, traceFileString);
+		return EXIT_SUCCESS;
+	}
+
+	if (isPackSet || isUnpackSet) {
+		if (isPackSet && isUnpackSet) {
+			throw_error("--pack and --unpack can not be combined");
+		}
+		if (isPackSet) {
+			container_pack(inputFileString, outputFileString, key, nonce, chunkSize > UINT32_MAX ? 0 : chunkSize, threadCount);
+		}
+		else if (unpackChunk >= 0) {
+			container_unpack_chunk(inputFileString, outputFileString, key, unpackChunk);
+		}
+		else {
+			container_unpack(inputFileString, outputFileString, key, threadCount);
+		}
+		finish_trace(isPhaseTimingSet, traceFileString);
+		return EXIT_SUCCESS;
+	}
+
+	if (isRangeSet || shardCount > 0) {
+		if (isNumaSet || isPackSet || isUnpackSet) {
+			throw_error("--offset, --length and --shards can not be combined with --numa, --pack or --unpack");
+		}
+		if (shardCount > 0) {
+			run_sharded_crypt(inputFileString, outputFileString, key, nonce, rekey, newNonce, rangeOffset, rangeLength, shardCount, chunkSize);
+		}
+		else {
+			run_range_crypt(inputFileString, outputFileString, key, nonce, rekey, newNonce, rangeOffset, rangeLength, chunkSize);
+		}
+		finish_trace(isPhaseTimingSet, traceFileString);
+		return EXIT_SUCCESS;
+	}
+
+	if (isNumaSet) {
+		run_parallel_crypt(inputFileString, outputFileString, key, nonce, rekey, newNonce, threadCount, chunkSize, benchmarkRepetitions);
+		finish_trace(isPhaseTimingSet, traceFileString);
+		return EXIT_SUCCESS;
+	}
 
 	// open input file
 	// https://man7.org/linux/man-pages/man3/fopen.3.html
+	TRACE_BEGIN(openStart);
 	FILE* inputFilePointer = fopen(inputFileString, "r");
 	if (inputFilePointer == NULL) {
 		throw_file_perror("Error when opening input file", inputFilePointer);
 		return EXIT_FAILURE;
 	}
+	TRACE_END("open input", openStart, 0);
 
+	TRACE_BEGIN(statStart);
 	// get file descriptor of input file
 	// https://man7.org/linux/man-pages/man3/fileno.3.html
 	int inputFileDescriptor = fileno(inputFilePointer);
@@ -131,29 +617,49 @@ int main(int argc, char* argv[]) {
 
 	// store fileLength (equal for input & output)
 	uint64_t fileLength = inputFileStat.st_size;
+	TRACE_END("stat", statStart, 0);
 
 	// malloc inputBuffer
+	TRACE_BEGIN(allocInputStart);
 	uint8_t* inputBuffer = (uint8_t*)malloc(fileLength);
 	if (inputBuffer == NULL) {
 		throw_file_perror("An error occurred when allocating memory", inputFilePointer);
 	}
+	TRACE_END("alloc input", allocInputStart, fileLength);
 
 	// read file into inputBuffer
 	// https://man7.org/linux/man-pages/man3/fgets.3p.html
+	TRACE_BEGIN(readStart);
 	if (fread(inputBuffer, 1, fileLength, inputFilePointer) < fileLength) {
 		throw_file_perror("An error occurred when reading input file", inputFilePointer);
 	}
+	TRACE_END("read", readStart, fileLength);
 
 	// close inputFilePointer
+	TRACE_BEGIN(closeInputStart);
 	if (fclose(inputFilePointer) != 0) {
 		throw_perror("An error occurred when closing the file");
 	}
+	TRACE_END("close input", closeInputStart, 0);
 
 	// malloc outputBuffer
+	TRACE_BEGIN(allocOutputStart);
 	uint8_t* outputBuffer = (uint8_t*)malloc(fileLength);
 	if (outputBuffer == NULL) {
 		throw_perror("An error occurred when allocating memory");
 	}
+	TRACE_END("alloc output", allocOutputStart, fileLength);
+
+	// without -V the kernel comes from the machine profile written by --tune
+	struct tune_plan plan = tune_plan_for_version(version);
+	struct tune_profile profile;
+	if (!isVersionSet && tune_profile_load(&profile)) {
+		plan = tune_plan_for_size(&profile, fileLength);
+		tune_profile_free(&profile);
+	}
+	if (isPlanSet) {
+		tune_print_plan(&plan, fileLength);
+	}
 
 	if (isBenchmarkSet) {
 		double totalTime = 0;
@@ -161,32 +667,59 @@ int main(int argc, char* argv[]) {
 		struct timespec t2;
 		for (int i = 0; i <= benchmarkRepetitions; i++) {
 			clock_gettime(CLOCK_MONOTONIC, &t1);
-			(*salsa20CryptFunctions[version])(fileLength, inputBuffer, outputBuffer, key, nonce);
+			if (rekey != NULL) {
+				salsa20_transcrypt(fileLength, inputBuffer, outputBuffer, key, nonce, rekey, newNonce, 0);
+			}
+			else {
+				tune_crypt(&plan, fileLength, inputBuffer, outputBuffer, key, nonce);
+			}
 			clock_gettime(CLOCK_MONOTONIC, &t2);
 			totalTime += (t2.tv_sec + t2.tv_nsec * 1e-9) - (t1.tv_sec + t1.tv_nsec * 1e-9);
+			if (traceEnabled) {
+				trace_record("crypt", t1.tv_sec * 1000000000ULL + t1.tv_nsec, t2.tv_sec * 1000000000ULL + t2.tv_nsec, fileLength);
+			}
 		}
 		printf("Total run-time: %f | Average time per run: %f \n", totalTime, totalTime / (benchmarkRepetitions + 1));
 	}
 	else {
-		(*salsa20CryptFunctions[version])(fileLength, inputBuffer, outputBuffer, key, nonce);
+		TRACE_BEGIN(cryptStart);
+		if (rekey != NULL) {
+			salsa20_transcrypt(fileLength, inputBuffer, outputBuffer, key, nonce, rekey, newNonce, 0);
+		}
+		else {
+			tune_crypt(&plan, fileLength, inputBuffer, outputBuffer, key, nonce);
+		}
+		TRACE_END("crypt", cryptStart, fileLength);
 	}
 
 	// open output file
+	TRACE_BEGIN(openOutputStart);
 	FILE* outputFilePointer = fopen(outputFileString, "w");
 	if (outputFilePointer == NULL) {
 		throw_file_perror("An error occurred when opening output file", outputFilePointer);
 	}
+	TRACE_END("open output", openOutputStart, 0);
+
+	TRACE_BEGIN(writeStart);
 	size_t bytesWritten = fwrite(outputBuffer, sizeof(uint8_t), fileLength, outputFilePointer);
 	if (bytesWritten < fileLength) {
 		throw_file_perror("An error occurred when writing output", outputFilePointer);
 	}
+	TRACE_END("write", writeStart, fileLength);
 
+	// fclose flushes the stdio buffer, so the tail of the write is accounted here
+	TRACE_BEGIN(closeOutputStart);
 	if (fclose(outputFilePointer) != 0) {
 		throw_error("An error occurred when closing the output file");
 	}
+	TRACE_END("close output", closeOutputStart, 0);
 
+	TRACE_BEGIN(freeStart);
 	free(inputBuffer);
 	free(outputBuffer);
+	TRACE_END("free", freeStart, 0);
+
+	finish_trace(isPhaseTimingSet, traceFileString);
 
 	return EXIT_SUCCESS;
 }
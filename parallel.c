@@ -0,0 +1,450 @@
+/*
+ * NUMA-aware parallel encryption of a whole file
+ * -> workers are pinned round-robin over the NUMA nodes, every chunk is read from the file into
+ *    untouched memory by a worker of the node it is assigned to (first touch puts the pages there),
+ *    and workers take chunks of their own node before stealing from other nodes
+ *
+ * The topology is read from /sys/devices/system/node; without it (or on one node) this is a plain
+ * pinned thread pool.
+ */
+#define _GNU_SOURCE // sched_setaffinity, CPU_SET
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "parallel.h"
+#include "salsa20.h"
+#include "trace.h"
+#include "utils.h"
+
+struct numa_node {
+	int id;
+	int* cpus;
+	int cpuCount;
+	// chunks assigned to this node and the next one to hand out
+	size_t* chunks;
+	size_t chunkCount;
+	atomic_size_t next;
+};
+
+struct parallel_job {
+	struct numa_node* nodes;
+	int nodeCount;
+	int inputFd;
+	int outputFd;
+	uint8_t* input;
+	uint8_t* output;
+	uint64_t length;
+	size_t chunkSize;
+	size_t chunkCount;
+	int* chunkNode;
+	uint32_t* key;
+	uint64_t nonce;
+	// re-encryption target (NULL: plain crypt)
+	uint32_t* newKey;
+	uint64_t newNonce;
+	bool withIo;
+	atomic_bool failed;
+	atomic_bool pinWarned;
+};
+
+struct parallel_worker {
+	struct parallel_job* job;
+	int node;
+	int cpu;
+	uint64_t start;
+	uint64_t end;
+	uint64_t bytes;
+	size_t localChunks;
+	size_t stolenChunks;
+};
+
+/*
+ * Parses a cpulist like "0-3,8,10-11" and keeps the CPUs this process may run on
+ */
+static int parse_cpulist(const char* list, const cpu_set_t* allowed, int* cpus, int maxCpus) {
+	int count = 0;
+	while (*list != '\0' && *list != '\n') {
+		char* end;
+		long first = strtol(list, &end, 10);
+		long last = first;
+		if (end == list) {
+			break;
+		}
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+		}
+		for (long cpu = first; cpu <= last && count < maxCpus; cpu++) {
+			if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, allowed)) {
+				cpus[count++] = (int)cpu;
+			}
+		}
+		list = *end == ',' ? end + 1 : end;
+	}
+	return count;
+}
+
+/*
+ * Reads the NUMA nodes with at least one allowed CPU; falls back to one node with all allowed CPUs
+ */
+static int read_topology(struct numa_node** nodesOut) {
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &allowed);
+		}
+	}
+	const int allowedCount = CPU_COUNT(&allowed);
+
+	struct numa_node* nodes = NULL;
+	int nodeCount = 0;
+	DIR* directory = opendir("/sys/devices/system/node");
+	struct dirent* entry;
+	while (directory != NULL && (entry = readdir(directory)) != NULL) {
+		int id;
+		char rest;
+		if (sscanf(entry->d_name, "node%d%c", &id, &rest) != 1) {
+			continue;
+		}
+		char path[300];
+		char list[4096];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+		FILE* file = fopen(path, "r");
+		if (file == NULL) {
+			continue;
+		}
+		bool ok = fgets(list, sizeof(list), file) != NULL;
+		fclose(file);
+		int* cpus = (int*)malloc(allowedCount * sizeof(int));
+		if (cpus == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+		int cpuCount = ok ? parse_cpulist(list, &allowed, cpus, allowedCount) : 0;
+		if (cpuCount == 0) {
+			free(cpus);
+			continue;
+		}
+		nodes = (struct numa_node*)realloc(nodes, (nodeCount + 1) * sizeof(struct numa_node));
+		if (nodes == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+		memset(&nodes[nodeCount], 0, sizeof(struct numa_node));
+		nodes[nodeCount].id = id;
+		nodes[nodeCount].cpus = cpus;
+		nodes[nodeCount].cpuCount = cpuCount;
+		nodeCount++;
+	}
+	if (directory != NULL) {
+		closedir(directory);
+	}
+
+	if (nodeCount == 0) {
+		nodes = (struct numa_node*)calloc(1, sizeof(struct numa_node));
+		int* cpus = (int*)malloc((allowedCount ? allowedCount : 1) * sizeof(int));
+		if (nodes == NULL || cpus == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+		int cpuCount = 0;
+		for (int cpu = 0; cpu < CPU_SETSIZE && cpuCount < allowedCount; cpu++) {
+			if (CPU_ISSET(cpu, &allowed)) {
+				cpus[cpuCount++] = cpu;
+			}
+		}
+		nodes[0].cpus = cpus;
+		// cpuCount 0 means no pinning
+		nodes[0].cpuCount = cpuCount;
+		nodeCount = 1;
+	}
+	*nodesOut = nodes;
+	return nodeCount;
+}
+
+/*
+ * Next chunk for a worker: own node first, then the other nodes in order
+ */
+static bool take_chunk(struct parallel_job* job, int node, size_t* chunk, bool* stolen) {
+	for (int i = 0; i < job->nodeCount; i++) {
+		struct numa_node* candidate = &job->nodes[(node + i) % job->nodeCount];
+		if (atomic_load_explicit(&candidate->next, memory_order_relaxed) >= candidate->chunkCount) {
+			continue;
+		}
+		size_t index = atomic_fetch_add(&candidate->next, 1);
+		if (index < candidate->chunkCount) {
+			*chunk = candidate->chunks[index];
+			*stolen = i != 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void* run_worker(void* argument) {
+	struct parallel_worker* worker = (struct parallel_worker*)argument;
+	struct parallel_job* job = worker->job;
+
+	if (worker->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(worker->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0 && !atomic_exchange(&job->pinWarned, true)) {
+			perror("Warning: could not pin worker thread, continuing unpinned");
+		}
+	}
+
+	size_t chunk;
+	bool stolen;
+	worker->start = monotonic_ns();
+	while (!atomic_load_explicit(&job->failed, memory_order_relaxed) && take_chunk(job, worker->node, &chunk, &stolen)) {
+		const uint64_t offset = (uint64_t)chunk * job->chunkSize;
+		const size_t length = job->length - offset < job->chunkSize ? job->length - offset : job->chunkSize;
+
+		if (job->withIo) {
+			// the first write to these pages happens here, on this worker's node
+			TRACE_BEGIN(readStart);
+			if (!pread_all(job->inputFd, job->input + offset, length, offset)) {
+				atomic_store(&job->failed, true);
+				break;
+			}
+			TRACE_END("read chunk", readStart, length);
+			job->chunkNode[chunk] = worker->node;
+		}
+
+		TRACE_BEGIN(cryptStart);
+		if (job->newKey != NULL) {
+			salsa20_transcrypt(length, job->input + offset, job->output + offset, job->key, job->nonce, job->newKey, job->newNonce, offset);
+		}
+		else {
+			salsa20_crypt_offset(length, job->input + offset, job->output + offset, job->key, job->nonce, offset);
+		}
+		TRACE_END("crypt chunk", cryptStart, length);
+
+		if (job->withIo) {
+			TRACE_BEGIN(writeStart);
+			if (!pwrite_all(job->outputFd, job->output + offset, length, offset)) {
+				atomic_store(&job->failed, true);
+				break;
+			}
+			TRACE_END("write chunk", writeStart, length);
+		}
+
+		worker->bytes += length;
+		if (stolen) {
+			worker->stolenChunks++;
+		}
+		else {
+			worker->localChunks++;
+		}
+	}
+	worker->end = monotonic_ns();
+	return NULL;
+}
+
+/*
+ * Runs one pass over all chunks and prints throughput per node
+ */
+static void run_pass(struct parallel_job* job, struct parallel_worker* workers, int threads, const char* name) {
+	for (int n = 0; n < job->nodeCount; n++) {
+		atomic_store(&job->nodes[n].next, 0);
+	}
+	pthread_t* handles = (pthread_t*)malloc(threads * sizeof(pthread_t));
+	if (handles == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	const uint64_t start = monotonic_ns();
+	for (int i = 0; i < threads; i++) {
+		workers[i].bytes = workers[i].localChunks = workers[i].stolenChunks = 0;
+		if (pthread_create(&handles[i], NULL, run_worker, &workers[i]) != 0) {
+			throw_error("An error occurred when creating a thread");
+		}
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(handles[i], NULL);
+	}
+	const uint64_t end = monotonic_ns();
+	free(handles);
+
+	if (atomic_load(&job->failed)) {
+		throw_perror("An error occurred when reading or writing a chunk");
+	}
+
+	printf("%s: %.3f s | %.1f MB/s\n", name, (end - start) * 1e-9, job->length * 1e3 / (end - start));
+	printf("  %-6s %8s %8s %8s %12s %12s\n", "node", "workers", "local", "stolen", "MB", "MB/s");
+	for (int n = 0; n < job->nodeCount; n++) {
+		uint64_t first = UINT64_MAX;
+		uint64_t last = 0;
+		uint64_t bytes = 0;
+		size_t local = 0;
+		size_t stolen = 0;
+		int count = 0;
+		for (int i = 0; i < threads; i++) {
+			if (workers[i].node != n) continue;
+			count++;
+			bytes += workers[i].bytes;
+			local += workers[i].localChunks;
+			stolen += workers[i].stolenChunks;
+			if (workers[i].bytes > 0 && workers[i].start < first) first = workers[i].start;
+			if (workers[i].bytes > 0 && workers[i].end > last) last = workers[i].end;
+		}
+		double throughput = last > first ? bytes * 1e3 / (last - first) : 0;
+		printf("  %-6d %8d %8zu %8zu %12.1f %12.1f\n", job->nodes[n].id, count, local, stolen, bytes * 1e-6, throughput);
+	}
+}
+
+struct buffer_job {
+	const uint8_t* msg;
+	uint8_t* cipher;
+	size_t mlen;
+	uint32_t* key;
+	uint64_t iv;
+	size_t chunkSize;
+	atomic_size_t next;
+};
+
+static void* run_buffer_worker(void* argument) {
+	struct buffer_job* job = (struct buffer_job*)argument;
+	size_t offset;
+	while ((offset = atomic_fetch_add(&job->next, job->chunkSize)) < job->mlen) {
+		size_t length = job->mlen - offset < job->chunkSize ? job->mlen - offset : job->chunkSize;
+		salsa20_crypt_offset(length, job->msg + offset, job->cipher + offset, job->key, job->iv, offset);
+	}
+	return NULL;
+}
+
+/*
+ * Encrypts/decrypts an in-memory buffer with 'threads' threads (the caller is one of them), unpinned
+ */
+void parallel_crypt_buffer(size_t mlen, const uint8_t* msg, uint8_t* cipher, uint32_t key[8], uint64_t iv, int threads, size_t chunkSize) {
+	struct buffer_job job = { msg, cipher, mlen, key, iv, chunkSize, 0 };
+	pthread_t handles[threads > 1 ? threads - 1 : 1];
+	int started = 0;
+	for (; started < threads - 1; started++) {
+		if (pthread_create(&handles[started], NULL, run_buffer_worker, &job) != 0) {
+			break;
+		}
+	}
+	run_buffer_worker(&job);
+	for (int i = 0; i < started; i++) {
+		pthread_join(handles[i], NULL);
+	}
+}
+
+/*
+ * Encrypts/decrypts 'inputPath' into 'outputPath' with 'threads' pinned workers in chunks of 'chunkSize' bytes;
+ * every repetition re-runs the crypt step on the node-local buffers and reports it separately;
+ * with 'newKey' set the input is re-encrypted from (key, nonce) to (newKey, newNonce) instead
+ */
+void run_parallel_crypt(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, uint32_t newKey[8], uint64_t newNonce, int threads, size_t chunkSize, long long repetitions) {
+	if (chunkSize == 0 || chunkSize % 64 != 0) {
+		throw_error("Chunk size must be a positive multiple of 64");
+	}
+
+	struct parallel_job job = { 0 };
+	job.inputFd = open(inputPath, O_RDONLY | O_CLOEXEC);
+	if (job.inputFd < 0) {
+		throw_perror("Error when opening input file");
+	}
+	struct stat inputStat;
+	if (fstat(job.inputFd, &inputStat) != 0) {
+		throw_perror("Error when getting information about file");
+	}
+	if (!S_ISREG(inputStat.st_mode)) {
+		throw_error("File provided is not a regular file");
+	}
+	if (inputStat.st_size <= 0) {
+		throw_error("Please provide a non-empty file");
+	}
+	job.length = inputStat.st_size;
+	job.outputFd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (job.outputFd < 0 || ftruncate(job.outputFd, job.length) != 0) {
+		throw_perror("An error occurred when opening output file");
+	}
+
+	// anonymous mappings stay unbacked until the first write, which decides the node of each page
+	job.input = (uint8_t*)mmap(NULL, job.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	job.output = (uint8_t*)mmap(NULL, job.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (job.input == MAP_FAILED || job.output == MAP_FAILED) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	job.chunkSize = chunkSize;
+	job.chunkCount = (job.length + chunkSize - 1) / chunkSize;
+	job.chunkNode = (int*)calloc(job.chunkCount, sizeof(int));
+	job.key = key;
+	job.nonce = nonce;
+	job.newKey = newKey;
+	job.newNonce = newNonce;
+	job.nodeCount = read_topology(&job.nodes);
+
+	// workers interleaved over the nodes, each pinned to a different CPU of its node
+	struct parallel_worker* workers = (struct parallel_worker*)calloc(threads, sizeof(struct parallel_worker));
+	int* nodeWorkers = (int*)calloc(job.nodeCount, sizeof(int));
+	if (job.chunkNode == NULL || workers == NULL || nodeWorkers == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	for (int i = 0; i < threads; i++) {
+		struct numa_node* node = &job.nodes[i % job.nodeCount];
+		workers[i].job = &job;
+		workers[i].node = i % job.nodeCount;
+		workers[i].cpu = node->cpuCount > 0 ? node->cpus[(i / job.nodeCount) % node->cpuCount] : -1;
+		nodeWorkers[i % job.nodeCount]++;
+	}
+
+	// contiguous share of the chunks per node, proportional to its workers
+	size_t assigned = 0;
+	int workersBefore = 0;
+	for (int n = 0; n < job.nodeCount; n++) {
+		workersBefore += nodeWorkers[n];
+		size_t end = job.chunkCount * workersBefore / threads;
+		job.nodes[n].chunks = (size_t*)malloc((job.chunkCount ? job.chunkCount : 1) * sizeof(size_t));
+		if (job.nodes[n].chunks == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+		job.nodes[n].chunkCount = 0;
+		for (; assigned < end; assigned++) {
+			job.nodes[n].chunks[job.nodes[n].chunkCount++] = assigned;
+		}
+	}
+
+	printf("%d NUMA node(s), %d worker(s), %zu chunk(s) of %zu bytes\n", job.nodeCount, threads, job.chunkCount, chunkSize);
+	job.withIo = true;
+	run_pass(&job, workers, threads, "read+crypt+write");
+
+	if (repetitions > 0) {
+		// later passes follow the pages: every chunk goes to the node that first touched it
+		for (int n = 0; n < job.nodeCount; n++) {
+			job.nodes[n].chunkCount = 0;
+		}
+		for (size_t c = 0; c < job.chunkCount; c++) {
+			struct numa_node* node = &job.nodes[job.chunkNode[c]];
+			node->chunks[node->chunkCount++] = c;
+		}
+		job.withIo = false;
+		for (long long r = 0; r < repetitions; r++) {
+			run_pass(&job, workers, threads, "crypt");
+		}
+	}
+
+	if (close(job.outputFd) != 0) {
+		throw_perror("An error occurred when closing the output file");
+	}
+	close(job.inputFd);
+	munmap(job.input, job.length);
+	munmap(job.output, job.length);
+	for (int n = 0; n < job.nodeCount; n++) {
+		free(job.nodes[n].cpus);
+		free(job.nodes[n].chunks);
+	}
+	free(job.nodes);
+	free(job.chunkNode);
+	free(workers);
+	free(nodeWorkers);
+}
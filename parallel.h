@@ -0,0 +1,11 @@
+#ifndef TEAM152_PARALLEL_H
+#define TEAM152_PARALLEL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PARALLEL_DEFAULT_CHUNK_SIZE (1UL << 20)
+
+void parallel_crypt_buffer(size_t mlen, const uint8_t* msg, uint8_t* cipher, uint32_t key[8], uint64_t iv, int threads, size_t chunkSize);
+void run_parallel_crypt(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, uint32_t newKey[8], uint64_t newNonce, int threads, size_t chunkSize, long long repetitions);
+#endif
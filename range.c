@@ -0,0 +1,137 @@
+/*
+ * Byte-range encryption for sharding one file across processes or hosts
+ * -> only [offset, offset + length) of the input is encrypted, with the keystream of that position,
+ *    and written to the same offset of the output file, which is neither truncated nor otherwise touched,
+ *    so several workers (with disjoint ranges) can share one output file
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "range.h"
+#include "salsa20.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * End of the range [offset, offset + length) inside the input file; length 0 means up to the end of the file
+ */
+static uint64_t range_end(const char* inputPath, uint64_t offset, uint64_t length) {
+	struct stat inputStat;
+	if (stat(inputPath, &inputStat) != 0) {
+		throw_perror("Error when getting information about file");
+	}
+	if (!S_ISREG(inputStat.st_mode)) {
+		throw_error("File provided is not a regular file");
+	}
+	uint64_t fileLength = inputStat.st_size;
+	if (offset >= fileLength) {
+		throw_error("Offset is beyond the end of the input file");
+	}
+	if (length == 0 || length > fileLength - offset) {
+		return fileLength;
+	}
+	return offset + length;
+}
+
+/*
+ * Encrypts/decrypts the range [offset, offset + length) of 'inputPath' in chunks of 'chunkSize' bytes
+ * and writes it at the same offset into 'outputPath' (created if missing, never truncated);
+ * with 'newKey' set the range is re-encrypted from (key, nonce) to (newKey, newNonce) instead
+ */
+void run_range_crypt(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, uint32_t newKey[8], uint64_t newNonce, uint64_t offset, uint64_t length, size_t chunkSize) {
+	if (chunkSize == 0) {
+		throw_error("Chunk size must be positive");
+	}
+	uint64_t end = range_end(inputPath, offset, length);
+
+	int inputFd = open(inputPath, O_RDONLY | O_CLOEXEC);
+	if (inputFd < 0) {
+		throw_perror("Error when opening input file");
+	}
+	int outputFd = open(outputPath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (outputFd < 0) {
+		throw_perror("An error occurred when opening output file");
+	}
+	uint8_t* buffer = (uint8_t*)malloc(chunkSize);
+	if (buffer == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+
+	for (uint64_t position = offset; position < end; position += chunkSize) {
+		size_t size = end - position < chunkSize ? end - position : chunkSize;
+
+		TRACE_BEGIN(readStart);
+		if (!pread_all(inputFd, buffer, size, position)) {
+			throw_perror("An error occurred when reading input file");
+		}
+		TRACE_END("read chunk", readStart, size);
+
+		TRACE_BEGIN(cryptStart);
+		if (newKey != NULL) {
+			salsa20_transcrypt(size, buffer, buffer, key, nonce, newKey, newNonce, position);
+		}
+		else {
+			salsa20_crypt_offset(size, buffer, buffer, key, nonce, position);
+		}
+		TRACE_END("crypt chunk", cryptStart, size);
+
+		TRACE_BEGIN(writeStart);
+		if (!pwrite_all(outputFd, buffer, size, position)) {
+			throw_perror("An error occurred when writing output");
+		}
+		TRACE_END("write chunk", writeStart, size);
+	}
+
+	free(buffer);
+	close(inputFd);
+	if (close(outputFd) != 0) {
+		throw_perror("An error occurred when closing the output file");
+	}
+}
+
+/*
+ * Splits the range into 'shards' parts and encrypts each in its own worker process; every boundary between two
+ * shards is a multiple of 64, so with an unaligned offset the first shard ends at an aligned position
+ */
+void run_sharded_crypt(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, uint32_t newKey[8], uint64_t newNonce, uint64_t offset, uint64_t length, int shards, size_t chunkSize) {
+	uint64_t end = range_end(inputPath, offset, length);
+	uint64_t base = offset / 64 * 64;
+	uint64_t shardSize = ((end - base + shards - 1) / shards + 63) / 64 * 64;
+	pid_t* workers = (pid_t*)calloc(shards, sizeof(pid_t));
+	if (workers == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+
+	// output buffered by stdio must not be flushed twice by the children
+	fflush(stdout);
+	int started = 0;
+	for (uint64_t begin = offset; begin < end; started++) {
+		uint64_t boundary = base + ((begin - base) / shardSize + 1) * shardSize;
+		uint64_t size = (boundary < end ? boundary : end) - begin;
+		workers[started] = fork();
+		if (workers[started] < 0) {
+			throw_perror("An error occurred when starting a worker process");
+		}
+		if (workers[started] == 0) {
+			run_range_crypt(inputPath, outputPath, key, nonce, newKey, newNonce, begin, size, chunkSize);
+			exit(EXIT_SUCCESS);
+		}
+		begin += size;
+	}
+
+	int failed = 0;
+	for (int i = 0; i < started; i++) {
+		int status;
+		if (waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			failed++;
+		}
+	}
+	free(workers);
+	if (failed > 0) {
+		fprintf(stderr, "%d of %d shard(s) failed\n", failed, started);
+		exit(EXIT_FAILURE);
+	}
+}
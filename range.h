@@ -0,0 +1,9 @@
+#ifndef TEAM152_RANGE_H
+#define TEAM152_RANGE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+void run_range_crypt(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, uint32_t newKey[8], uint64_t newNonce, uint64_t offset, uint64_t length, size_t chunkSize);
+void run_sharded_crypt(const char* inputPath, const char* outputPath, uint32_t key[8], uint64_t nonce, uint32_t newKey[8], uint64_t newNonce, uint64_t offset, uint64_t length, int shards, size_t chunkSize);
+#endif
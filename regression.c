@@ -0,0 +1,357 @@
+/*
+ * Benchmark regression gate (see regression.h)
+ * -> the baseline is a small JSON file of raw samples, so the comparison can use a rank test instead of
+ *    comparing two averages that each hide their noise
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "autotune.h"
+#include "regression.h"
+#include "utils.h"
+
+static const uint64_t regressionSizes[] = { 64, 1024, 16384, 1 << 20 };
+
+struct regression_result {
+	char kernel[16];
+	uint64_t size;
+	int sampleCount;
+	double samples[REGRESSION_SAMPLES];
+};
+
+struct ranked_sample {
+	double value;
+	int group;
+};
+
+static int compare_double(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static int compare_ranked(const void* a, const void* b) {
+	return compare_double(&((const struct ranked_sample*)a)->value, &((const struct ranked_sample*)b)->value);
+}
+
+static double median(const double* samples, int count) {
+	double sorted[REGRESSION_SAMPLES];
+	memcpy(sorted, samples, count * sizeof(double));
+	qsort(sorted, count, sizeof(double), compare_double);
+	return count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+/*
+ * REGRESSION_SAMPLES throughput samples in MB/s, each over at least REGRESSION_SAMPLE_NS
+ * (the calls per sample are calibrated once, which also warms up caches and frequency)
+ */
+static void measure(salsa20CryptFunction crypt, size_t size, const uint8_t* msg, uint8_t* cipher, double samples[REGRESSION_SAMPLES]) {
+	uint32_t key[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	uint64_t calls = 1;
+	for (;;) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t c = 0; c < calls; c++) {
+			crypt(size, msg, cipher, key, c);
+		}
+		if (monotonic_ns() - start >= REGRESSION_SAMPLE_NS) break;
+		calls *= 2;
+	}
+	for (int i = 0; i < REGRESSION_SAMPLES; i++) {
+		uint64_t start = monotonic_ns();
+		for (uint64_t c = 0; c < calls; c++) {
+			crypt(size, msg, cipher, key, c);
+		}
+		uint64_t elapsed = monotonic_ns() - start;
+		samples[i] = (double)calls * size * 1e3 / (elapsed ? elapsed : 1);
+	}
+}
+
+/*
+ * Samples of every kernel at every size, returns the number of results
+ */
+static size_t run_all(struct regression_result** resultsOut) {
+	const size_t sizeCount = sizeof(regressionSizes) / sizeof(regressionSizes[0]);
+	const size_t maxSize = regressionSizes[sizeCount - 1];
+	struct regression_result* results = (struct regression_result*)calloc(tuneKernelCount * sizeCount, sizeof(struct regression_result));
+	uint8_t* msg = (uint8_t*)calloc(1, maxSize);
+	uint8_t* cipher = (uint8_t*)calloc(1, maxSize);
+	if (results == NULL || msg == NULL || cipher == NULL) {
+		perror("An error occurred when allocating memory");
+		exit(EXIT_FAILURE);
+	}
+	printf("Measuring %zu kernels at %zu sizes (%d samples each)...\n", tuneKernelCount, sizeCount, REGRESSION_SAMPLES);
+	fflush(stdout);
+
+	size_t count = 0;
+	for (size_t k = 0; k < tuneKernelCount; k++) {
+		for (size_t s = 0; s < sizeCount; s++, count++) {
+			snprintf(results[count].kernel, sizeof(results[count].kernel), "%s", tuneKernels[k].name);
+			results[count].size = regressionSizes[s];
+			results[count].sampleCount = REGRESSION_SAMPLES;
+			measure(tuneKernels[k].crypt, regressionSizes[s], msg, cipher, results[count].samples);
+		}
+	}
+	free(msg);
+	free(cipher);
+	*resultsOut = results;
+	return count;
+}
+
+/*
+ * One-sided Mann-Whitney U test (normal approximation with tie and continuity correction):
+ * p-value for "the samples b are stochastically smaller than the samples a"
+ */
+static double mann_whitney_p(const double* a, int n1, const double* b, int n2) {
+	struct ranked_sample values[2 * REGRESSION_SAMPLES];
+	const int n = n1 + n2;
+	for (int i = 0; i < n1; i++) {
+		values[i] = (struct ranked_sample){ a[i], 0 };
+	}
+	for (int i = 0; i < n2; i++) {
+		values[n1 + i] = (struct ranked_sample){ b[i], 1 };
+	}
+	qsort(values, n, sizeof(values[0]), compare_ranked);
+
+	// average ranks (1-based) over runs of equal values
+	double rankSumB = 0;
+	double tieSum = 0;
+	for (int i = 0; i < n;) {
+		int j = i;
+		while (j < n && values[j].value == values[i].value) {
+			j++;
+		}
+		const double rank = (i + 1 + j) / 2.0;
+		for (int k = i; k < j; k++) {
+			if (values[k].group == 1) {
+				rankSumB += rank;
+			}
+		}
+		const double t = j - i;
+		tieSum += t * t * t - t;
+		i = j;
+	}
+
+	const double u = rankSumB - n2 * (n2 + 1) / 2.0;
+	const double mean = n1 * n2 / 2.0;
+	const double variance = n1 * n2 / 12.0 * ((n + 1) - tieSum / ((double)n * (n - 1)));
+	if (variance <= 0) {
+		return 1.0;
+	}
+	const double z = (u - mean + 0.5) / sqrt(variance);
+	return 0.5 * erfc(-z / sqrt(2.0));
+}
+
+/*
+ * Measures all kernels and writes the samples to 'path'
+ * Returns 0, or -1 with errno set if the file can not be written
+ */
+int regression_save(const char* path) {
+	struct regression_result* results;
+	size_t count = run_all(&results);
+	char cpu[128];
+	tune_read_cpu_model(cpu, sizeof(cpu));
+
+	FILE* file = fopen(path, "w");
+	if (file == NULL) {
+		free(results);
+		return -1;
+	}
+	fprintf(file, "{\n  \"version\": %d,\n  \"cpu\": \"", REGRESSION_BASELINE_VERSION);
+	for (const char* c = cpu; *c != '\0'; c++) {
+		fprintf(file, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+	}
+	fprintf(file, "\",\n  \"unit\": \"MB/s\",\n  \"results\": [\n");
+	for (size_t i = 0; i < count; i++) {
+		fprintf(file, "    { \"kernel\": \"%s\", \"size\": %llu, \"samples\": [", results[i].kernel, (unsigned long long)results[i].size);
+		for (int s = 0; s < results[i].sampleCount; s++) {
+			fprintf(file, "%s%.3f", s ? ", " : "", results[i].samples[s]);
+		}
+		fprintf(file, "] }%s\n", i + 1 < count ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+	free(results);
+	if (fclose(file) != 0) {
+		return -1;
+	}
+	printf("Baseline of %zu results written to %s\n", count, path);
+	return 0;
+}
+
+/*
+ * Start of the value of the first "key": at or after 'from', or NULL
+ */
+static const char* find_value(const char* from, const char* key) {
+	const char* position = strstr(from, key);
+	if (position == NULL) {
+		return NULL;
+	}
+	position += strlen(key);
+	return position + strspn(position, " \t\r\n:");
+}
+
+/*
+ * JSON string value of the first "key": at or after 'from', copied into 'out'; returns the position after it or NULL
+ */
+static const char* read_string(const char* from, const char* key, char* out, size_t size) {
+	const char* position = find_value(from, key);
+	if (position == NULL || *position != '"') {
+		return NULL;
+	}
+	size_t length = 0;
+	for (position++; *position != '\0' && *position != '"'; position++) {
+		if (*position == '\\' && position[1] != '\0') {
+			position++;
+		}
+		if (length + 1 < size) {
+			out[length++] = *position;
+		}
+	}
+	out[length] = '\0';
+	return *position == '"' ? position + 1 : NULL;
+}
+
+/*
+ * Parses a baseline written by regression_save (results of kernels missing in this build are never looked up)
+ * Returns the number of results, or -1 with errno set (EINVAL for a file that is no baseline of this version)
+ */
+static long load_baseline(const char* path, char* cpu, size_t cpuSize, struct regression_result** resultsOut) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+	size_t capacity = 4096;
+	size_t length = 0;
+	char* text = (char*)malloc(capacity);
+	size_t count;
+	while (text != NULL && (count = fread(text + length, 1, capacity - length - 1, file)) > 0) {
+		length += count;
+		if (capacity - length - 1 == 0) {
+			capacity *= 2;
+			char* grown = (char*)realloc(text, capacity);
+			if (grown == NULL) {
+				free(text);
+			}
+			text = grown;
+		}
+	}
+	fclose(file);
+	if (text == NULL) {
+		return -1;
+	}
+	text[length] = '\0';
+
+	const char* version = find_value(text, "\"version\"");
+	if (version == NULL || strtol(version, NULL, 10) != REGRESSION_BASELINE_VERSION
+		|| read_string(text, "\"cpu\"", cpu, cpuSize) == NULL) {
+		free(text);
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct regression_result* results = NULL;
+	size_t resultCount = 0;
+	size_t resultCapacity = 0;
+	const char* position = text;
+	struct regression_result result;
+	while ((position = read_string(position, "\"kernel\"", result.kernel, sizeof(result.kernel))) != NULL) {
+		const char* size = find_value(position, "\"size\"");
+		const char* samples = size != NULL ? find_value(size, "\"samples\"") : NULL;
+		if (samples == NULL || *samples != '[') {
+			break;
+		}
+		result.size = strtoull(size, NULL, 10);
+		result.sampleCount = 0;
+		position = samples + 1;
+		for (;;) {
+			position += strspn(position, " \t\r\n,");
+			if (*position == ']' || *position == '\0') break;
+			char* end;
+			double value = strtod(position, &end);
+			if (end == position) break;
+			if (result.sampleCount < REGRESSION_SAMPLES) {
+				result.samples[result.sampleCount++] = value;
+			}
+			position = end;
+		}
+		if (result.sampleCount < 2) {
+			continue;
+		}
+		if (resultCount == resultCapacity) {
+			resultCapacity = resultCapacity ? resultCapacity * 2 : 32;
+			struct regression_result* grown = (struct regression_result*)realloc(results, resultCapacity * sizeof(struct regression_result));
+			if (grown == NULL) {
+				free(results);
+				free(text);
+				return -1;
+			}
+			results = grown;
+		}
+		results[resultCount++] = result;
+	}
+	free(text);
+	if (resultCount == 0) {
+		free(results);
+		errno = EINVAL;
+		return -1;
+	}
+	*resultsOut = results;
+	return resultCount;
+}
+
+/*
+ * Measures all kernels and compares them with the baseline at 'path', one row per kernel and size
+ * Returns the number of regressions, or -1 with errno set if the baseline can not be read
+ */
+int regression_compare(const char* path, double thresholdPercent) {
+	char baselineCpu[128];
+	struct regression_result* baseline;
+	long baselineCount = load_baseline(path, baselineCpu, sizeof(baselineCpu), &baseline);
+	if (baselineCount < 0) {
+		return -1;
+	}
+	char cpu[128];
+	tune_read_cpu_model(cpu, sizeof(cpu));
+	if (strcmp(cpu, baselineCpu) != 0) {
+		printf("Warning: the baseline was measured on another CPU (%s)\n", baselineCpu);
+	}
+
+	struct regression_result* results;
+	size_t count = run_all(&results);
+	int regressions = 0;
+	printf("%-8s %9s %12s %12s %9s %8s  %s\n", "kernel", "size", "base MB/s", "new MB/s", "change", "p", "verdict");
+	for (size_t i = 0; i < count; i++) {
+		const struct regression_result* base = NULL;
+		for (long b = 0; b < baselineCount && base == NULL; b++) {
+			if (strcmp(baseline[b].kernel, results[i].kernel) == 0 && baseline[b].size == results[i].size) {
+				base = &baseline[b];
+			}
+		}
+		const double current = median(results[i].samples, results[i].sampleCount);
+		if (base == NULL) {
+			printf("%-8s %9llu %12s %12.1f %9s %8s  %s\n", results[i].kernel, (unsigned long long)results[i].size, "-", current, "-", "-", "no baseline");
+			continue;
+		}
+
+		const double previous = median(base->samples, base->sampleCount);
+		const double change = (current - previous) / previous * 100;
+		const double pSlower = mann_whitney_p(base->samples, base->sampleCount, results[i].samples, results[i].sampleCount);
+		const double pFaster = mann_whitney_p(results[i].samples, results[i].sampleCount, base->samples, base->sampleCount);
+		const char* verdict = "ok";
+		double p = pSlower < pFaster ? pSlower : pFaster;
+		if (change < -thresholdPercent && pSlower < REGRESSION_ALPHA) {
+			verdict = "REGRESSION";
+			regressions++;
+		}
+		else if (change > thresholdPercent && pFaster < REGRESSION_ALPHA) {
+			verdict = "faster";
+		}
+		printf("%-8s %9llu %12.1f %12.1f %+8.1f%% %8.4f  %s\n", results[i].kernel, (unsigned long long)results[i].size, previous, current, change, p, verdict);
+	}
+	printf("%d regression(s): median throughput more than %.1f%% below the baseline with p < %.2f (Mann-Whitney U)\n",
+		regressions, thresholdPercent, REGRESSION_ALPHA);
+	free(results);
+	free(baseline);
+	return regressions;
+}
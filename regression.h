@@ -0,0 +1,20 @@
+#ifndef TEAM152_REGRESSION_H
+#define TEAM152_REGRESSION_H 1
+
+/*
+ * Benchmark regression gate
+ *
+ * regression_save measures REGRESSION_SAMPLES throughput samples (MB/s) of every kernel (autotune.h) at every
+ * size and stores them as a JSON baseline. regression_compare measures again and compares each kernel and size
+ * with the baseline by a one-sided Mann-Whitney U test: a median throughput that dropped by more than
+ * 'thresholdPercent' with p < REGRESSION_ALPHA is a regression.
+ */
+#define REGRESSION_BASELINE_VERSION 1
+#define REGRESSION_SAMPLES 15
+#define REGRESSION_SAMPLE_NS 2000000ULL
+#define REGRESSION_ALPHA 0.05
+#define REGRESSION_DEFAULT_THRESHOLD 5.0
+
+int regression_save(const char* path);
+int regression_compare(const char* path, double thresholdPercent);
+#endif
@@ -1,8 +1,10 @@
 #ifndef TEAM152_SALSA20_H
 #define TEAM152_SALSA20_H 1
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #define a11 0
 #define a12 1
@@ -21,6 +23,22 @@
 #define a43 14
 #define a44 15
 
+// one target of salsa20_crypt_fanout
+struct salsa20_recipient {
+	uint32_t key[8];
+	uint64_t nonce;
+	uint8_t* cipher;
+};
+
+// one record of salsa20_crypt_gather: 'length' bytes at keystream block 'counter'
+struct salsa20_gather_record {
+	uint64_t counter;
+	const uint8_t* in;
+	uint8_t* out;
+	size_t length;
+};
+
+void fill_matrix(uint32_t matrix[16], uint32_t key[8], uint64_t nonce, uint64_t counter);
 void salsa20_core(uint32_t output[16], const uint32_t input[16]);
 void salsa20_crypt(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv);
 void salsa20_core_V1(uint32_t output[16], const uint32_t input[16]);
@@ -29,4 +47,18 @@ void salsa20_core_V2(uint32_t output[16], const uint32_t input[16]);
 void salsa20_crypt_V2(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv);
 void salsa20_core_V3(uint32_t output[16], const uint32_t input[16]);
 void salsa20_crypt_V3(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv);
+void salsa20_core_V4(uint32_t output[16], const uint32_t input[16]);
+void salsa20_crypt_V4(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv);
+void salsa20_core_x4(uint32_t output[4][16], const uint32_t input[4][16]);
+size_t salsa20_xor_blocks_x4(size_t blocks, const uint8_t* msg, uint8_t* cipher, const uint32_t matrix[16], uint64_t counter);
+void salsa20_crypt_x4(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv);
+size_t salsa20_xor_blocks_hybrid(size_t blocks, const uint8_t* msg, uint8_t* cipher, const uint32_t matrix[16], uint64_t counter);
+void salsa20_crypt_hybrid(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv);
+void salsa20_crypt_offset(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv, uint64_t offset);
+void salsa20_crypt_fanout(size_t mlen, const uint8_t msg[mlen], struct salsa20_recipient recipients[], int count, uint64_t offset);
+void salsa20_transcrypt(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t oldKey[8], uint64_t oldNonce, uint32_t newKey[8], uint64_t newNonce, uint64_t offset);
+void salsa20_crypt_gather(uint32_t key[8], uint64_t nonce, const struct salsa20_gather_record records[], size_t count);
+uint32_t salsa20_crypt_crc32c(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv, uint64_t offset, uint32_t* msgCrc);
+uint32_t salsa20_crypt_crc32c_input(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv, uint64_t offset);
+size_t salsa20_cryptv(uint32_t key[8], uint64_t iv, uint64_t offset, const struct iovec* in, int n, const struct iovec* out, int m);
 #endif
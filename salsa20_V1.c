@@ -4,6 +4,7 @@
  */
 #include <emmintrin.h>
 #include "salsa20.h"
+#include "stats.h"
 
  /*
 	* Fills matrix with following values
@@ -118,6 +119,7 @@ void salsa20_core_V1(uint32_t output[16], const uint32_t input[16]) {
  * Salsa20 Encryption / Decryption for a given mesage, key and nonce
  */
 void salsa20_crypt_V1(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) {
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_V1, mlen);
 
 	uint32_t matrix[16] = { 0 };
 	uint32_t salsaBlock[16] = { 0 };
@@ -161,4 +163,5 @@ void salsa20_crypt_V1(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen]
 	for (; i < rest; i++) {
 		cipher[outIndex + i] = msg[outIndex + i] ^ cipherStream[i];
 	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_V1, mlen);
 }
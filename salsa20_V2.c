@@ -3,6 +3,7 @@
  * -> core without without transpose (rowround(columnround))
  */
 #include "salsa20.h"
+#include "stats.h"
 
  /*
 	* Fills matrix with following values
@@ -120,6 +121,7 @@ void salsa20_core_V2(uint32_t output[16], const uint32_t input[16]) {
  * Salsa20 Encryption / Decryption for a given mesage, key and nonce
  */
 void salsa20_crypt_V2(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) {
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_V2, mlen);
 
 	uint32_t matrix[16] = { 0 };
 	uint32_t salsaBlock[16] = { 0 };
@@ -137,4 +139,5 @@ void salsa20_crypt_V2(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen]
 		}
 		cipher[i] = msg[i] ^ cipherStream[i % 64];
 	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_V2, mlen);
 }
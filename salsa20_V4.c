@@ -0,0 +1,166 @@
+/*
+ * Salsa20 Version 4 (register-resident SIMD)
+ * -> core of version 1, but the diagonals stay in registers for all blocks of a message,
+ *    the counter is incremented in-register and the keystream is XORed straight into the cipher
+ */
+#include <emmintrin.h>
+#include "salsa20.h"
+#include "stats.h"
+
+/*
+ * Loads the matrix as its four diagonals (same layout as version 1)
+ */
+static inline void load_diagonals_V4(const uint32_t input[16], __m128i diagonals[4]) {
+	diagonals[0] = _mm_set_epi32(input[a14], input[a43], input[a32], input[a21]);
+	diagonals[1] = _mm_set_epi32(input[a24], input[a13], input[a42], input[a31]);
+	diagonals[2] = _mm_set_epi32(input[a34], input[a23], input[a12], input[a41]);
+	diagonals[3] = _mm_set_epi32(input[a44], input[a33], input[a22], input[a11]);
+}
+
+/*
+ * 20 rounds + addition of the input, result in diagonal layout
+ */
+static inline void block_V4(const __m128i input[4], __m128i output[4]) {
+	__m128i firstDiagonal = input[0];
+	__m128i secondDiagonal = input[1];
+	__m128i thirdDiagonal = input[2];
+	__m128i fourthDiagonal = input[3];
+	__m128i temp;
+	__m128i temp2;
+
+	for (int i = 0; i < 20; i++) {
+		// first block: left rotate 7
+		temp = _mm_add_epi32(fourthDiagonal, thirdDiagonal);
+		temp2 = _mm_slli_epi32(temp, 7);
+		temp = _mm_srli_epi32(temp, 25);
+		temp = _mm_or_si128(temp, temp2);
+		firstDiagonal = _mm_xor_si128(temp, firstDiagonal);
+
+		// second block: left rotate 9
+		temp = _mm_add_epi32(firstDiagonal, fourthDiagonal);
+		temp2 = _mm_slli_epi32(temp, 9);
+		temp = _mm_srli_epi32(temp, 23);
+		temp = _mm_or_si128(temp, temp2);
+		secondDiagonal = _mm_xor_si128(temp, secondDiagonal);
+
+		// third block: left rotate 13
+		temp = _mm_add_epi32(secondDiagonal, firstDiagonal);
+		temp2 = _mm_slli_epi32(temp, 13);
+		temp = _mm_srli_epi32(temp, 19);
+		temp = _mm_or_si128(temp, temp2);
+		thirdDiagonal = _mm_xor_si128(temp, thirdDiagonal);
+
+		// fourth block: left rotate 18
+		temp = _mm_add_epi32(thirdDiagonal, secondDiagonal);
+		temp2 = _mm_slli_epi32(temp, 18);
+		temp = _mm_srli_epi32(temp, 14);
+		temp = _mm_or_si128(temp, temp2);
+		fourthDiagonal = _mm_xor_si128(temp, fourthDiagonal);
+
+		// transpose
+		temp = _mm_shuffle_epi32(firstDiagonal, 147); // 2, 1 0, 3
+		firstDiagonal = _mm_shuffle_epi32(thirdDiagonal, 57); // 0, 3, 2, 1
+		thirdDiagonal = temp;
+		secondDiagonal = _mm_shuffle_epi32(secondDiagonal, 78); // 1, 0, 3, 2
+	}
+
+	// O = A + S
+	output[0] = _mm_add_epi32(firstDiagonal, input[0]);
+	output[1] = _mm_add_epi32(secondDiagonal, input[1]);
+	output[2] = _mm_add_epi32(thirdDiagonal, input[2]);
+	output[3] = _mm_add_epi32(fourthDiagonal, input[3]);
+}
+
+/*
+ * Lanes 0 and 2 from 'x', lanes 1 and 3 from 'y'
+ */
+static inline __m128i blend_even_V4(__m128i x, __m128i y) {
+	const __m128i evenLanes = _mm_set_epi32(0, -1, 0, -1);
+	return _mm_or_si128(_mm_and_si128(evenLanes, x), _mm_andnot_si128(evenLanes, y));
+}
+
+/*
+ * Low 64 bit from 'low', high 64 bit from 'high'
+ */
+static inline __m128i blend_low_V4(__m128i low, __m128i high) {
+	return _mm_castpd_si128(_mm_move_sd(_mm_castsi128_pd(high), _mm_castsi128_pd(low)));
+}
+
+/*
+ * Permutes the diagonals into the rows of the matrix (message order)
+ * row r, lane k comes from diagonal (3, 2, 1, 0)[(k - r) mod 4]
+ */
+static inline void diagonals_to_rows_V4(const __m128i diagonals[4], __m128i rows[4]) {
+	__m128i fourthThird = blend_even_V4(diagonals[3], diagonals[2]);
+	__m128i secondFirst = blend_even_V4(diagonals[1], diagonals[0]);
+	__m128i firstFourth = blend_even_V4(diagonals[0], diagonals[3]);
+	__m128i thirdSecond = blend_even_V4(diagonals[2], diagonals[1]);
+
+	rows[0] = blend_low_V4(fourthThird, secondFirst);
+	rows[1] = blend_low_V4(firstFourth, thirdSecond);
+	rows[2] = blend_low_V4(secondFirst, fourthThird);
+	rows[3] = blend_low_V4(thirdSecond, firstFourth);
+}
+
+/*
+ * Salsa Core - create key stream block from input matrix
+ */
+void salsa20_core_V4(uint32_t output[16], const uint32_t input[16]) {
+	__m128i diagonals[4];
+	__m128i rows[4];
+
+	load_diagonals_V4(input, diagonals);
+	block_V4(diagonals, diagonals);
+	diagonals_to_rows_V4(diagonals, rows);
+	for (int i = 0; i < 4; i++) {
+		_mm_storeu_si128((__m128i*) (output + i * 4), rows[i]);
+	}
+}
+
+/*
+ * Salsa20 Encryption / Decryption for a given mesage, key and nonce
+ */
+void salsa20_crypt_V4(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) {
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_V4, mlen);
+
+	uint32_t matrix[16];
+	__m128i input[4];
+	__m128i output[4];
+	__m128i rows[4];
+	size_t outIndex = 0;
+
+	// the counter words are a31 (lane 0 of the second diagonal) and a32 (lane 1 of the first diagonal)
+	const __m128i counterIncrement = _mm_set_epi32(0, 0, 0, 1);
+	const __m128i zero = _mm_setzero_si128();
+
+	fill_matrix(matrix, key, iv, 0);
+	load_diagonals_V4(matrix, input);
+
+	// full 64 byte blocks
+	for (; outIndex + 64 <= mlen; outIndex += 64) {
+		block_V4(input, output);
+		diagonals_to_rows_V4(output, rows);
+		for (size_t j = 0; j < 4; j++) {
+			_mm_storeu_si128((__m128i*) (cipher + outIndex + j * 16), _mm_xor_si128(rows[j], _mm_loadu_si128((__m128i*) (msg + outIndex + j * 16))));
+		}
+
+		// counter++: low word wraps to 0 -> carry into the high word
+		input[1] = _mm_add_epi32(input[1], counterIncrement);
+		__m128i carry = _mm_and_si128(_mm_cmpeq_epi32(input[1], zero), counterIncrement);
+		input[0] = _mm_add_epi32(input[0], _mm_slli_si128(carry, 4));
+	}
+
+	// last partial block
+	if (outIndex < mlen) {
+		uint8_t cipherStream[64];
+		block_V4(input, output);
+		diagonals_to_rows_V4(output, rows);
+		for (size_t j = 0; j < 4; j++) {
+			_mm_storeu_si128((__m128i*) (cipherStream + j * 16), rows[j]);
+		}
+		for (size_t i = 0; outIndex + i < mlen; i++) {
+			cipher[outIndex + i] = msg[outIndex + i] ^ cipherStream[i];
+		}
+	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_V4, mlen);
+}
@@ -0,0 +1,183 @@
+/*
+ * Encrypted pread/pwrite file layer (see salsa20_file.h)
+ * -> the keystream position of every byte is its file offset, so any range can be read or written on its own
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "salsa20.h"
+#include "salsa20_file.h"
+
+struct salsa20_file {
+	int fd;
+	uint32_t key[8];
+	uint64_t nonce;
+	atomic_uint_fast64_t size;
+	// staging buffers for writes, a stack of free indices guarded by poolLock
+	pthread_mutex_t poolLock;
+	pthread_cond_t poolAvailable;
+	uint8_t* pool;
+	int freeBuffers[SALSA20_FILE_BUFFER_COUNT];
+	int freeCount;
+};
+
+static uint8_t* acquire_buffer(struct salsa20_file* file) {
+	pthread_mutex_lock(&file->poolLock);
+	while (file->freeCount == 0) {
+		pthread_cond_wait(&file->poolAvailable, &file->poolLock);
+	}
+	int index = file->freeBuffers[--file->freeCount];
+	pthread_mutex_unlock(&file->poolLock);
+	return file->pool + (size_t)index * SALSA20_FILE_BUFFER_SIZE;
+}
+
+static void release_buffer(struct salsa20_file* file, uint8_t* buffer) {
+	pthread_mutex_lock(&file->poolLock);
+	file->freeBuffers[file->freeCount++] = (int)((buffer - file->pool) / SALSA20_FILE_BUFFER_SIZE);
+	pthread_cond_signal(&file->poolAvailable);
+	pthread_mutex_unlock(&file->poolLock);
+}
+
+/*
+ * size = max(size, end)
+ */
+static void grow_size(struct salsa20_file* file, uint64_t end) {
+	uint_fast64_t size = atomic_load(&file->size);
+	while (size < end && !atomic_compare_exchange_weak(&file->size, &size, end)) {
+	}
+}
+
+/*
+ * Opens (or creates, see open(2) 'flags' and 'mode') an encrypted file
+ * Returns NULL with errno set on failure; O_APPEND is rejected (EINVAL), salsa20_append takes its place
+ */
+struct salsa20_file* salsa20_file_open(const char* path, int flags, mode_t mode, uint32_t key[8], uint64_t nonce) {
+	if (flags & O_APPEND) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct salsa20_file* file = (struct salsa20_file*)calloc(1, sizeof(struct salsa20_file));
+	if (file == NULL) {
+		return NULL;
+	}
+	file->pool = (uint8_t*)aligned_alloc(SALSA20_FILE_ALIGNMENT, (size_t)SALSA20_FILE_BUFFER_COUNT * SALSA20_FILE_BUFFER_SIZE);
+	if (file->pool == NULL) {
+		free(file);
+		return NULL;
+	}
+	file->fd = open(path, flags | O_CLOEXEC, mode);
+	struct stat fileStat;
+	if (file->fd < 0 || fstat(file->fd, &fileStat) != 0) {
+		int error = errno;
+		if (file->fd >= 0) close(file->fd);
+		free(file->pool);
+		free(file);
+		errno = error;
+		return NULL;
+	}
+	memcpy(file->key, key, sizeof(file->key));
+	file->nonce = nonce;
+	atomic_init(&file->size, fileStat.st_size);
+	pthread_mutex_init(&file->poolLock, NULL);
+	pthread_cond_init(&file->poolAvailable, NULL);
+	for (int i = 0; i < SALSA20_FILE_BUFFER_COUNT; i++) {
+		file->freeBuffers[i] = i;
+	}
+	file->freeCount = SALSA20_FILE_BUFFER_COUNT;
+	return file;
+}
+
+/*
+ * Reads up to 'count' plaintext bytes at 'offset' (fewer only at the end of the file)
+ * Returns the number of bytes read or -1 with errno set
+ */
+ssize_t salsa20_pread(struct salsa20_file* file, void* buffer, size_t count, uint64_t offset) {
+	uint8_t* out = (uint8_t*)buffer;
+	size_t done = 0;
+	while (done < count) {
+		ssize_t result = pread(file->fd, out + done, count - done, offset + done);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result < 0) {
+			if (done == 0) return -1;
+			break;
+		}
+		if (result == 0) {
+			break;
+		}
+		done += result;
+	}
+	salsa20_crypt_offset(done, out, out, file->key, file->nonce, offset);
+	return done;
+}
+
+/*
+ * Writes 'count' plaintext bytes at 'offset', encrypted through the buffer pool
+ * Returns the number of bytes written (fewer only if a write failed midway) or -1 with errno set
+ */
+ssize_t salsa20_pwrite(struct salsa20_file* file, const void* buffer, size_t count, uint64_t offset) {
+	const uint8_t* in = (const uint8_t*)buffer;
+	uint8_t* staging = acquire_buffer(file);
+	size_t done = 0;
+	int error = 0;
+	while (done < count && error == 0) {
+		size_t piece = count - done < SALSA20_FILE_BUFFER_SIZE ? count - done : SALSA20_FILE_BUFFER_SIZE;
+		salsa20_crypt_offset(piece, in + done, staging, file->key, file->nonce, offset + done);
+		size_t written = 0;
+		while (written < piece) {
+			ssize_t result = pwrite(file->fd, staging + written, piece - written, offset + done + written);
+			if (result < 0 && errno == EINTR) {
+				continue;
+			}
+			if (result <= 0) {
+				error = result < 0 ? errno : EIO;
+				break;
+			}
+			written += result;
+		}
+		done += written;
+	}
+	release_buffer(file, staging);
+	grow_size(file, offset + done);
+	if (done == 0 && error != 0) {
+		errno = error;
+		return -1;
+	}
+	return done;
+}
+
+/*
+ * Writes 'count' bytes at the end of the file; concurrent appends get disjoint ranges
+ * The offset written to is stored in 'offset' (may be NULL)
+ */
+ssize_t salsa20_append(struct salsa20_file* file, const void* buffer, size_t count, uint64_t* offset) {
+	uint64_t position = atomic_fetch_add(&file->size, count);
+	if (offset != NULL) {
+		*offset = position;
+	}
+	return salsa20_pwrite(file, buffer, count, position);
+}
+
+/*
+ * Size of the file including appends that are still being written
+ */
+uint64_t salsa20_file_size(struct salsa20_file* file) {
+	return atomic_load(&file->size);
+}
+
+int salsa20_file_close(struct salsa20_file* file) {
+	int result = close(file->fd);
+	memset(file->key, 0, sizeof(file->key));
+	memset(file->pool, 0, (size_t)SALSA20_FILE_BUFFER_COUNT * SALSA20_FILE_BUFFER_SIZE);
+	pthread_mutex_destroy(&file->poolLock);
+	pthread_cond_destroy(&file->poolAvailable);
+	free(file->pool);
+	free(file);
+	return result;
+}
@@ -0,0 +1,30 @@
+#ifndef TEAM152_SALSA20_FILE_H
+#define TEAM152_SALSA20_FILE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Encrypted file handle: byte i of the file is byte i of the plaintext XOR keystream byte i of (key, nonce),
+ * so a file written through this layer is the same as the CLI output for the whole plaintext and vice versa.
+ *
+ * salsa20_pread reads the ciphertext straight into the caller's buffer and decrypts it there;
+ * salsa20_pwrite encrypts into buffers of a per-file pool (aligned to SALSA20_FILE_ALIGNMENT, so the file
+ * may be opened with O_DIRECT for aligned writes) and writes from them. All calls are safe from several threads.
+ *
+ * Writing the same offset twice reuses its keystream: overwrites reveal the XOR of old and new plaintext.
+ */
+#define SALSA20_FILE_ALIGNMENT 4096
+#define SALSA20_FILE_BUFFER_SIZE (256 << 10)
+#define SALSA20_FILE_BUFFER_COUNT 4
+
+struct salsa20_file;
+
+struct salsa20_file* salsa20_file_open(const char* path, int flags, mode_t mode, uint32_t key[8], uint64_t nonce);
+ssize_t salsa20_pread(struct salsa20_file* file, void* buffer, size_t count, uint64_t offset);
+ssize_t salsa20_pwrite(struct salsa20_file* file, const void* buffer, size_t count, uint64_t offset);
+ssize_t salsa20_append(struct salsa20_file* file, const void* buffer, size_t count, uint64_t* offset);
+uint64_t salsa20_file_size(struct salsa20_file* file);
+int salsa20_file_close(struct salsa20_file* file);
+#endif
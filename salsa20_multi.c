@@ -0,0 +1,792 @@
+/*
+ * Salsa20 multi-block (SIMD across blocks)
+ * -> every __m128i holds the same matrix entry of four independent blocks,
+ *    so the rounds need no shuffles and the lanes may use different keys, nonces or counters
+ */
+#include <emmintrin.h>
+#include <nmmintrin.h>
+#include "crc32c.h"
+#include "salsa20.h"
+#include "stats.h"
+
+// blocks in general purpose registers per group of the hybrid kernel (more than two spill to the stack on x86-64)
+#ifndef HYBRID_SCALAR_BLOCKS
+#define HYBRID_SCALAR_BLOCKS 1
+#endif
+#define HYBRID_BLOCKS (4 + HYBRID_SCALAR_BLOCKS)
+// message bytes per pass over all recipients of salsa20_crypt_fanout
+#define FANOUT_SLICE_SIZE (16 << 10)
+
+#define ROTATE_LEFT_X4(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define QUARTER_X4(a, b, c, d) \
+	b = _mm_xor_si128(b, ROTATE_LEFT_X4(_mm_add_epi32(a, d), 7)); \
+	c = _mm_xor_si128(c, ROTATE_LEFT_X4(_mm_add_epi32(b, a), 9)); \
+	d = _mm_xor_si128(d, ROTATE_LEFT_X4(_mm_add_epi32(c, b), 13)); \
+	a = _mm_xor_si128(a, ROTATE_LEFT_X4(_mm_add_epi32(d, c), 18))
+
+/*
+ * Transpose four vectors as a 4x4 matrix of 32-bit values
+ */
+static inline void transpose_x4(__m128i* r0, __m128i* r1, __m128i* r2, __m128i* r3) {
+	__m128i t0 = _mm_unpacklo_epi32(*r0, *r1);
+	__m128i t1 = _mm_unpacklo_epi32(*r2, *r3);
+	__m128i t2 = _mm_unpackhi_epi32(*r0, *r1);
+	__m128i t3 = _mm_unpackhi_epi32(*r2, *r3);
+	*r0 = _mm_unpacklo_epi64(t0, t1);
+	*r1 = _mm_unpackhi_epi64(t0, t1);
+	*r2 = _mm_unpacklo_epi64(t2, t3);
+	*r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+/*
+ * 20 rounds on sixteen lane-sliced state words, then O = A + S
+ */
+static inline void rounds_x4(__m128i x[16], const __m128i s[16]) {
+	for (int i = 0; i < 16; i++) {
+		x[i] = s[i];
+	}
+	for (int i = 0; i < 10; i++) {
+		// columnround
+		QUARTER_X4(x[a11], x[a21], x[a31], x[a41]);
+		QUARTER_X4(x[a22], x[a32], x[a42], x[a12]);
+		QUARTER_X4(x[a33], x[a43], x[a13], x[a23]);
+		QUARTER_X4(x[a44], x[a14], x[a24], x[a34]);
+		// rowround
+		QUARTER_X4(x[a11], x[a12], x[a13], x[a14]);
+		QUARTER_X4(x[a22], x[a23], x[a24], x[a21]);
+		QUARTER_X4(x[a33], x[a34], x[a31], x[a32]);
+		QUARTER_X4(x[a44], x[a41], x[a42], x[a43]);
+	}
+	for (int i = 0; i < 16; i++) {
+		x[i] = _mm_add_epi32(x[i], s[i]);
+	}
+}
+
+/*
+ * XOR the four keystream blocks in x (lane b = block b) into 256 bytes of msg
+ */
+static inline void xor_x4(uint8_t* cipher, const uint8_t* msg, __m128i x[16]) {
+	for (int i = 0; i < 16; i += 4) {
+		transpose_x4(&x[i], &x[i + 1], &x[i + 2], &x[i + 3]);
+	}
+	for (int b = 0; b < 4; b++) {
+		for (int i = 0; i < 4; i++) {
+			__m128i m = _mm_loadu_si128((const __m128i*)(msg + b * 64 + i * 16));
+			_mm_storeu_si128((__m128i*)(cipher + b * 64 + i * 16), _mm_xor_si128(m, x[i * 4 + b]));
+		}
+	}
+}
+
+/*
+ * Lane-sliced state with the 64-bit counters of four consecutive blocks in a31 (low) and a32 (high words)
+ */
+static inline void set_counters_x4(__m128i s[16], const uint32_t matrix[16], uint64_t counter) {
+	for (int i = 0; i < 16; i++) {
+		s[i] = _mm_set1_epi32(matrix[i]);
+	}
+	s[a31] = _mm_set_epi32(counter + 3, counter + 2, counter + 1, counter);
+	s[a32] = _mm_set_epi32((counter + 3) >> 32, (counter + 2) >> 32, (counter + 1) >> 32, counter >> 32);
+}
+
+/*
+ * Add 4 to the low words and carry into the high words where they wrapped (unsigned compare via sign flip)
+ */
+static inline void advance_counters_x4(__m128i s[16]) {
+	const __m128i signBit = _mm_set1_epi32((int)0x80000000);
+	__m128i low = _mm_add_epi32(s[a31], _mm_set1_epi32(4));
+	__m128i carry = _mm_cmplt_epi32(_mm_xor_si128(low, signBit), _mm_xor_si128(s[a31], signBit));
+	s[a31] = low;
+	s[a32] = _mm_sub_epi32(s[a32], carry);
+}
+
+/*
+ * Salsa Core for four independent input matrices
+ */
+void salsa20_core_x4(uint32_t output[4][16], const uint32_t input[4][16]) {
+	__m128i s[16];
+	__m128i x[16];
+
+	for (int i = 0; i < 16; i += 4) {
+		s[i] = _mm_loadu_si128((const __m128i*)(input[0] + i));
+		s[i + 1] = _mm_loadu_si128((const __m128i*)(input[1] + i));
+		s[i + 2] = _mm_loadu_si128((const __m128i*)(input[2] + i));
+		s[i + 3] = _mm_loadu_si128((const __m128i*)(input[3] + i));
+		transpose_x4(&s[i], &s[i + 1], &s[i + 2], &s[i + 3]);
+	}
+
+	rounds_x4(x, s);
+
+	for (int i = 0; i < 16; i += 4) {
+		transpose_x4(&x[i], &x[i + 1], &x[i + 2], &x[i + 3]);
+		_mm_storeu_si128((__m128i*)(output[0] + i), x[i]);
+		_mm_storeu_si128((__m128i*)(output[1] + i), x[i + 1]);
+		_mm_storeu_si128((__m128i*)(output[2] + i), x[i + 2]);
+		_mm_storeu_si128((__m128i*)(output[3] + i), x[i + 3]);
+	}
+}
+
+/*
+ * XOR 'blocks' full keystream blocks starting at 'counter' into msg,
+ * four consecutive counters at a time with the counter lanes incremented in-register
+ * (blocks that do not fill all four lanes are left to the caller)
+ * Returns the number of blocks processed
+ */
+size_t salsa20_xor_blocks_x4(size_t blocks, const uint8_t* msg, uint8_t* cipher, const uint32_t matrix[16], uint64_t counter) {
+	__m128i s[16];
+	__m128i x[16];
+	size_t done = 0;
+
+	set_counters_x4(s, matrix, counter);
+
+	for (; done + 4 <= blocks; done += 4) {
+		rounds_x4(x, s);
+		xor_x4(cipher + done * 64, msg + done * 64, x);
+
+		advance_counters_x4(s);
+	}
+	return done;
+}
+
+#define ROTATE_LEFT(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+	b ^= ROTATE_LEFT(a + d, 7); \
+	c ^= ROTATE_LEFT(b + a, 9); \
+	d ^= ROTATE_LEFT(c + b, 13); \
+	a ^= ROTATE_LEFT(d + c, 18)
+
+// one quarterround of the four SIMD blocks next to the same quarterround of every scalar block
+#define QUARTER_HYBRID(a, b, c, d) \
+	QUARTER_X4(x[a], x[b], x[c], x[d]); \
+	for (int k = 0; k < HYBRID_SCALAR_BLOCKS; k++) { \
+		QUARTER(y[k][a], y[k][b], y[k][c], y[k][d]); \
+	}
+
+/*
+ * XOR 'blocks' full keystream blocks starting at 'counter' into msg, HYBRID_BLOCKS consecutive counters at a time:
+ * four in the SIMD lanes and HYBRID_SCALAR_BLOCKS in general purpose registers. Both run the same round in one
+ * basic block, so the out-of-order core can issue scalar ALU work on the ports the vector code leaves idle.
+ * (blocks that do not fill a whole group are left to the caller)
+ * Returns the number of blocks processed
+ */
+size_t salsa20_xor_blocks_hybrid(size_t blocks, const uint8_t* msg, uint8_t* cipher, const uint32_t matrix[16], uint64_t counter) {
+	__m128i s[16];
+	__m128i x[16];
+	uint32_t y[HYBRID_SCALAR_BLOCKS][16];
+	size_t done = 0;
+
+	for (int i = 0; i < 16; i++) {
+		s[i] = _mm_set1_epi32(matrix[i]);
+	}
+
+	for (; done + HYBRID_BLOCKS <= blocks; done += HYBRID_BLOCKS, counter += HYBRID_BLOCKS) {
+		// SIMD lanes take counter .. counter + 3, the scalar blocks follow them
+		s[a31] = _mm_set_epi32(counter + 3, counter + 2, counter + 1, counter);
+		s[a32] = _mm_set_epi32((counter + 3) >> 32, (counter + 2) >> 32, (counter + 1) >> 32, counter >> 32);
+		for (int k = 0; k < HYBRID_SCALAR_BLOCKS; k++) {
+			memcpy(y[k], matrix, sizeof(y[k]));
+			y[k][a31] = counter + 4 + k;
+			y[k][a32] = (counter + 4 + k) >> 32;
+		}
+		for (int i = 0; i < 16; i++) {
+			x[i] = s[i];
+		}
+
+		for (int i = 0; i < 10; i++) {
+			// columnround
+			QUARTER_HYBRID(a11, a21, a31, a41);
+			QUARTER_HYBRID(a22, a32, a42, a12);
+			QUARTER_HYBRID(a33, a43, a13, a23);
+			QUARTER_HYBRID(a44, a14, a24, a34);
+			// rowround
+			QUARTER_HYBRID(a11, a12, a13, a14);
+			QUARTER_HYBRID(a22, a23, a24, a21);
+			QUARTER_HYBRID(a33, a34, a31, a32);
+			QUARTER_HYBRID(a44, a41, a42, a43);
+		}
+
+		for (int i = 0; i < 16; i++) {
+			x[i] = _mm_add_epi32(x[i], s[i]);
+		}
+		xor_x4(cipher + done * 64, msg + done * 64, x);
+
+		// scalar blocks: O = A + S, then XOR behind the four SIMD blocks
+		for (int k = 0; k < HYBRID_SCALAR_BLOCKS; k++) {
+			uint32_t keystream[16];
+			for (int i = 0; i < 16; i++) {
+				keystream[i] = y[k][i] + matrix[i];
+			}
+			keystream[a31] += (uint32_t)(counter + 4 + k) - matrix[a31];
+			keystream[a32] += (uint32_t)((counter + 4 + k) >> 32) - matrix[a32];
+			const uint8_t* in = msg + (done + 4 + k) * 64;
+			uint8_t* out = cipher + (done + 4 + k) * 64;
+			for (int i = 0; i < 4; i++) {
+				__m128i m = _mm_loadu_si128((const __m128i*)(in + i * 16));
+				_mm_storeu_si128((__m128i*)(out + i * 16), _mm_xor_si128(m, _mm_loadu_si128((const __m128i*)(keystream + i * 4))));
+			}
+		}
+	}
+	return done;
+}
+
+/*
+ * Salsa20 Encryption / Decryption for a given mesage, key and nonce (hybrid scalar + SIMD kernel)
+ */
+void salsa20_crypt_hybrid(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) {
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_HYBRID, mlen);
+	uint32_t matrix[16] = { 0 };
+	uint32_t salsaBlock[16] = { 0 };
+	const uint8_t* cipherStream = (const uint8_t*)salsaBlock;
+
+	fill_matrix(matrix, key, iv, 0);
+	size_t blocks = salsa20_xor_blocks_hybrid(mlen / 64, msg, cipher, matrix, 0);
+	size_t position = blocks * 64;
+	uint64_t counter = blocks;
+
+	// remaining full blocks and the partial last block
+	for (; position < mlen; position += 64, counter++) {
+		matrix[a31] = counter;
+		matrix[a32] = counter >> 32;
+		salsa20_core(salsaBlock, matrix);
+		size_t rest = mlen - position < 64 ? mlen - position : 64;
+		for (size_t i = 0; i < rest; i++) {
+			cipher[position + i] = msg[position + i] ^ cipherStream[i];
+		}
+	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_HYBRID, mlen);
+}
+
+/*
+ * Salsa20 Encryption / Decryption for a given mesage, key and nonce (four blocks per iteration)
+ */
+void salsa20_crypt_x4(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv) {
+	salsa20_crypt_offset(mlen, msg, cipher, key, iv, 0);
+}
+
+/*
+ * Uninstrumented body of salsa20_crypt_offset (for kernels that count their bytes themselves)
+ */
+static void crypt_offset_x4(size_t mlen, const uint8_t* msg, uint8_t* cipher, uint32_t key[8], uint64_t iv, uint64_t offset) {
+	uint32_t matrix[16] = { 0 };
+	uint32_t salsaBlock[16] = { 0 };
+	const uint8_t* cipherStream = (const uint8_t*)salsaBlock;
+	uint64_t counter = offset / 64;
+	size_t position = 0;
+
+	fill_matrix(matrix, key, iv, counter);
+
+	// partially used first block
+	if (offset % 64 != 0 && mlen > 0) {
+		salsa20_core(salsaBlock, matrix);
+		size_t skip = offset % 64;
+		size_t rest = mlen < 64 - skip ? mlen : 64 - skip;
+		for (size_t i = 0; i < rest; i++) {
+			cipher[i] = msg[i] ^ cipherStream[skip + i];
+		}
+		position = rest;
+		counter++;
+	}
+
+	size_t blocks = salsa20_xor_blocks_x4((mlen - position) / 64, msg + position, cipher + position, matrix, counter);
+	position += blocks * 64;
+	counter += blocks;
+
+	// remaining full blocks and the partial last block
+	for (; position < mlen; position += 64, counter++) {
+		matrix[a31] = counter;
+		matrix[a32] = counter >> 32;
+		salsa20_core(salsaBlock, matrix);
+		size_t rest = mlen - position < 64 ? mlen - position : 64;
+		for (size_t i = 0; i < rest; i++) {
+			cipher[position + i] = msg[position + i] ^ cipherStream[i];
+		}
+	}
+}
+
+/*
+ * Salsa20 Encryption / Decryption of a message that starts 'offset' bytes into the keystream
+ * (block counter offset / 64, position offset % 64 inside that block)
+ */
+void salsa20_crypt_offset(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv, uint64_t offset) {
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_X4, mlen);
+	crypt_offset_x4(mlen, msg, cipher, key, iv, offset);
+	SALSA20_CRYPT_END(SALSA20_KERNEL_X4, mlen);
+}
+
+/*
+ * CRC32C step over the 16 bytes of a register (raw, not inverted state)
+ */
+__attribute__((target("sse4.2")))
+static inline uint64_t crc32c_x16(uint64_t crc, __m128i v) {
+	crc = _mm_crc32_u64(crc, (uint64_t)_mm_cvtsi128_si64(v));
+	return _mm_crc32_u64(crc, (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+}
+
+/*
+ * Like salsa20_xor_blocks_x4, and the CRC32C of every 16 bytes written (if 'cipherCrc' is set) and of the 16 bytes
+ * read (if 'msgCrc' is set) is updated while they are still in a register, so the output is never read again
+ */
+__attribute__((target("sse4.2"), always_inline))
+static inline size_t xor_blocks_crc_x4(size_t blocks, const uint8_t* msg, uint8_t* cipher, const uint32_t matrix[16], uint64_t counter, uint32_t* cipherCrc, uint32_t* msgCrc) {
+	__m128i s[16];
+	__m128i x[16];
+	uint64_t cipherState = cipherCrc != NULL ? ~*cipherCrc : 0;
+	uint64_t msgState = msgCrc != NULL ? ~*msgCrc : 0;
+	size_t done = 0;
+
+	set_counters_x4(s, matrix, counter);
+	for (; done + 4 <= blocks; done += 4) {
+		rounds_x4(x, s);
+		for (int i = 0; i < 16; i += 4) {
+			transpose_x4(&x[i], &x[i + 1], &x[i + 2], &x[i + 3]);
+		}
+		const uint8_t* in = msg + done * 64;
+		uint8_t* out = cipher + done * 64;
+		for (int b = 0; b < 4; b++) {
+			for (int i = 0; i < 4; i++) {
+				__m128i m = _mm_loadu_si128((const __m128i*)(in + b * 64 + i * 16));
+				__m128i c = _mm_xor_si128(m, x[i * 4 + b]);
+				_mm_storeu_si128((__m128i*)(out + b * 64 + i * 16), c);
+				if (cipherCrc != NULL) {
+					cipherState = crc32c_x16(cipherState, c);
+				}
+				if (msgCrc != NULL) {
+					msgState = crc32c_x16(msgState, m);
+				}
+			}
+		}
+		advance_counters_x4(s);
+	}
+	if (cipherCrc != NULL) {
+		*cipherCrc = ~(uint32_t)cipherState;
+	}
+	if (msgCrc != NULL) {
+		*msgCrc = ~(uint32_t)msgState;
+	}
+	return done;
+}
+
+// one variant of the fused loop per combination of checksums, so a checksum costs nothing when it is not wanted
+__attribute__((target("sse4.2")))
+static size_t xor_blocks_crc_x4_cipher(size_t blocks, const uint8_t* msg, uint8_t* cipher, const uint32_t matrix[16], uint64_t counter, uint32_t* cipherCrc) {
+	return xor_blocks_crc_x4(blocks, msg, cipher, matrix, counter, cipherCrc, NULL);
+}
+
+__attribute__((target("sse4.2")))
+static size_t xor_blocks_crc_x4_msg(size_t blocks, const uint8_t* msg, uint8_t* cipher, const uint32_t matrix[16], uint64_t counter, uint32_t* msgCrc) {
+	return xor_blocks_crc_x4(blocks, msg, cipher, matrix, counter, NULL, msgCrc);
+}
+
+__attribute__((target("sse4.2")))
+static size_t xor_blocks_crc_x4_both(size_t blocks, const uint8_t* msg, uint8_t* cipher, const uint32_t matrix[16], uint64_t counter, uint32_t* cipherCrc, uint32_t* msgCrc) {
+	return xor_blocks_crc_x4(blocks, msg, cipher, matrix, counter, cipherCrc, msgCrc);
+}
+
+/*
+ * Crypt of 'length' bytes inside the keystream block 'counter', starting 'skip' bytes into it, with the checksums
+ * that are set (the message checksum first, msg and cipher may be the same buffer)
+ */
+static void crypt_crc_block(size_t length, const uint8_t* msg, uint8_t* cipher, uint32_t matrix[16], uint64_t counter, size_t skip, uint32_t* cipherCrc, uint32_t* msgCrc) {
+	uint32_t salsaBlock[16];
+	const uint8_t* cipherStream = (const uint8_t*)salsaBlock;
+	if (msgCrc != NULL) {
+		*msgCrc = crc32c(*msgCrc, msg, length);
+	}
+	matrix[a31] = counter;
+	matrix[a32] = counter >> 32;
+	salsa20_core(salsaBlock, matrix);
+	for (size_t i = 0; i < length; i++) {
+		cipher[i] = msg[i] ^ cipherStream[skip + i];
+	}
+	if (cipherCrc != NULL) {
+		*cipherCrc = crc32c(*cipherCrc, cipher, length);
+	}
+}
+
+/*
+ * Crypt like salsa20_crypt_offset in a single pass that updates the checksums that are set (from 0)
+ * Without SSE4.2 the checksums are computed in separate passes
+ */
+static void crypt_crc32c(size_t mlen, const uint8_t* msg, uint8_t* cipher, uint32_t key[8], uint64_t iv, uint64_t offset, uint32_t* cipherCrc, uint32_t* msgCrc) {
+	if (!crc32c_hardware()) {
+		if (msgCrc != NULL) {
+			*msgCrc = crc32c(0, msg, mlen);
+		}
+		salsa20_crypt_offset(mlen, msg, cipher, key, iv, offset);
+		if (cipherCrc != NULL) {
+			*cipherCrc = crc32c(0, cipher, mlen);
+		}
+		return;
+	}
+
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_X4, mlen);
+	uint32_t matrix[16] = { 0 };
+	uint64_t counter = offset / 64;
+	size_t position = 0;
+
+	if (cipherCrc != NULL) {
+		*cipherCrc = 0;
+	}
+	if (msgCrc != NULL) {
+		*msgCrc = 0;
+	}
+	fill_matrix(matrix, key, iv, counter);
+
+	// partially used first block
+	if (offset % 64 != 0 && mlen > 0) {
+		size_t skip = offset % 64;
+		position = mlen < 64 - skip ? mlen : 64 - skip;
+		crypt_crc_block(position, msg, cipher, matrix, counter, skip, cipherCrc, msgCrc);
+		counter++;
+	}
+
+	size_t blocks = (mlen - position) / 64;
+	if (cipherCrc == NULL) {
+		blocks = xor_blocks_crc_x4_msg(blocks, msg + position, cipher + position, matrix, counter, msgCrc);
+	} else if (msgCrc == NULL) {
+		blocks = xor_blocks_crc_x4_cipher(blocks, msg + position, cipher + position, matrix, counter, cipherCrc);
+	} else {
+		blocks = xor_blocks_crc_x4_both(blocks, msg + position, cipher + position, matrix, counter, cipherCrc, msgCrc);
+	}
+	position += blocks * 64;
+	counter += blocks;
+
+	// remaining full blocks and the partial last block
+	for (; position < mlen; position += 64, counter++) {
+		size_t rest = mlen - position < 64 ? mlen - position : 64;
+		crypt_crc_block(rest, msg + position, cipher + position, matrix, counter, 0, cipherCrc, msgCrc);
+	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_X4, mlen);
+}
+
+/*
+ * Salsa20 Encryption / Decryption like salsa20_crypt_offset in a single pass that also returns the CRC32C of the
+ * output ('cipher'); if 'msgCrc' is not NULL it receives the CRC32C of the input ('msg')
+ */
+uint32_t salsa20_crypt_crc32c(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv, uint64_t offset, uint32_t* msgCrc) {
+	uint32_t cipherCrc;
+	crypt_crc32c(mlen, msg, cipher, key, iv, offset, &cipherCrc, msgCrc);
+	return cipherCrc;
+}
+
+/*
+ * Like salsa20_crypt_crc32c, but returns only the CRC32C of the input ('msg'), e.g. of a ciphertext being decrypted
+ */
+uint32_t salsa20_crypt_crc32c_input(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t key[8], uint64_t iv, uint64_t offset) {
+	uint32_t msgCrc;
+	crypt_crc32c(mlen, msg, cipher, key, iv, offset, NULL, &msgCrc);
+	return msgCrc;
+}
+
+/*
+ * Keystream block 'counter' of all four lanes, x[i * 4 + r] = bytes 16 * i .. 16 * i + 15 of lane r
+ */
+static inline void fanout_block_x4(__m128i x[16], __m128i s[16], uint64_t counter) {
+	s[a31] = _mm_set1_epi32(counter);
+	s[a32] = _mm_set1_epi32(counter >> 32);
+	rounds_x4(x, s);
+	for (int i = 0; i < 16; i += 4) {
+		transpose_x4(&x[i], &x[i + 1], &x[i + 2], &x[i + 3]);
+	}
+}
+
+/*
+ * XOR bytes skip .. skip + length - 1 of every lane's keystream block into its output
+ */
+static void fanout_partial_x4(__m128i x[16], const uint8_t* in, uint8_t* const out[4], size_t skip, size_t length) {
+	_Alignas(16) uint8_t keystream[64];
+	for (int r = 0; r < 4; r++) {
+		for (int i = 0; i < 4; i++) {
+			_mm_store_si128((__m128i*)(keystream + i * 16), x[i * 4 + r]);
+		}
+		for (size_t i = 0; i < length; i++) {
+			out[r][i] = in[i] ^ keystream[skip + i];
+		}
+	}
+}
+
+/*
+ * Encryption of msg under four recipients at once: lane r of every register belongs to recipients[r],
+ * all lanes share the block counter
+ */
+static void crypt_fanout_x4(size_t mlen, const uint8_t* msg, size_t position, struct salsa20_recipient* recipients, uint64_t offset) {
+	uint32_t matrices[4][16];
+	uint8_t* out[4];
+	__m128i s[16];
+	__m128i x[16];
+	uint64_t counter = offset / 64;
+	size_t done = 0;
+
+	for (int r = 0; r < 4; r++) {
+		fill_matrix(matrices[r], recipients[r].key, recipients[r].nonce, 0);
+		out[r] = recipients[r].cipher + position;
+	}
+	for (int i = 0; i < 16; i++) {
+		s[i] = _mm_set_epi32(matrices[3][i], matrices[2][i], matrices[1][i], matrices[0][i]);
+	}
+
+	// partially used first block
+	if (offset % 64 != 0 && mlen > 0) {
+		size_t skip = offset % 64;
+		done = mlen < 64 - skip ? mlen : 64 - skip;
+		fanout_block_x4(x, s, counter++);
+		fanout_partial_x4(x, msg, out, skip, done);
+	}
+
+	for (; done + 64 <= mlen; done += 64, counter++) {
+		fanout_block_x4(x, s, counter);
+		for (int i = 0; i < 4; i++) {
+			__m128i m = _mm_loadu_si128((const __m128i*)(msg + done + i * 16));
+			_mm_storeu_si128((__m128i*)(out[0] + done + i * 16), _mm_xor_si128(m, x[i * 4]));
+			_mm_storeu_si128((__m128i*)(out[1] + done + i * 16), _mm_xor_si128(m, x[i * 4 + 1]));
+			_mm_storeu_si128((__m128i*)(out[2] + done + i * 16), _mm_xor_si128(m, x[i * 4 + 2]));
+			_mm_storeu_si128((__m128i*)(out[3] + done + i * 16), _mm_xor_si128(m, x[i * 4 + 3]));
+		}
+	}
+
+	// partial last block
+	if (done < mlen) {
+		uint8_t* tail[4] = { out[0] + done, out[1] + done, out[2] + done, out[3] + done };
+		fanout_block_x4(x, s, counter);
+		fanout_partial_x4(x, msg + done, tail, 0, mlen - done);
+	}
+}
+
+/*
+ * Salsa20 Encryption / Decryption of one message for 'count' recipients, each with its own key, nonce and output
+ * (recipients[r].cipher receives mlen bytes), starting 'offset' bytes into every keystream:
+ * the message is read in slices of FANOUT_SLICE_SIZE bytes that stay in L1 while the keystreams of four
+ * recipients at a time are generated in the SIMD lanes; the last count % 4 recipients get the usual
+ * multi-block kernel each (consecutive counters in all lanes instead of discarded lanes)
+ */
+void salsa20_crypt_fanout(size_t mlen, const uint8_t msg[mlen], struct salsa20_recipient recipients[], int count, uint64_t offset) {
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_FANOUT, mlen * count);
+	for (size_t position = 0; position < mlen; position += FANOUT_SLICE_SIZE) {
+		size_t length = mlen - position < FANOUT_SLICE_SIZE ? mlen - position : FANOUT_SLICE_SIZE;
+		int r = 0;
+		for (; r + 4 <= count; r += 4) {
+			crypt_fanout_x4(length, msg + position, position, &recipients[r], offset + position);
+		}
+		// uninstrumented: the bytes are already counted for the fan-out kernel
+		for (; r < count; r++) {
+			crypt_offset_x4(length, msg + position, recipients[r].cipher + position, recipients[r].key, recipients[r].nonce, offset + position);
+		}
+	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_FANOUT, mlen * count);
+}
+
+/*
+ * Combined keystream of blocks 'counter' and 'counter' + 1 under the old key (lanes 0, 1) and the new key
+ * (lanes 2, 3): k[i] = bytes 16 * i .. 16 * i + 15 of the first block, k[4 + i] of the second
+ */
+static inline void transcrypt_blocks_x4(__m128i k[8], __m128i s[16], uint64_t counter) {
+	__m128i x[16];
+	s[a31] = _mm_set_epi32(counter + 1, counter, counter + 1, counter);
+	s[a32] = _mm_set_epi32((counter + 1) >> 32, counter >> 32, (counter + 1) >> 32, counter >> 32);
+	rounds_x4(x, s);
+	for (int i = 0; i < 16; i += 4) {
+		transpose_x4(&x[i], &x[i + 1], &x[i + 2], &x[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		k[i] = _mm_xor_si128(x[i * 4], x[i * 4 + 2]);
+		k[4 + i] = _mm_xor_si128(x[i * 4 + 1], x[i * 4 + 3]);
+	}
+}
+
+/*
+ * Re-encryption of a ciphertext from (oldKey, oldNonce) to (newKey, newNonce), starting 'offset' bytes into both
+ * keystreams: both keystreams are generated in the same registers and XORed into the data in one pass,
+ * so the plaintext never reaches memory (msg and cipher may be the same buffer)
+ */
+void salsa20_transcrypt(size_t mlen, const uint8_t msg[mlen], uint8_t cipher[mlen], uint32_t oldKey[8], uint64_t oldNonce, uint32_t newKey[8], uint64_t newNonce, uint64_t offset) {
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_TRANSCRYPT, mlen);
+	uint32_t oldMatrix[16];
+	uint32_t newMatrix[16];
+	__m128i s[16];
+	__m128i k[8];
+	uint64_t counter = offset / 64;
+	size_t skip = offset % 64;
+	size_t done = 0;
+
+	fill_matrix(oldMatrix, oldKey, oldNonce, 0);
+	fill_matrix(newMatrix, newKey, newNonce, 0);
+	for (int i = 0; i < 16; i++) {
+		s[i] = _mm_set_epi32(newMatrix[i], newMatrix[i], oldMatrix[i], oldMatrix[i]);
+	}
+
+	while (done < mlen) {
+		transcrypt_blocks_x4(k, s, counter);
+		counter += 2;
+		if (skip == 0 && mlen - done >= 128) {
+			for (int i = 0; i < 8; i++) {
+				__m128i m = _mm_loadu_si128((const __m128i*)(msg + done + i * 16));
+				_mm_storeu_si128((__m128i*)(cipher + done + i * 16), _mm_xor_si128(m, k[i]));
+			}
+			done += 128;
+			continue;
+		}
+		// partially used first or last pair of blocks
+		_Alignas(16) uint8_t keystream[128];
+		for (int i = 0; i < 8; i++) {
+			_mm_store_si128((__m128i*)(keystream + i * 16), k[i]);
+		}
+		size_t length = mlen - done < 128 - skip ? mlen - done : 128 - skip;
+		for (size_t i = 0; i < length; i++) {
+			cipher[done + i] = msg[done + i] ^ keystream[skip + i];
+		}
+		done += length;
+		skip = 0;
+	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_TRANSCRYPT, mlen);
+}
+
+/*
+ * Keystream blocks of four independent counters (one per lane), XORed into their lanes' pieces
+ * (up to 64 bytes each; only the first 'lanes' lanes are used)
+ */
+static inline void gather_x4(__m128i s[16], const uint64_t counters[4], const uint8_t* const in[4], uint8_t* const out[4], const size_t lengths[4], int lanes) {
+	__m128i x[16];
+	s[a31] = _mm_set_epi32(counters[3], counters[2], counters[1], counters[0]);
+	s[a32] = _mm_set_epi32(counters[3] >> 32, counters[2] >> 32, counters[1] >> 32, counters[0] >> 32);
+	rounds_x4(x, s);
+	for (int i = 0; i < 16; i += 4) {
+		transpose_x4(&x[i], &x[i + 1], &x[i + 2], &x[i + 3]);
+	}
+	for (int b = 0; b < lanes; b++) {
+		if (lengths[b] == 64) {
+			for (int i = 0; i < 4; i++) {
+				__m128i m = _mm_loadu_si128((const __m128i*)(in[b] + i * 16));
+				_mm_storeu_si128((__m128i*)(out[b] + i * 16), _mm_xor_si128(m, x[i * 4 + b]));
+			}
+			continue;
+		}
+		_Alignas(16) uint8_t keystream[64];
+		for (int i = 0; i < 4; i++) {
+			_mm_store_si128((__m128i*)(keystream + i * 16), x[i * 4 + b]);
+		}
+		for (size_t i = 0; i < lengths[b]; i++) {
+			out[b][i] = in[b][i] ^ keystream[i];
+		}
+	}
+}
+
+/*
+ * Salsa20 Encryption / Decryption of 'count' independent records under one key and nonce: record r is
+ * records[r].length bytes starting at keystream block records[r].counter (e.g. the row index of a cell, or
+ * row * blocks per cell), in and out of a record may be the same. Groups of four blocks of a record run as usual,
+ * the remaining blocks of all records are gathered four at a time into the SIMD lanes, every lane with its own
+ * counter, so small sparse rows cost no more than contiguous data
+ */
+void salsa20_crypt_gather(uint32_t key[8], uint64_t nonce, const struct salsa20_gather_record records[], size_t count) {
+	// the entry probe reports the length of all records
+	uint64_t bytes = 0;
+	for (size_t r = 0; r < count; r++) {
+		bytes += records[r].length;
+	}
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_GATHER, bytes);
+	uint32_t matrix[16];
+	__m128i s[16];
+	uint64_t counters[4] = { 0 };
+	const uint8_t* in[4];
+	uint8_t* out[4];
+	size_t lengths[4];
+	int lanes = 0;
+
+	fill_matrix(matrix, key, nonce, 0);
+	for (int i = 0; i < 16; i++) {
+		s[i] = _mm_set1_epi32(matrix[i]);
+	}
+	for (size_t r = 0; r < count; r++) {
+		const struct salsa20_gather_record* record = &records[r];
+		// groups of four blocks inside one record: consecutive counters incremented in-register
+		size_t position = record->length >= 4 * 64 ? salsa20_xor_blocks_x4(record->length / 64, record->in, record->out, matrix, record->counter) * 64 : 0;
+		for (; position < record->length; position += 64) {
+			counters[lanes] = record->counter + position / 64;
+			in[lanes] = record->in + position;
+			out[lanes] = record->out + position;
+			lengths[lanes] = record->length - position < 64 ? record->length - position : 64;
+			if (++lanes == 4) {
+				gather_x4(s, counters, in, out, lengths, 4);
+				lanes = 0;
+			}
+		}
+	}
+	if (lanes > 0) {
+		gather_x4(s, counters, in, out, lengths, lanes);
+	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_GATHER, bytes);
+}
+
+/*
+ * Salsa20 Encryption / Decryption of a scatter-gather message: the n input segments are XORed into the m output
+ * segments as one stream starting 'offset' bytes into the keystream; segment boundaries of both sides may differ
+ * and may fall anywhere inside a block (the block is generated once and reused for every piece of it)
+ * Returns the number of bytes processed (the smaller of both total lengths)
+ */
+size_t salsa20_cryptv(uint32_t key[8], uint64_t iv, uint64_t offset, const struct iovec* in, int n, const struct iovec* out, int m) {
+	// the entry probe reports the length that will be processed
+	size_t inLength = 0;
+	size_t outLength = 0;
+	for (int k = 0; k < n; k++) {
+		inLength += in[k].iov_len;
+	}
+	for (int k = 0; k < m; k++) {
+		outLength += out[k].iov_len;
+	}
+	SALSA20_CRYPT_BEGIN(SALSA20_KERNEL_VECTOR, inLength < outLength ? inLength : outLength);
+	uint32_t matrix[16] = { 0 };
+	uint32_t salsaBlock[16] = { 0 };
+	const uint8_t* cipherStream = (const uint8_t*)salsaBlock;
+	uint64_t blockCounter = 0;
+	bool isBlockValid = false;
+	uint64_t position = offset;
+	size_t inPosition = 0;
+	size_t outPosition = 0;
+	int i = 0;
+	int j = 0;
+
+	fill_matrix(matrix, key, iv, 0);
+	while (i < n && j < m) {
+		if (inPosition == in[i].iov_len) {
+			i++;
+			inPosition = 0;
+			continue;
+		}
+		if (outPosition == out[j].iov_len) {
+			j++;
+			outPosition = 0;
+			continue;
+		}
+		const uint8_t* msg = (const uint8_t*)in[i].iov_base + inPosition;
+		uint8_t* cipher = (uint8_t*)out[j].iov_base + outPosition;
+		size_t run = in[i].iov_len - inPosition < out[j].iov_len - outPosition ? in[i].iov_len - inPosition : out[j].iov_len - outPosition;
+
+		for (size_t done = 0; done < run;) {
+			uint64_t counter = (position + done) / 64;
+			size_t skip = (position + done) % 64;
+
+			// long block-aligned run inside both segments: bulk SIMD path
+			if (skip == 0 && run - done >= 4 * 64) {
+				done += salsa20_xor_blocks_x4((run - done) / 64, msg + done, cipher + done, matrix, counter) * 64;
+				continue;
+			}
+
+			if (!isBlockValid || blockCounter != counter) {
+				matrix[a31] = counter;
+				matrix[a32] = counter >> 32;
+				salsa20_core(salsaBlock, matrix);
+				blockCounter = counter;
+				isBlockValid = true;
+			}
+			size_t rest = run - done < 64 - skip ? run - done : 64 - skip;
+			for (size_t k = 0; k < rest; k++) {
+				cipher[done + k] = msg[done + k] ^ cipherStream[skip + k];
+			}
+			done += rest;
+		}
+		position += run;
+		inPosition += run;
+		outPosition += run;
+	}
+	SALSA20_CRYPT_END(SALSA20_KERNEL_VECTOR, position - offset);
+	return position - offset;
+}
@@ -0,0 +1,332 @@
+/*
+ * Lazily decrypted memory view (see salsa20_view.h)
+ * -> the whole file is reserved as PROT_NONE; the SIGSEGV handler decrypts a faulting page into a fresh anonymous
+ *    page and moves that into place with mremap, so other threads never see a page that is mapped but not yet
+ *    decrypted. Evicting maps PROT_NONE over a page again, which also returns its memory.
+ *    Everything the handler calls is async-signal-safe (system calls and the pure, uninstrumented kernels).
+ */
+#define _GNU_SOURCE // mremap
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "salsa20.h"
+#include "salsa20_view.h"
+
+struct salsa20_view {
+	uint8_t* base;
+	size_t mappedSize;
+	uint64_t size;
+	int fd;
+	uint32_t key[8];
+	uint64_t nonce;
+	size_t pageSize;
+	size_t pageCount;
+	size_t readahead;
+	size_t maxResident;
+	int slot;
+	// everything below is guarded by lock (a spinlock, the only lock usable in a signal handler)
+	atomic_flag lock;
+	uint8_t* resident;
+	// decrypted pages in the order they were decrypted (ring of maxResident entries)
+	size_t* fifo;
+	size_t fifoHead;
+	size_t fifoCount;
+	struct salsa20_view_stats stats;
+};
+
+static _Atomic(struct salsa20_view*) views[SALSA20_VIEW_MAX_VIEWS];
+static struct sigaction previousAction;
+static pthread_once_t handlerOnce = PTHREAD_ONCE_INIT;
+static bool isHandlerInstalled = false;
+// last fault of this thread on a page that was already resident, and the decrypted page count at that time
+static _Thread_local const uint8_t* retriedPage = NULL;
+static _Thread_local uint64_t retriedMapping = 0;
+
+static void lock_view(struct salsa20_view* view) {
+	while (atomic_flag_test_and_set_explicit(&view->lock, memory_order_acquire)) {
+		sched_yield();
+	}
+}
+
+static void unlock_view(struct salsa20_view* view) {
+	atomic_flag_clear_explicit(&view->lock, memory_order_release);
+}
+
+/*
+ * Decrypts 'length' bytes at file offset 'offset' (a multiple of 64) in place
+ */
+static void decrypt_page(struct salsa20_view* view, uint8_t* page, size_t length, uint64_t offset) {
+	uint32_t matrix[16];
+	uint32_t salsaBlock[16];
+	const uint8_t* cipherStream = (const uint8_t*)salsaBlock;
+	uint64_t counter = offset / 64;
+
+	fill_matrix(matrix, view->key, view->nonce, counter);
+	size_t blocks = salsa20_xor_blocks_x4(length / 64, page, page, matrix, counter);
+	counter += blocks;
+	for (size_t position = blocks * 64; position < length; position += 64, counter++) {
+		matrix[a31] = counter;
+		matrix[a32] = counter >> 32;
+		salsa20_core(salsaBlock, matrix);
+		size_t rest = length - position < 64 ? length - position : 64;
+		for (size_t i = 0; i < rest; i++) {
+			page[position + i] ^= cipherStream[i];
+		}
+	}
+}
+
+static void evict_oldest(struct salsa20_view* view) {
+	size_t page = view->fifo[view->fifoHead];
+	view->fifoHead = (view->fifoHead + 1) % view->maxResident;
+	view->fifoCount--;
+	mmap(view->base + page * view->pageSize, view->pageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	view->resident[page] = 0;
+	view->stats.residentPages--;
+	view->stats.evictions++;
+}
+
+/*
+ * Reads, decrypts and maps page 'page' (view locked)
+ * Returns false on an I/O or mapping error
+ */
+static bool map_page(struct salsa20_view* view, size_t page) {
+	if (view->maxResident > 0 && view->stats.residentPages >= view->maxResident) {
+		evict_oldest(view);
+	}
+	uint8_t* staging = (uint8_t*)mmap(NULL, view->pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (staging == MAP_FAILED) {
+		return false;
+	}
+	const uint64_t offset = (uint64_t)page * view->pageSize;
+	const size_t length = view->size - offset < view->pageSize ? view->size - offset : view->pageSize;
+
+	// a file that shrank since the view was opened reads as zeros behind its end
+	size_t done = 0;
+	while (done < length) {
+		ssize_t count = pread(view->fd, staging + done, length - done, offset + done);
+		if (count < 0 && errno == EINTR) continue;
+		if (count < 0) {
+			munmap(staging, view->pageSize);
+			return false;
+		}
+		if (count == 0) break;
+		done += count;
+	}
+	decrypt_page(view, staging, length, offset);
+
+	if (mprotect(staging, view->pageSize, PROT_READ) != 0
+		|| mremap(staging, view->pageSize, view->pageSize, MREMAP_MAYMOVE | MREMAP_FIXED, view->base + offset) == MAP_FAILED) {
+		munmap(staging, view->pageSize);
+		return false;
+	}
+	view->resident[page] = 1;
+	if (view->maxResident > 0) {
+		view->fifo[(view->fifoHead + view->fifoCount) % view->maxResident] = page;
+		view->fifoCount++;
+	}
+	view->stats.residentPages++;
+	view->stats.decryptedPages++;
+	return true;
+}
+
+/*
+ * Makes the faulting page and its readahead window resident (view locked)
+ */
+static bool fault_in(struct salsa20_view* view, size_t page) {
+	view->stats.faults++;
+	if (!map_page(view, page)) {
+		return false;
+	}
+	// the readahead must not evict the page just faulted in
+	size_t readahead = view->readahead;
+	if (view->maxResident > 0 && readahead > view->maxResident - 1) {
+		readahead = view->maxResident - 1;
+	}
+	for (size_t next = page + 1; next <= page + readahead && next < view->pageCount; next++) {
+		if (!view->resident[next]) {
+			if (!map_page(view, next)) {
+				return false;
+			}
+			view->stats.readaheadPages++;
+		}
+	}
+	return true;
+}
+
+static void handle_fault(int signal, siginfo_t* info, void* context) {
+	// the interrupted code may be between a call and its errno check
+	const int savedErrno = errno;
+	uint8_t* address = (uint8_t*)info->si_addr;
+	for (int i = 0; i < SALSA20_VIEW_MAX_VIEWS; i++) {
+		struct salsa20_view* view = atomic_load(&views[i]);
+		if (view != NULL && address >= view->base && address < view->base + view->mappedSize) {
+			// a load behind the last page of the file, or an I/O error: SIGBUS like a file mapping
+			const uint64_t position = address - view->base;
+			if (position >= view->pageCount * view->pageSize) {
+				raise(SIGBUS);
+				return;
+			}
+			const size_t page = position / view->pageSize;
+			bool isOurs = true;
+			bool isMapped = true;
+			lock_view(view);
+			if (view->resident[page]) {
+				// another thread faulted on the same page first and the retry succeeds, or a store to the read-only
+				// page: faulting again on the same mapping of the page is not ours
+				const uint8_t* pageAddress = view->base + page * view->pageSize;
+				isOurs = retriedPage != pageAddress || retriedMapping != view->stats.decryptedPages;
+				retriedPage = pageAddress;
+				retriedMapping = view->stats.decryptedPages;
+			}
+			else {
+				isMapped = fault_in(view, page);
+			}
+			unlock_view(view);
+			if (isOurs) {
+				if (!isMapped) {
+					raise(SIGBUS);
+				}
+				errno = savedErrno;
+				return;
+			}
+			break;
+		}
+	}
+
+	// not a view (or a store to one): whoever handled SIGSEGV before
+	if (previousAction.sa_flags & SA_SIGINFO) {
+		previousAction.sa_sigaction(signal, info, context);
+	}
+	else if (previousAction.sa_handler != SIG_DFL && previousAction.sa_handler != SIG_IGN) {
+		previousAction.sa_handler(signal);
+	}
+	else {
+		// the faulting instruction runs again and gets the default action
+		struct sigaction defaultAction;
+		memset(&defaultAction, 0, sizeof(defaultAction));
+		defaultAction.sa_handler = SIG_DFL;
+		sigaction(SIGSEGV, &defaultAction, NULL);
+	}
+}
+
+static void install_handler(void) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = handle_fault;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	isHandlerInstalled = sigaction(SIGSEGV, &action, &previousAction) == 0;
+}
+
+/*
+ * Opens a view of the encrypted file 'path' (options may be NULL for the defaults)
+ * Returns NULL with errno set on failure (EINVAL for a page size that is not a multiple of the system page size,
+ * EMFILE if SALSA20_VIEW_MAX_VIEWS views are open)
+ */
+struct salsa20_view* salsa20_view_open(const char* path, uint32_t key[8], uint64_t nonce, const struct salsa20_view_options* options) {
+	const size_t systemPageSize = sysconf(_SC_PAGESIZE);
+	struct salsa20_view_options defaults = { 0, 0, 0 };
+	if (options == NULL) {
+		options = &defaults;
+	}
+	size_t pageSize = options->pageSize ? options->pageSize : SALSA20_VIEW_DEFAULT_PAGE_SIZE;
+	if (pageSize % systemPageSize != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_once(&handlerOnce, install_handler);
+	if (!isHandlerInstalled) {
+		return NULL;
+	}
+
+	struct salsa20_view* view = (struct salsa20_view*)calloc(1, sizeof(struct salsa20_view));
+	if (view == NULL) {
+		return NULL;
+	}
+	view->fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat fileStat;
+	if (view->fd < 0 || fstat(view->fd, &fileStat) != 0) {
+		int error = errno;
+		if (view->fd >= 0) close(view->fd);
+		free(view);
+		errno = error;
+		return NULL;
+	}
+	memcpy(view->key, key, sizeof(view->key));
+	view->nonce = nonce;
+	view->size = fileStat.st_size;
+	view->pageSize = pageSize;
+	view->pageCount = (view->size + pageSize - 1) / pageSize;
+	view->readahead = options->readahead;
+	view->maxResident = options->maxResident;
+	atomic_flag_clear(&view->lock);
+
+	// at least one page, so an empty file still has an address
+	view->mappedSize = view->pageCount > 0 ? view->pageCount * pageSize : pageSize;
+	view->base = (uint8_t*)mmap(NULL, view->mappedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	view->resident = (uint8_t*)calloc(view->pageCount > 0 ? view->pageCount : 1, 1);
+	view->fifo = view->maxResident > 0 ? (size_t*)malloc(view->maxResident * sizeof(size_t)) : NULL;
+	view->slot = -1;
+	if (view->base != MAP_FAILED && view->resident != NULL && (view->maxResident == 0 || view->fifo != NULL)) {
+		for (int i = 0; i < SALSA20_VIEW_MAX_VIEWS && view->slot < 0; i++) {
+			struct salsa20_view* empty = NULL;
+			if (atomic_compare_exchange_strong(&views[i], &empty, view)) {
+				view->slot = i;
+			}
+		}
+		if (view->slot >= 0) {
+			return view;
+		}
+		errno = EMFILE;
+	}
+	int error = errno;
+	if (view->base != MAP_FAILED) munmap(view->base, view->mappedSize);
+	free(view->resident);
+	free(view->fifo);
+	close(view->fd);
+	free(view);
+	errno = error;
+	return NULL;
+}
+
+/*
+ * Plaintext of the whole file, read-only
+ */
+const uint8_t* salsa20_view_data(const struct salsa20_view* view) {
+	return view->base;
+}
+
+uint64_t salsa20_view_size(const struct salsa20_view* view) {
+	return view->size;
+}
+
+void salsa20_view_get_stats(struct salsa20_view* view, struct salsa20_view_stats* stats) {
+	lock_view(view);
+	*stats = view->stats;
+	unlock_view(view);
+}
+
+/*
+ * Unmaps the view; no thread may access it any more
+ */
+int salsa20_view_close(struct salsa20_view* view) {
+	atomic_store(&views[view->slot], NULL);
+	int result = munmap(view->base, view->mappedSize);
+	if (close(view->fd) != 0) {
+		result = -1;
+	}
+	memset(view->key, 0, sizeof(view->key));
+	free(view->resident);
+	free(view->fifo);
+	free(view);
+	return result;
+}
@@ -0,0 +1,48 @@
+#ifndef TEAM152_SALSA20_VIEW_H
+#define TEAM152_SALSA20_VIEW_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lazily decrypted read-only memory view of an encrypted file (ciphertext = plaintext XOR keystream, byte i of the
+ * file at keystream position i, e.g. written by the CLI or salsa20_file.h)
+ *
+ * salsa20_view_open reserves address space for the whole file without reading it. The first load from a page
+ * raises SIGSEGV; the handler reads that page (and 'readahead' following pages) from the file, decrypts it with the
+ * keystream of its offset and maps it in place read-only, so only touched pages cost I/O, crypto and memory.
+ * With 'maxResident' set, the oldest decrypted pages are dropped again (FIFO) and decrypted anew on the next access.
+ *
+ * Only loads of the process itself fault in pages: passing view memory to a system call (write, send, ...) before
+ * it was touched fails with EFAULT. An I/O error while faulting in a page raises SIGBUS, as with mmap.
+ * (userfaultfd would avoid the signal handler, but it is unavailable to unprivileged processes on most systems)
+ */
+#define SALSA20_VIEW_MAX_VIEWS 64
+// one fault, read and mapping per 64 KiB (also keeps the number of memory mappings low, see vm.max_map_count)
+#define SALSA20_VIEW_DEFAULT_PAGE_SIZE (64 << 10)
+
+struct salsa20_view_options {
+	// bytes per page, a multiple of the system page size (0: SALSA20_VIEW_DEFAULT_PAGE_SIZE)
+	size_t pageSize;
+	// pages decrypted after the faulting one if they are not resident yet
+	size_t readahead;
+	// upper bound of decrypted pages (0: no bound)
+	size_t maxResident;
+};
+
+struct salsa20_view_stats {
+	uint64_t faults;
+	uint64_t decryptedPages;
+	uint64_t readaheadPages;
+	uint64_t evictions;
+	uint64_t residentPages;
+};
+
+struct salsa20_view;
+
+struct salsa20_view* salsa20_view_open(const char* path, uint32_t key[8], uint64_t nonce, const struct salsa20_view_options* options);
+const uint8_t* salsa20_view_data(const struct salsa20_view* view);
+uint64_t salsa20_view_size(const struct salsa20_view* view);
+void salsa20_view_get_stats(struct salsa20_view* view, struct salsa20_view_stats* stats);
+int salsa20_view_close(struct salsa20_view* view);
+#endif
@@ -0,0 +1,407 @@
+/*
+ * Salsa20 daemon
+ * -> keeps event loop threads and connection buffers alive and encrypts framed requests
+ *    received over a Unix domain socket (wire format in server.h)
+ *
+ * Every thread runs its own epoll loop and accepts from the shared listening socket (EPOLLEXCLUSIVE).
+ * All complete requests read in one epoll_wait round form a batch; full groups of four blocks use
+ * the multi-block kernel per request, leftover blocks of all requests in the batch share its lanes.
+ */
+#define _GNU_SOURCE // accept4
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "salsa20.h"
+#include "server.h"
+#include "utils.h"
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE 65536
+
+struct connection {
+	int fd;
+	uint8_t* in;
+	size_t inLength;
+	size_t inCapacity;
+	size_t inConsumed;
+	uint8_t* out;
+	size_t outLength;
+	size_t outCapacity;
+	size_t outSent;
+	bool wantsWrite;
+	bool peerClosed;
+	bool failed;
+};
+
+struct request {
+	uint32_t matrix[16];
+	const uint8_t* payload;
+	uint8_t* cipher;
+	uint32_t length;
+};
+
+struct event_loop {
+	int epollFd;
+	int listenFd;
+	struct request* batch;
+	size_t batchLength;
+	size_t batchCapacity;
+	struct connection** touched;
+	size_t touchedLength;
+	size_t touchedCapacity;
+};
+
+/*
+ * Grows *buffer to hold at least 'needed' bytes (capacity doubles, the memory is kept for later requests)
+ */
+static void reserve(uint8_t** buffer, size_t* capacity, size_t needed) {
+	if (needed <= *capacity) {
+		return;
+	}
+	size_t newCapacity = *capacity ? *capacity : SERVER_READ_SIZE;
+	while (newCapacity < needed) {
+		newCapacity *= 2;
+	}
+	uint8_t* newBuffer = (uint8_t*)realloc(*buffer, newCapacity);
+	if (newBuffer == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	*buffer = newBuffer;
+	*capacity = newCapacity;
+}
+
+static uint32_t load_u32(const uint8_t* p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint64_t load_u64(const uint8_t* p) {
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+/*
+ * XOR the keystream blocks of up to four lanes (each lane one block of some request)
+ */
+static void flush_lanes(uint32_t lanes[4][16], const uint8_t* msg[4], uint8_t* cipher[4], size_t length[4], int used) {
+	uint32_t keystream[4][16];
+	// unused lanes repeat lane 0, the kernel always computes four blocks
+	for (int lane = used; lane < 4; lane++) {
+		memcpy(lanes[lane], lanes[0], sizeof(lanes[0]));
+	}
+	salsa20_core_x4(keystream, (const uint32_t(*)[16])lanes);
+	for (int lane = 0; lane < used; lane++) {
+		const uint8_t* stream = (const uint8_t*)keystream[lane];
+		for (size_t i = 0; i < length[lane]; i++) {
+			cipher[lane][i] = msg[lane][i] ^ stream[i];
+		}
+	}
+}
+
+/*
+ * Encrypts all requests of one epoll round
+ */
+static void crypt_batch(struct request* batch, size_t count) {
+	uint32_t lanes[4][16];
+	const uint8_t* msg[4];
+	uint8_t* cipher[4];
+	size_t length[4];
+	int used = 0;
+
+	for (size_t r = 0; r < count; r++) {
+		struct request* request = &batch[r];
+		size_t done = salsa20_xor_blocks_x4(request->length / 64, request->payload, request->cipher, request->matrix, 0);
+
+		// remaining full blocks and the tail go into shared lanes
+		for (size_t offset = done * 64; offset < request->length; offset += 64, done++) {
+			memcpy(lanes[used], request->matrix, sizeof(lanes[used]));
+			lanes[used][a31] = done;
+			lanes[used][a32] = (uint64_t)done >> 32;
+			msg[used] = request->payload + offset;
+			cipher[used] = request->cipher + offset;
+			length[used] = request->length - offset < 64 ? request->length - offset : 64;
+			if (++used == 4) {
+				flush_lanes(lanes, msg, cipher, length, used);
+				used = 0;
+			}
+		}
+	}
+	if (used > 0) {
+		flush_lanes(lanes, msg, cipher, length, used);
+	}
+}
+
+static void set_write_interest(struct event_loop* loop, struct connection* connection, bool wantsWrite) {
+	if (connection->wantsWrite == wantsWrite) {
+		return;
+	}
+	struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET | (wantsWrite ? EPOLLOUT : 0), .data.ptr = connection };
+	if (epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, connection->fd, &event) != 0) {
+		connection->failed = true;
+		return;
+	}
+	connection->wantsWrite = wantsWrite;
+}
+
+/*
+ * Writes as much of the pending output as the socket accepts
+ */
+static void flush_output(struct event_loop* loop, struct connection* connection) {
+	while (connection->outSent < connection->outLength) {
+		ssize_t written = send(connection->fd, connection->out + connection->outSent, connection->outLength - connection->outSent, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			connection->failed = true;
+			return;
+		}
+		connection->outSent += written;
+	}
+	if (connection->outSent == connection->outLength) {
+		connection->outSent = connection->outLength = 0;
+	}
+	set_write_interest(loop, connection, connection->outLength > 0);
+}
+
+/*
+ * Reads until EAGAIN (edge-triggered)
+ */
+static void read_input(struct connection* connection) {
+	for (;;) {
+		reserve(&connection->in, &connection->inCapacity, connection->inLength + SERVER_READ_SIZE);
+		ssize_t received = read(connection->fd, connection->in + connection->inLength, connection->inCapacity - connection->inLength);
+		if (received > 0) {
+			connection->inLength += received;
+			continue;
+		}
+		if (received == 0) {
+			connection->peerClosed = true;
+		}
+		else if (errno == EINTR) {
+			continue;
+		}
+		else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			connection->failed = true;
+		}
+		return;
+	}
+}
+
+/*
+ * Adds every complete request in the input buffer to the batch and reserves its response in the output buffer
+ */
+static void parse_requests(struct event_loop* loop, struct connection* connection) {
+	// first pass: count complete frames and the response space they need
+	size_t position = 0;
+	size_t responseBytes = 0;
+	size_t frames = 0;
+	while (connection->inLength - position >= SERVER_REQUEST_HEADER_SIZE) {
+		uint32_t length = load_u32(connection->in + position);
+		if (length > SERVER_MAX_PAYLOAD) {
+			connection->failed = true;
+			return;
+		}
+		if (connection->inLength - position < SERVER_REQUEST_HEADER_SIZE + (size_t)length) {
+			break;
+		}
+		position += SERVER_REQUEST_HEADER_SIZE + length;
+		responseBytes += SERVER_RESPONSE_HEADER_SIZE + length;
+		frames++;
+	}
+	if (frames == 0) {
+		return;
+	}
+
+	// output buffer is not touched again until the batch is done, so pointers into it stay valid
+	if (connection->outSent > 0) {
+		memmove(connection->out, connection->out + connection->outSent, connection->outLength - connection->outSent);
+		connection->outLength -= connection->outSent;
+		connection->outSent = 0;
+	}
+	reserve(&connection->out, &connection->outCapacity, connection->outLength + responseBytes);
+	if (loop->batchLength + frames > loop->batchCapacity) {
+		size_t capacity = loop->batchCapacity ? loop->batchCapacity : 64;
+		while (capacity < loop->batchLength + frames) {
+			capacity *= 2;
+		}
+		loop->batch = (struct request*)realloc(loop->batch, capacity * sizeof(struct request));
+		if (loop->batch == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+		loop->batchCapacity = capacity;
+	}
+
+	// second pass: fill the batch
+	position = 0;
+	for (size_t i = 0; i < frames; i++) {
+		const uint8_t* header = connection->in + position;
+		uint32_t length = load_u32(header);
+		uint32_t key[8];
+		for (int k = 0; k < 8; k++) {
+			key[k] = load_u32(header + 4 + 4 * k);
+		}
+		struct request* request = &loop->batch[loop->batchLength++];
+		fill_matrix(request->matrix, key, load_u64(header + 36), 0);
+		request->payload = header + SERVER_REQUEST_HEADER_SIZE;
+		request->length = length;
+		memcpy(connection->out + connection->outLength, &length, sizeof(length));
+		request->cipher = connection->out + connection->outLength + SERVER_RESPONSE_HEADER_SIZE;
+		connection->outLength += SERVER_RESPONSE_HEADER_SIZE + length;
+		position += SERVER_REQUEST_HEADER_SIZE + length;
+	}
+	connection->inConsumed = position;
+}
+
+static void close_connection(struct event_loop* loop, struct connection* connection) {
+	epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+	close(connection->fd);
+	free(connection->in);
+	free(connection->out);
+	free(connection);
+}
+
+static void accept_connections(struct event_loop* loop) {
+	for (;;) {
+		int fd = accept4(loop->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			// EAGAIN: another loop took it or the queue is empty
+			return;
+		}
+		struct connection* connection = (struct connection*)calloc(1, sizeof(struct connection));
+		if (connection == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+		connection->fd = fd;
+		struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = connection };
+		if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+			close(fd);
+			free(connection);
+		}
+	}
+}
+
+static void remember_touched(struct event_loop* loop, struct connection* connection) {
+	if (loop->touchedLength == loop->touchedCapacity) {
+		loop->touchedCapacity = loop->touchedCapacity ? loop->touchedCapacity * 2 : SERVER_MAX_EVENTS;
+		loop->touched = (struct connection**)realloc(loop->touched, loop->touchedCapacity * sizeof(struct connection*));
+		if (loop->touched == NULL) {
+			throw_perror("An error occurred when allocating memory");
+		}
+	}
+	loop->touched[loop->touchedLength++] = connection;
+}
+
+static void* run_event_loop(void* argument) {
+	struct event_loop* loop = (struct event_loop*)argument;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+
+	for (;;) {
+		int count = epoll_wait(loop->epollFd, events, SERVER_MAX_EVENTS, -1);
+		if (count < 0) {
+			if (errno == EINTR) continue;
+			throw_perror("An error occurred when waiting for events");
+		}
+
+		loop->batchLength = 0;
+		loop->touchedLength = 0;
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.ptr == NULL) {
+				accept_connections(loop);
+				continue;
+			}
+			struct connection* connection = (struct connection*)events[i].data.ptr;
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				read_input(connection);
+				if (!connection->failed) {
+					parse_requests(loop, connection);
+				}
+			}
+			remember_touched(loop, connection);
+		}
+
+		crypt_batch(loop->batch, loop->batchLength);
+
+		for (size_t i = 0; i < loop->touchedLength; i++) {
+			struct connection* connection = loop->touched[i];
+			if (connection->inConsumed > 0) {
+				memmove(connection->in, connection->in + connection->inConsumed, connection->inLength - connection->inConsumed);
+				connection->inLength -= connection->inConsumed;
+				connection->inConsumed = 0;
+			}
+			if (!connection->failed) {
+				flush_output(loop, connection);
+			}
+			if (connection->failed || (connection->peerClosed && connection->outLength == 0)) {
+				close_connection(loop, connection);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Listens on 'socketPath' and serves requests with 'threads' event loops, never returns
+ */
+void run_server(const char* socketPath, int threads) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(socketPath) >= sizeof(address.sun_path)) {
+		throw_error("Socket path is too long");
+	}
+	if (threads <= 0) {
+		throw_error("Too few threads specified");
+	}
+	strcpy(address.sun_path, socketPath);
+	signal(SIGPIPE, SIG_IGN);
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenFd < 0) {
+		throw_perror("An error occurred when creating the socket");
+	}
+	// remove a stale socket of an earlier run
+	unlink(socketPath);
+	if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		throw_perror("An error occurred when binding the socket");
+	}
+	if (listen(listenFd, SOMAXCONN) != 0) {
+		throw_perror("An error occurred when listening on the socket");
+	}
+
+	struct event_loop* loops = (struct event_loop*)calloc(threads, sizeof(struct event_loop));
+	if (loops == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	for (int i = 0; i < threads; i++) {
+		loops[i].listenFd = listenFd;
+		loops[i].epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (loops[i].epollFd < 0) {
+			throw_perror("An error occurred when creating the epoll instance");
+		}
+		// data.ptr == NULL marks the listening socket
+		struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+		if (epoll_ctl(loops[i].epollFd, EPOLL_CTL_ADD, listenFd, &event) != 0) {
+			throw_perror("An error occurred when registering the socket");
+		}
+	}
+
+	printf("Listening on %s with %d threads\n", socketPath, threads);
+	fflush(stdout);
+
+	for (int i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, run_event_loop, &loops[i]) != 0) {
+			throw_error("An error occurred when creating a thread");
+		}
+		pthread_detach(thread);
+	}
+	run_event_loop(&loops[0]);
+}
@@ -0,0 +1,27 @@
+#ifndef TEAM152_SERVER_H
+#define TEAM152_SERVER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Wire format (all integers little-endian)
+ * Request:  uint32 length | uint32 key[8] | uint64 nonce | <length> bytes payload
+ * Response: uint32 length | <length> bytes ciphertext
+ * Requests may be pipelined, responses are returned in request order per connection
+ */
+#define SERVER_REQUEST_HEADER_SIZE 44
+#define SERVER_RESPONSE_HEADER_SIZE 4
+#define SERVER_MAX_PAYLOAD (64U << 20)
+
+struct loadgen_options {
+	const char* socketPath;
+	int connections;
+	int depth;
+	size_t payloadSize;
+	double duration;
+};
+
+void run_server(const char* socketPath, int threads);
+void run_loadgen(const struct loadgen_options* options);
+#endif
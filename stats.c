@@ -0,0 +1,75 @@
+/*
+ * Statistics of the crypt functions (see stats.h), empty unless compiled with -DSALSA20_STATS
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "utils.h"
+
+const char* const salsa20KernelNames[SALSA20_KERNEL_COUNT] = { "V0", "V1", "V2", "V3", "V4", "x4", "hybrid", "fanout", "transcrypt", "gather", "vector" };
+
+#ifdef SALSA20_STATS
+_Thread_local struct salsa20_stats_block* salsa20StatsBlock = NULL;
+static struct salsa20_stats_block* statsBlocks = NULL;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct salsa20_stats_block* salsa20_stats_register(void) {
+	struct salsa20_stats_block* block = (struct salsa20_stats_block*)calloc(1, sizeof(struct salsa20_stats_block));
+	if (block == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	pthread_mutex_lock(&statsLock);
+	block->next = statsBlocks;
+	statsBlocks = block;
+	pthread_mutex_unlock(&statsLock);
+	salsa20StatsBlock = block;
+	return block;
+}
+#endif
+
+bool salsa20_stats_enabled(void) {
+#ifdef SALSA20_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Sum of the counters of all threads (all zero without -DSALSA20_STATS)
+ */
+void salsa20_stats_get(struct salsa20_stats* stats) {
+	memset(stats, 0, sizeof(*stats));
+#ifdef SALSA20_STATS
+	pthread_mutex_lock(&statsLock);
+	for (struct salsa20_stats_block* block = statsBlocks; block != NULL; block = block->next) {
+		stats->bytes += atomic_load_explicit(&block->bytes, memory_order_relaxed);
+		stats->tailBytes += atomic_load_explicit(&block->tailBytes, memory_order_relaxed);
+		for (int k = 0; k < SALSA20_KERNEL_COUNT; k++) {
+			stats->kernelCalls[k] += atomic_load_explicit(&block->kernelCalls[k], memory_order_relaxed);
+			stats->calls += atomic_load_explicit(&block->kernelCalls[k], memory_order_relaxed);
+			stats->kernelCycles[k] += atomic_load_explicit(&block->kernelCycles[k], memory_order_relaxed);
+		}
+	}
+	pthread_mutex_unlock(&statsLock);
+#endif
+}
+
+void salsa20_stats_print(void) {
+	if (!salsa20_stats_enabled()) {
+		printf("Statistics are not compiled in (make STATS=1)\n");
+		return;
+	}
+	struct salsa20_stats stats;
+	salsa20_stats_get(&stats);
+	printf("crypt calls: %llu | bytes: %llu | tail bytes: %llu\n", (unsigned long long)stats.calls,
+		(unsigned long long)stats.bytes, (unsigned long long)stats.tailBytes);
+	printf("%-8s %12s %16s %14s\n", "kernel", "calls", "TSC cycles", "cycles/call");
+	for (int k = 0; k < SALSA20_KERNEL_COUNT; k++) {
+		if (stats.kernelCalls[k] == 0) continue;
+		printf("%-8s %12llu %16llu %14.1f\n", salsa20KernelNames[k], (unsigned long long)stats.kernelCalls[k],
+			(unsigned long long)stats.kernelCycles[k], (double)stats.kernelCycles[k] / stats.kernelCalls[k]);
+	}
+}
@@ -0,0 +1,114 @@
+#ifndef TEAM152_STATS_H
+#define TEAM152_STATS_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Instrumentation of the crypt functions, both parts compile out completely unless enabled:
+ *
+ * -DSALSA20_PROBES   USDT probes salsa20:crypt__entry and salsa20:crypt__return (needs <sys/sdt.h>),
+ *                    arguments: kernel name (char*), message length, block count, e.g.
+ *                    bpftrace -e 'usdt:./salsa20:salsa20:crypt__entry { @[str(arg0)] = hist(arg1); }'
+ * -DSALSA20_STATS    per-thread counter block (calls, bytes, tail bytes, calls and TSC cycles per kernel,
+ *                    cycles sampled every SALSA20_STATS_SAMPLE-th call), summed over all threads by salsa20_stats_get
+ *
+ * (make STATS=1 PROBES=1)
+ */
+enum salsa20_kernel {
+	SALSA20_KERNEL_V0,
+	SALSA20_KERNEL_V1,
+	SALSA20_KERNEL_V2,
+	SALSA20_KERNEL_V3,
+	SALSA20_KERNEL_V4,
+	SALSA20_KERNEL_X4,
+	SALSA20_KERNEL_HYBRID,
+	SALSA20_KERNEL_FANOUT,
+	SALSA20_KERNEL_TRANSCRYPT,
+	SALSA20_KERNEL_GATHER,
+	SALSA20_KERNEL_VECTOR,
+	SALSA20_KERNEL_COUNT
+};
+
+struct salsa20_stats {
+	uint64_t calls;
+	uint64_t bytes;
+	// bytes of partial last blocks
+	uint64_t tailBytes;
+	uint64_t kernelCalls[SALSA20_KERNEL_COUNT];
+	uint64_t kernelCycles[SALSA20_KERNEL_COUNT];
+};
+
+extern const char* const salsa20KernelNames[SALSA20_KERNEL_COUNT];
+
+bool salsa20_stats_enabled(void);
+void salsa20_stats_get(struct salsa20_stats* stats);
+void salsa20_stats_print(void);
+
+#ifdef SALSA20_PROBES
+#include <sys/sdt.h>
+#define SALSA20_PROBE(name, kernel, mlen) DTRACE_PROBE3(salsa20, name, salsa20KernelNames[kernel], (uint64_t)(mlen), ((uint64_t)(mlen) + 63) / 64)
+#else
+#define SALSA20_PROBE(name, kernel, mlen) do { } while (0)
+#endif
+
+#ifdef SALSA20_STATS
+#include <stdatomic.h>
+
+// counters of one thread: only that thread writes (plain load + store), readers may sum them at any time
+// (no total call counter: it is the sum of kernelCalls, one store less per call)
+struct salsa20_stats_block {
+	atomic_uint_fast64_t bytes;
+	atomic_uint_fast64_t tailBytes;
+	atomic_uint_fast64_t kernelCalls[SALSA20_KERNEL_COUNT];
+	atomic_uint_fast64_t kernelCycles[SALSA20_KERNEL_COUNT];
+	struct salsa20_stats_block* next;
+};
+
+// block of the calling thread, registered on its first crypt call (blocks of finished threads stay in the sums)
+extern _Thread_local struct salsa20_stats_block* salsa20StatsBlock;
+struct salsa20_stats_block* salsa20_stats_register(void);
+
+#define SALSA20_STATS_ADD(counter, value) \
+	atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (value), memory_order_relaxed)
+
+static inline uint64_t salsa20_stats_cycles(void) {
+	uint32_t low, high;
+	__asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+// rdtsc costs more than the rest of the bookkeeping, so only every SALSA20_STATS_SAMPLE-th call of a kernel
+// in a thread is timed and its cycles count SALSA20_STATS_SAMPLE times (counted per kernel, so alternating
+// kernels are still sampled evenly)
+#define SALSA20_STATS_SAMPLE 64
+
+// 'start' is the TSC at entry of a sampled call and 0 otherwise; calls that are not sampled only touch three counters
+static inline void salsa20_stats_record(struct salsa20_stats_block* block, enum salsa20_kernel kernel, uint64_t mlen, uint64_t start) {
+	if (__builtin_expect(start != 0, 0)) {
+		SALSA20_STATS_ADD(block->kernelCycles[kernel], (salsa20_stats_cycles() - start) * SALSA20_STATS_SAMPLE);
+	}
+	SALSA20_STATS_ADD(block->bytes, mlen);
+	SALSA20_STATS_ADD(block->tailBytes, mlen % 64);
+	SALSA20_STATS_ADD(block->kernelCalls[kernel], 1);
+}
+
+#define SALSA20_STATS_BEGIN(var, kernel) \
+	struct salsa20_stats_block* var##Block = salsa20StatsBlock; \
+	if (__builtin_expect(var##Block == NULL, 0)) var##Block = salsa20_stats_register(); \
+	uint64_t var = __builtin_expect(atomic_load_explicit(&var##Block->kernelCalls[kernel], memory_order_relaxed) % SALSA20_STATS_SAMPLE == 0, 0) ? salsa20_stats_cycles() : 0
+#define SALSA20_STATS_END(var, kernel, mlen) \
+	salsa20_stats_record(var##Block, kernel, mlen, var)
+#else
+#define SALSA20_STATS_BEGIN(var, kernel) do { } while (0)
+#define SALSA20_STATS_END(var, kernel, mlen) do { } while (0)
+#endif
+
+// at entry and before every exit of a crypt function
+#define SALSA20_CRYPT_BEGIN(kernel, mlen) \
+	SALSA20_PROBE(crypt__entry, kernel, mlen); \
+	SALSA20_STATS_BEGIN(salsa20StatsStart, kernel)
+#define SALSA20_CRYPT_END(kernel, mlen) \
+	SALSA20_STATS_END(salsa20StatsStart, kernel, mlen); \
+	SALSA20_PROBE(crypt__return, kernel, mlen)
+#endif
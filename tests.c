@@ -2,8 +2,19 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "salsa20.h"
 #include "utils.h"
+#include "container.h"
+#include "keystream_cache.h"
+#include "salsa20_file.h"
+#include "async.h"
+#include "follow.h"
+#include "crc32c.h"
+#include "salsa20_view.h"
 
 //Testing crypt by comparing message with encoded and decoded message
 int test_salsa20_crypt(int n, char *message, size_t mlen, uint32_t key[8], uint64_t nonce) {
@@ -58,6 +69,581 @@ int test_salsa20_core(int version, uint32_t input[16], uint32_t rightResult[16])
 	return memcmp(rightResult, output, 16);
 }
 
+// Testing multi-block crypt by comparing it with the keystream of salsa20_crypt
+int test_salsa20_crypt_x4(size_t mlen, uint32_t key[8], uint64_t nonce) {
+	uint8_t message[mlen + 1];
+	uint8_t expected[mlen + 1];
+	uint8_t cipher[mlen + 1];
+	for (size_t i = 0; i < mlen; i++) {
+		message[i] = (uint8_t)(i * 7 + 3);
+	}
+	salsa20_crypt(mlen, message, expected, key, nonce);
+	salsa20_crypt_x4(mlen, message, cipher, key, nonce);
+	return memcmp(expected, cipher, mlen);
+}
+
+// Testing hybrid crypt by comparing it with the keystream of salsa20_crypt, and its block function across the 32-bit counter carry
+int test_salsa20_crypt_hybrid(size_t mlen, uint32_t key[8], uint64_t nonce) {
+	uint8_t message[mlen + 1];
+	uint8_t expected[mlen + 1];
+	uint8_t cipher[mlen + 1];
+	uint32_t matrix[16];
+	for (size_t i = 0; i < mlen; i++) {
+		message[i] = (uint8_t)(i * 7 + 3);
+	}
+	salsa20_crypt(mlen, message, expected, key, nonce);
+	salsa20_crypt_hybrid(mlen, message, cipher, key, nonce);
+	if (memcmp(expected, cipher, mlen) != 0) {
+		return -1;
+	}
+
+	const uint64_t counter = 0xfffffffeULL;
+	fill_matrix(matrix, key, nonce, 0);
+	size_t blocks = salsa20_xor_blocks_hybrid(mlen / 64, message, cipher, matrix, counter);
+	salsa20_crypt_offset(blocks * 64, message, expected, key, nonce, counter * 64);
+	return memcmp(expected, cipher, blocks * 64);
+}
+
+// Testing register-resident crypt by comparing it with the keystream of salsa20_crypt
+int test_salsa20_crypt_V4(size_t mlen, uint32_t key[8], uint64_t nonce) {
+	uint8_t message[mlen + 1];
+	uint8_t expected[mlen + 1];
+	uint8_t cipher[mlen + 1];
+	for (size_t i = 0; i < mlen; i++) {
+		message[i] = (uint8_t)(i * 7 + 3);
+	}
+	salsa20_crypt(mlen, message, expected, key, nonce);
+	salsa20_crypt_V4(mlen, message, cipher, key, nonce);
+	return memcmp(expected, cipher, mlen);
+}
+
+// Testing scatter-gather crypt: input split into segments of 'inSegment' bytes, output into segments of 'outSegment' bytes
+int test_salsa20_cryptv(size_t mlen, size_t inSegment, size_t outSegment, uint64_t offset, uint32_t key[8], uint64_t nonce) {
+	uint8_t message[mlen + 1];
+	uint8_t expected[mlen + 1];
+	uint8_t cipher[mlen + 1];
+	struct iovec in[mlen / inSegment + 1];
+	struct iovec out[mlen / outSegment + 1];
+	int n = 0;
+	int m = 0;
+	for (size_t i = 0; i < mlen; i++) {
+		message[i] = (uint8_t)(i * 11 + 1);
+	}
+	for (size_t i = 0; i < mlen; i += inSegment, n++) {
+		in[n] = (struct iovec){ message + i, mlen - i < inSegment ? mlen - i : inSegment };
+	}
+	for (size_t i = 0; i < mlen; i += outSegment, m++) {
+		out[m] = (struct iovec){ cipher + i, mlen - i < outSegment ? mlen - i : outSegment };
+	}
+	salsa20_crypt_offset(mlen, message, expected, key, nonce, offset);
+	if (salsa20_cryptv(key, nonce, offset, in, n, out, m) != mlen) {
+		return -1;
+	}
+	return memcmp(expected, cipher, mlen);
+}
+
+// Testing offset crypt by encrypting a message in two pieces split at 'split'
+int test_salsa20_crypt_offset(size_t mlen, size_t split, uint32_t key[8], uint64_t nonce) {
+	uint8_t message[mlen + 1];
+	uint8_t expected[mlen + 1];
+	uint8_t cipher[mlen + 1];
+	for (size_t i = 0; i < mlen; i++) {
+		message[i] = (uint8_t)(i * 13 + 5);
+	}
+	salsa20_crypt(mlen, message, expected, key, nonce);
+	salsa20_crypt_offset(split, message, cipher, key, nonce, 0);
+	salsa20_crypt_offset(mlen - split, message + split, cipher + split, key, nonce, split);
+	return memcmp(expected, cipher, mlen);
+}
+
+// Testing container by streaming a message in uneven pieces and reading a range back with container_pread
+int test_container(size_t mlen, uint32_t chunkSize, size_t offset, size_t length, uint32_t key[8], uint64_t nonce) {
+	uint8_t message[mlen + 1];
+	uint8_t range[length + 1];
+	for (size_t i = 0; i < mlen; i++) {
+		message[i] = (uint8_t)(i * 29 + 1);
+	}
+	FILE* file = tmpfile();
+	if (file == NULL) {
+		return -1;
+	}
+	struct container_writer* writer = container_writer_open(fileno(file), key, nonce, chunkSize);
+	int result = writer == NULL ? -1 : 0;
+	for (size_t position = 0, piece = 1; result == 0 && position < mlen; position += piece, piece = piece * 3 + 1) {
+		result = container_writer_write(writer, message + position, position + piece < mlen ? piece : mlen - position);
+	}
+	if (writer != NULL && container_writer_close(writer) != 0) {
+		result = -1;
+	}
+	struct container_reader* reader = result == 0 ? container_reader_open(fileno(file), key) : NULL;
+	if (reader == NULL || reader->length != mlen || container_pread(reader, range, length, offset) != (ssize_t)length) {
+		result = -1;
+	}
+	else {
+		result = memcmp(message + offset, range, length);
+	}
+	if (reader != NULL) {
+		container_reader_close(reader);
+	}
+	fclose(file);
+	return result;
+}
+
+// Testing keystream cache: the same unaligned ranges twice (miss, then hit) against salsa20_crypt_offset,
+// with a cache of only two runs so that runs get evicted, then eviction of the key
+int test_keystream_cache(uint32_t key[8], uint64_t nonce) {
+	uint8_t message[3000];
+	uint8_t expected[3000];
+	uint8_t cipher[3000];
+	uint64_t offsets[4] = {0, 100, 1000000, 190};
+	size_t lengths[4] = {3000, 1, 2500, 700};
+	for (size_t i = 0; i < sizeof(message); i++) {
+		message[i] = (uint8_t)(i * 17 + 9);
+	}
+	struct keystream_cache* cache = keystream_cache_create(2 * 256, 256, 1);
+	if (cache == NULL) {
+		return -1;
+	}
+	int result = 0;
+	for (int pass = 0; pass < 2 && result == 0; pass++) {
+		for (int i = 0; i < 4 && result == 0; i++) {
+			salsa20_crypt_offset(lengths[i], message, expected, key, nonce, offsets[i]);
+			keystream_cache_crypt(cache, lengths[i], message, cipher, key, nonce, offsets[i]);
+			result = memcmp(expected, cipher, lengths[i]);
+		}
+	}
+
+	// the last range (runs 0 to 3) fits no longer, but one run repeated is a hit
+	struct keystream_cache_stats stats;
+	keystream_cache_crypt(cache, 10, message, cipher, key, nonce, 300);
+	keystream_cache_crypt(cache, 10, message, cipher, key, nonce, 310);
+	keystream_cache_get_stats(cache, &stats);
+	if (stats.hits == 0 || stats.evictions == 0 || stats.runs != 2 || stats.capacityRuns != 2) {
+		result = -1;
+	}
+	if (keystream_cache_evict_key(cache, key) != 2) {
+		result = -1;
+	}
+	keystream_cache_get_stats(cache, &stats);
+	if (stats.runs != 0) {
+		result = -1;
+	}
+	keystream_cache_destroy(cache);
+	return result;
+}
+
+// Testing encrypted file layer: out-of-order pwrites, appends and a write larger than a pool buffer,
+// then ranges read back with salsa20_pread and the raw file compared with salsa20_crypt of the whole plaintext
+int test_salsa20_file(uint32_t key[8], uint64_t nonce) {
+	const size_t length = SALSA20_FILE_BUFFER_SIZE + 5000;
+	uint8_t* message = (uint8_t*)malloc(length);
+	uint8_t* expected = (uint8_t*)malloc(length);
+	uint8_t* read = (uint8_t*)malloc(length);
+	char path[] = "/tmp/salsa20_test_XXXXXX";
+	int fd = mkstemp(path);
+	int result = message == NULL || expected == NULL || read == NULL || fd < 0 ? -1 : 0;
+	if (fd >= 0) {
+		close(fd);
+	}
+	struct salsa20_file* file = result == 0 ? salsa20_file_open(path, O_RDWR, 0600, key, nonce) : NULL;
+	if (file == NULL) {
+		result = -1;
+	}
+	if (result == 0) {
+		for (size_t i = 0; i < length; i++) {
+			message[i] = (uint8_t)(i * 23 + 7);
+		}
+		uint64_t appendOffset = 0;
+		if (salsa20_pwrite(file, message + 100, 4000, 100) != 4000
+			|| salsa20_pwrite(file, message, 100, 0) != 100
+			|| salsa20_append(file, message + 4100, 900, &appendOffset) != 900 || appendOffset != 4100
+			|| salsa20_pwrite(file, message + 5000, length - 5000, 5000) != (ssize_t)(length - 5000)
+			|| salsa20_file_size(file) != length) {
+			result = -1;
+		}
+		if (result == 0 && (salsa20_pread(file, read, 77, 63) != 77 || memcmp(read, message + 63, 77) != 0)) {
+			result = -1;
+		}
+		// reads stop at the end of the file
+		if (result == 0 && (salsa20_pread(file, read, length, 0) != (ssize_t)length || memcmp(read, message, length) != 0
+			|| salsa20_pread(file, read, 100, length - 10) != 10)) {
+			result = -1;
+		}
+	}
+	if (file != NULL && salsa20_file_close(file) != 0) {
+		result = -1;
+	}
+	if (result == 0) {
+		FILE* raw = fopen(path, "r");
+		salsa20_crypt(length, message, expected, key, nonce);
+		if (raw == NULL || fread(read, 1, length, raw) != length || memcmp(read, expected, length) != 0) {
+			result = -1;
+		}
+		if (raw != NULL) {
+			fclose(raw);
+		}
+	}
+	unlink(path);
+	free(message);
+	free(expected);
+	free(read);
+	return result;
+}
+
+static void count_async_job(struct salsa20_job* job) {
+	atomic_fetch_add((atomic_int*)job->context, 1);
+}
+
+// Testing async engine: callback jobs (one of them split into parts) and jobs reaped through the eventfd
+int test_salsa20_engine(uint32_t key[8], uint64_t nonce) {
+	const size_t lengths[4] = {1, 100, 3 * ASYNC_PART_SIZE + 77, 4096};
+	const uint64_t offsets[4] = {0, 63, 5, 1000000};
+	const size_t total = 3 * ASYNC_PART_SIZE + 77;
+	uint8_t* message = (uint8_t*)malloc(total);
+	uint8_t* expected = (uint8_t*)malloc(total);
+	uint8_t* out = (uint8_t*)calloc(8, total);
+	struct salsa20_engine* engine = salsa20_engine_create(2, 8);
+	struct salsa20_job jobs[8];
+	atomic_int callbacks;
+	int result = 0;
+	if (message == NULL || expected == NULL || out == NULL || engine == NULL) {
+		free(message);
+		free(expected);
+		free(out);
+		if (engine != NULL) salsa20_engine_destroy(engine);
+		return -1;
+	}
+	atomic_init(&callbacks, 0);
+	for (size_t i = 0; i < total; i++) {
+		message[i] = (uint8_t)(i * 29 + 3);
+	}
+
+	// jobs 0-3 with callback, 4-7 without
+	memset(jobs, 0, sizeof(jobs));
+	for (int i = 0; i < 8; i++) {
+		memcpy(jobs[i].key, key, sizeof(jobs[i].key));
+		jobs[i].nonce = nonce + i;
+		jobs[i].offset = offsets[i % 4];
+		jobs[i].in = message;
+		jobs[i].out = out + i * total;
+		jobs[i].length = lengths[i % 4];
+		jobs[i].callback = i < 4 ? count_async_job : NULL;
+		jobs[i].context = &callbacks;
+		salsa20_engine_submit(engine, &jobs[i]);
+	}
+
+	size_t reaped = 0;
+	while (reaped < 4) {
+		uint64_t count;
+		if (read(salsa20_engine_eventfd(engine), &count, sizeof(count)) != sizeof(count)) {
+			usleep(1000);
+		}
+		struct salsa20_job* done[4];
+		size_t n = salsa20_engine_reap(engine, done, 4);
+		for (size_t k = 0; k < n; k++) {
+			if (done[k] < &jobs[4] || done[k] > &jobs[7]) result = -1;
+		}
+		reaped += n;
+	}
+	while (atomic_load(&callbacks) < 4) {
+		usleep(1000);
+	}
+	salsa20_engine_destroy(engine);
+
+	for (int i = 0; i < 8 && result == 0; i++) {
+		salsa20_crypt_offset(jobs[i].length, message, expected, key, jobs[i].nonce, jobs[i].offset);
+		if (memcmp(expected, jobs[i].out, jobs[i].length) != 0) {
+			result = -1;
+		}
+	}
+	free(message);
+	free(expected);
+	free(out);
+	return result;
+}
+
+// Testing follow mode: two appends (the first ends inside a block) must give the ciphertext of the whole file
+int test_follow_crypt(uint32_t key[8], uint64_t nonce) {
+	char inputPath[] = "/tmp/salsa20_follow_in_XXXXXX";
+	char outputPath[] = "/tmp/salsa20_follow_out_XXXXXX";
+	uint8_t message[700];
+	uint8_t expected[700];
+	uint8_t output[700];
+	int inputFd = mkstemp(inputPath);
+	int outputFd = mkstemp(outputPath);
+	int result = 0;
+	if (inputFd < 0 || outputFd < 0) {
+		return -1;
+	}
+	close(outputFd);
+	for (size_t i = 0; i < sizeof(message); i++) {
+		message[i] = (uint8_t)(i * 11 + 5);
+	}
+
+	// small chunks, so a single pass also crosses chunk boundaries
+	if (!write_all(inputFd, message, 100) || follow_crypt_appended(inputPath, outputPath, key, nonce, 128) != 100
+		|| !write_all(inputFd, message + 100, 600) || follow_crypt_appended(inputPath, outputPath, key, nonce, 128) != 700) {
+		result = -1;
+	}
+	close(inputFd);
+	FILE* file = fopen(outputPath, "r");
+	salsa20_crypt(sizeof(message), message, expected, key, nonce);
+	if (result != 0 || file == NULL || fread(output, 1, sizeof(output), file) != sizeof(output) || memcmp(expected, output, sizeof(output)) != 0) {
+		result = -1;
+	}
+	if (file != NULL) {
+		fclose(file);
+	}
+	unlink(inputPath);
+	unlink(outputPath);
+	return result;
+}
+
+// Testing fused crypt + CRC32C against salsa20_crypt_offset and separate checksums (also in place, and input only)
+int test_salsa20_crypt_crc32c(uint32_t key[8], uint64_t nonce) {
+	uint8_t message[1500];
+	uint8_t expected[1500];
+	uint8_t cipher[1500];
+	const uint64_t offsets[4] = {0, 13, 64, 1000003};
+	const size_t lengths[4] = {1500, 50, 1029, 255};
+	if (crc32c(0, "123456789", 9) != 0xE3069283) {
+		return -1;
+	}
+	for (size_t i = 0; i < sizeof(message); i++) {
+		message[i] = (uint8_t)(i * 13 + 1);
+	}
+	for (int t = 0; t < 4; t++) {
+		uint32_t msgCrc;
+		salsa20_crypt_offset(lengths[t], message, expected, key, nonce, offsets[t]);
+		if (salsa20_crypt_crc32c(lengths[t], message, cipher, key, nonce, offsets[t], &msgCrc) != crc32c(0, expected, lengths[t])
+			|| msgCrc != crc32c(0, message, lengths[t]) || memcmp(expected, cipher, lengths[t]) != 0) {
+			return -1;
+		}
+		memcpy(cipher, message, lengths[t]);
+		if (salsa20_crypt_crc32c(lengths[t], cipher, cipher, key, nonce, offsets[t], &msgCrc) != crc32c(0, expected, lengths[t])
+			|| msgCrc != crc32c(0, message, lengths[t]) || memcmp(expected, cipher, lengths[t]) != 0) {
+			return -1;
+		}
+		if (salsa20_crypt_crc32c_input(lengths[t], expected, cipher, key, nonce, offsets[t]) != crc32c(0, expected, lengths[t])
+			|| memcmp(message, cipher, lengths[t]) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Testing lazy view: random and sequential loads with readahead and a resident set of four pages
+int test_salsa20_view(uint32_t key[8], uint64_t nonce) {
+	char path[] = "/tmp/salsa20_view_XXXXXX";
+	const size_t pageSize = sysconf(_SC_PAGESIZE);
+	const size_t length = 40 * pageSize + 123;
+	uint8_t* message = (uint8_t*)malloc(length);
+	uint8_t* cipher = (uint8_t*)malloc(length);
+	int fd = mkstemp(path);
+	int result = 0;
+	if (message == NULL || cipher == NULL || fd < 0) {
+		free(message);
+		free(cipher);
+		return -1;
+	}
+	for (size_t i = 0; i < length; i++) {
+		message[i] = (uint8_t)(i * 31 + 7);
+	}
+	salsa20_crypt(length, message, cipher, key, nonce);
+	if (!write_all(fd, cipher, length)) {
+		result = -1;
+	}
+	close(fd);
+
+	struct salsa20_view_options options = { pageSize, 2, 4 };
+	struct salsa20_view* view = result == 0 ? salsa20_view_open(path, key, nonce, &options) : NULL;
+	if (view == NULL || salsa20_view_size(view) != length) {
+		result = -1;
+	}
+	else {
+		const uint8_t* data = salsa20_view_data(view);
+		uint64_t position = 12345;
+		for (int i = 0; i < 1000 && result == 0; i++) {
+			position = (position * 6364136223846793005ULL + 1442695040888963407ULL) % length;
+			if (data[position] != message[position]) {
+				result = -1;
+			}
+		}
+		if (memcmp(data, message, length) != 0) {
+			result = -1;
+		}
+		struct salsa20_view_stats stats;
+		salsa20_view_get_stats(view, &stats);
+		if (stats.residentPages > 4 || stats.evictions == 0 || stats.readaheadPages == 0 || stats.faults == 0) {
+			result = -1;
+		}
+		if (salsa20_view_close(view) != 0) {
+			result = -1;
+		}
+	}
+	unlink(path);
+	free(message);
+	free(cipher);
+	return result;
+}
+
+// Testing lazy view: a store into a resident and into a not yet touched page crashes with SIGSEGV (in a child)
+int test_salsa20_view_store(uint32_t key[8], uint64_t nonce) {
+	char path[] = "/tmp/salsa20_view_XXXXXX";
+	const size_t pageSize = sysconf(_SC_PAGESIZE);
+	const size_t length = 4 * pageSize;
+	uint8_t* cipher = (uint8_t*)calloc(1, length);
+	int fd = mkstemp(path);
+	int result = 0;
+	if (cipher == NULL || fd < 0) {
+		free(cipher);
+		return -1;
+	}
+	salsa20_crypt(length, cipher, cipher, key, nonce);
+	if (!write_all(fd, cipher, length)) {
+		result = -1;
+	}
+	close(fd);
+
+	struct salsa20_view_options options = { pageSize, 0, 0 };
+	struct salsa20_view* view = result == 0 ? salsa20_view_open(path, key, nonce, &options) : NULL;
+	if (view == NULL) {
+		result = -1;
+	}
+	else {
+		uint8_t* data = (uint8_t*)salsa20_view_data(view);
+		if (data[0] != 0) {
+			result = -1;
+		}
+		// page 0 is resident, page 3 is not
+		const size_t targets[2] = { 10, 3 * pageSize + 10 };
+		fflush(stdout);
+		for (int t = 0; t < 2 && result == 0; t++) {
+			pid_t child = fork();
+			if (child < 0) {
+				result = -1;
+				break;
+			}
+			if (child == 0) {
+				// a handler that keeps retrying the store ends in SIGALRM instead of hanging the tests
+				alarm(5);
+				((volatile uint8_t*)data)[targets[t]] = 1;
+				_exit(EXIT_SUCCESS);
+			}
+			int status;
+			if (waitpid(child, &status, 0) != child || !WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV) {
+				result = -1;
+			}
+		}
+		if (salsa20_view_close(view) != 0) {
+			result = -1;
+		}
+	}
+	unlink(path);
+	free(cipher);
+	return result;
+}
+
+// Testing fan-out with 1 to 6 recipients (full and partial SIMD groups) against salsa20_crypt_offset per recipient
+int test_salsa20_crypt_fanout(uint32_t keys[5][8], const uint64_t nonces[5]) {
+	uint8_t message[1100];
+	uint8_t expected[1100];
+	uint8_t ciphers[6][1100];
+	struct salsa20_recipient recipients[6];
+	const uint64_t offsets[3] = {0, 70, 999};
+	const size_t lengths[3] = {1100, 1000, 5};
+	for (size_t i = 0; i < sizeof(message); i++) {
+		message[i] = (uint8_t)(i * 3 + 17);
+	}
+	for (int r = 0; r < 6; r++) {
+		memcpy(recipients[r].key, keys[r % 5], sizeof(recipients[r].key));
+		recipients[r].nonce = nonces[r % 5] + r;
+		recipients[r].cipher = ciphers[r];
+	}
+	for (int count = 1; count <= 6; count++) {
+		for (int t = 0; t < 3; t++) {
+			salsa20_crypt_fanout(lengths[t], message, recipients, count, offsets[t]);
+			for (int r = 0; r < count; r++) {
+				salsa20_crypt_offset(lengths[t], message, expected, recipients[r].key, recipients[r].nonce, offsets[t]);
+				if (memcmp(expected, ciphers[r], lengths[t]) != 0) {
+					return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+// Testing transcrypt against decrypting with the old and encrypting with the new key, in place and at odd offsets
+int test_salsa20_transcrypt(uint32_t keys[5][8], const uint64_t nonces[5]) {
+	uint8_t message[1100];
+	uint8_t cipher[1100];
+	uint8_t expected[1100];
+	const uint64_t offsets[4] = {0, 64, 70, 999};
+	const size_t lengths[4] = {1100, 1000, 129, 5};
+	for (size_t i = 0; i < sizeof(message); i++) {
+		message[i] = (uint8_t)(i * 7 + 3);
+	}
+	for (int k = 0; k < 4; k++) {
+		for (int t = 0; t < 4; t++) {
+			salsa20_crypt_offset(lengths[t], message, cipher, keys[k], nonces[k], offsets[t]);
+			salsa20_crypt_offset(lengths[t], message, expected, keys[k + 1], nonces[k + 1], offsets[t]);
+			salsa20_transcrypt(lengths[t], cipher, cipher, keys[k], nonces[k], keys[k + 1], nonces[k + 1], offsets[t]);
+			if (memcmp(expected, cipher, lengths[t]) != 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Testing gather on sparse rows in reverse order (full, partial, large and overlapping cells, in place) against salsa20_crypt_offset per row
+int test_salsa20_crypt_gather(uint32_t key[8], uint64_t nonce) {
+	static uint8_t table[40 * 512];
+	static uint8_t cells[40 * 512];
+	uint8_t expected[512];
+	struct salsa20_gather_record records[40];
+	// 300 and 512 bytes: groups of four blocks inside a record, then the rest in the gathered lanes
+	const size_t cellSizes[5] = {64, 100, 200, 300, 512};
+	for (int c = 0; c < 5; c++) {
+		const size_t cellSize = cellSizes[c];
+		// counter = row * blocks per cell, then counter = row (the keystreams of neighbouring rows overlap)
+		for (int overlap = 0; overlap < 2; overlap++) {
+			for (size_t i = 0; i < sizeof(table); i++) {
+				table[i] = (uint8_t)(i * 5 + c);
+			}
+			memcpy(cells, table, sizeof(cells));
+			size_t count = 0;
+			for (int row = 39; row >= 0; row -= 3) {
+				uint64_t counter = overlap ? (uint64_t)row : row * ((cellSize + 63) / 64);
+				records[count++] = (struct salsa20_gather_record){ counter, cells + row * cellSize, cells + row * cellSize, cellSize };
+			}
+			salsa20_crypt_gather(key, nonce, records, count);
+			for (int row = 0; row < 40; row++) {
+				if (row % 3 != 0) {
+					if (memcmp(table + row * cellSize, cells + row * cellSize, cellSize) != 0) {
+						return -1;
+					}
+					continue;
+				}
+				uint64_t counter = overlap ? (uint64_t)row : row * ((cellSize + 63) / 64);
+				salsa20_crypt_offset(cellSize, table + row * cellSize, expected, key, nonce, counter * 64);
+				if (memcmp(expected, cells + row * cellSize, cellSize) != 0) {
+					return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+// Testing multi-block core by comparing four results at once
+int test_salsa20_core_x4(uint32_t input[4][16], uint32_t rightResult[4][16]) {
+	uint32_t output[4][16];
+	salsa20_core_x4(output, (const uint32_t(*)[16])input);
+	return memcmp(rightResult, output, sizeof(output));
+}
+
 // run all defined tests
 int run_tests() {
 	int errorCounter = 0;
@@ -167,6 +753,199 @@ int run_tests() {
 		printf("\n");
 	}
 
+	// Testing multi-block kernel
+	printf("testcase core x4\n");
+	if (test_salsa20_core_x4(coreTests, coreTestsResults) != 0 || test_salsa20_core_x4(coreTests + 1, coreTestsResults + 1) != 0) {
+		printf("test_salsa_core_x4 failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa_core_x4 successful\n");
+		successCounter++;
+	}
+	size_t multiTestLength[6] = {1, 64, 255, 256, 257, 1000};
+	for (size_t i = 0; i < 6; i++) {
+		if (test_salsa20_crypt_x4(multiTestLength[i], cryptTestKey[i % 5], cryptTestNonce[i % 5]) != 0) {
+			printf("test_salsa_crypt_x4 (%zu bytes) failed\n", multiTestLength[i]);
+			errorCounter++;
+		}
+		else {
+			printf("test_salsa_crypt_x4 (%zu bytes) successful\n", multiTestLength[i]);
+			successCounter++;
+		}
+	}
+	for (size_t i = 0; i < 6; i++) {
+		if (test_salsa20_crypt_hybrid(multiTestLength[i], cryptTestKey[i % 5], cryptTestNonce[i % 5]) != 0) {
+			printf("test_salsa_crypt_hybrid (%zu bytes) failed\n", multiTestLength[i]);
+			errorCounter++;
+		}
+		else {
+			printf("test_salsa_crypt_hybrid (%zu bytes) successful\n", multiTestLength[i]);
+			successCounter++;
+		}
+	}
+	for (size_t i = 0; i < 6; i++) {
+		if (test_salsa20_crypt_V4(multiTestLength[i], cryptTestKey[i % 5], cryptTestNonce[i % 5]) != 0) {
+			printf("test_salsa_crypt_V4 keystream (%zu bytes) failed\n", multiTestLength[i]);
+			errorCounter++;
+		}
+		else {
+			printf("test_salsa_crypt_V4 keystream (%zu bytes) successful\n", multiTestLength[i]);
+			successCounter++;
+		}
+	}
+	size_t offsetTestSplit[6][2] = {{100, 1}, {100, 64}, {700, 37}, {700, 320}, {1000, 999}, {1000, 0}};
+	for (size_t i = 0; i < 6; i++) {
+		if (test_salsa20_crypt_offset(offsetTestSplit[i][0], offsetTestSplit[i][1], cryptTestKey[i % 5], cryptTestNonce[i % 5]) != 0) {
+			printf("test_salsa_crypt_offset (%zu bytes at %zu) failed\n", offsetTestSplit[i][0] - offsetTestSplit[i][1], offsetTestSplit[i][1]);
+			errorCounter++;
+		}
+		else {
+			printf("test_salsa_crypt_offset (%zu bytes at %zu) successful\n", offsetTestSplit[i][0] - offsetTestSplit[i][1], offsetTestSplit[i][1]);
+			successCounter++;
+		}
+	}
+	size_t vectorTest[6][4] = {{1000, 1, 7, 0}, {1000, 37, 64, 5}, {2000, 300, 17, 100}, {2000, 1000, 1000, 64}, {513, 513, 1, 63}, {4096, 4096, 4096, 0}};
+	for (size_t i = 0; i < 6; i++) {
+		if (test_salsa20_cryptv(vectorTest[i][0], vectorTest[i][1], vectorTest[i][2], vectorTest[i][3], cryptTestKey[i % 5], cryptTestNonce[i % 5]) != 0) {
+			printf("test_salsa_cryptv (%zu bytes, segments %zu/%zu) failed\n", vectorTest[i][0], vectorTest[i][1], vectorTest[i][2]);
+			errorCounter++;
+		}
+		else {
+			printf("test_salsa_cryptv (%zu bytes, segments %zu/%zu) successful\n", vectorTest[i][0], vectorTest[i][1], vectorTest[i][2]);
+			successCounter++;
+		}
+	}
+	printf("\n");
+
+	// Testing container
+	printf("testcase container\n");
+	if (test_container(1000, 128, 100, 500, cryptTestKey[0], cryptTestNonce[0]) != 0 || test_container(4096, 64, 4000, 96, cryptTestKey[1], cryptTestNonce[1]) != 0) {
+		printf("test_container failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_container successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing keystream cache
+	printf("testcase keystream cache\n");
+	if (test_keystream_cache(cryptTestKey[2], cryptTestNonce[2]) != 0) {
+		printf("test_keystream_cache failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_keystream_cache successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing encrypted file layer
+	printf("testcase encrypted file\n");
+	if (test_salsa20_file(cryptTestKey[3], cryptTestNonce[3]) != 0) {
+		printf("test_salsa20_file failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa20_file successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing async engine
+	printf("testcase async engine\n");
+	if (test_salsa20_engine(cryptTestKey[4], cryptTestNonce[4]) != 0) {
+		printf("test_salsa20_engine failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa20_engine successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing follow mode
+	printf("testcase follow\n");
+	if (test_follow_crypt(cryptTestKey[0], cryptTestNonce[0]) != 0) {
+		printf("test_follow_crypt failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_follow_crypt successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing fused crypt + CRC32C
+	printf("testcase crypt crc32c\n");
+	if (test_salsa20_crypt_crc32c(cryptTestKey[1], cryptTestNonce[1]) != 0) {
+		printf("test_salsa20_crypt_crc32c failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa20_crypt_crc32c successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing lazy decrypting view
+	printf("testcase view\n");
+	if (test_salsa20_view(cryptTestKey[2], cryptTestNonce[2]) != 0) {
+		printf("test_salsa20_view failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa20_view successful\n");
+		successCounter++;
+	}
+	if (test_salsa20_view_store(cryptTestKey[2], cryptTestNonce[2]) != 0) {
+		printf("test_salsa20_view_store failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa20_view_store successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing multi-recipient fan-out
+	printf("testcase fanout\n");
+	if (test_salsa20_crypt_fanout(cryptTestKey, cryptTestNonce) != 0) {
+		printf("test_salsa20_crypt_fanout failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa20_crypt_fanout successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing key rotation in one pass
+	printf("testcase transcrypt\n");
+	if (test_salsa20_transcrypt(cryptTestKey, cryptTestNonce) != 0) {
+		printf("test_salsa20_transcrypt failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa20_transcrypt successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
+	// Testing sparse records
+	printf("testcase gather\n");
+	if (test_salsa20_crypt_gather(cryptTestKey[3], cryptTestNonce[3]) != 0) {
+		printf("test_salsa20_crypt_gather failed\n");
+		errorCounter++;
+	}
+	else {
+		printf("test_salsa20_crypt_gather successful\n");
+		successCounter++;
+	}
+	printf("\n");
+
 	printf("Summary:\n");
 	printf("%i tests successful\n", successCounter);
 	printf("%i tests failed\n", errorCounter);
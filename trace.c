@@ -0,0 +1,171 @@
+/*
+ * Phase timing: records (name, start, end, bytes) spans and exports them
+ * as a per-phase breakdown or as Chrome trace-event JSON (chrome://tracing, Perfetto)
+ */
+#define _GNU_SOURCE // syscall
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "utils.h"
+
+struct trace_event {
+	const char* name;
+	uint64_t start;
+	uint64_t end;
+	uint64_t bytes;
+	int tid;
+};
+
+bool traceEnabled = false;
+
+// the event count and the events share one MAP_SHARED mapping, so worker processes forked after trace_enable
+// (--shards) record into the same buffer as the parent
+struct trace_buffer {
+	atomic_size_t count;
+	struct trace_event events[];
+};
+
+static struct trace_buffer* traceBuffer = NULL;
+static size_t traceMappedSize = 0;
+static struct trace_event* traceEvents = NULL;
+static size_t traceCapacity = 0;
+static uint64_t traceOrigin = 0;
+static __thread int traceTid = 0;
+static pthread_once_t traceForkOnce = PTHREAD_ONCE_INIT;
+
+// a forked child inherits the cached thread id of its parent
+static void reset_tid(void) {
+	traceTid = 0;
+}
+
+static void register_fork_handler(void) {
+	pthread_atfork(NULL, NULL, reset_tid);
+}
+
+/*
+ * Allocates room for 'capacity' events and starts recording
+ */
+void trace_enable(size_t capacity) {
+	if (traceBuffer != NULL) {
+		munmap(traceBuffer, traceMappedSize);
+	}
+	traceMappedSize = sizeof(struct trace_buffer) + capacity * sizeof(struct trace_event);
+	traceBuffer = (struct trace_buffer*)mmap(NULL, traceMappedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (traceBuffer == MAP_FAILED) {
+		traceBuffer = NULL;
+		throw_perror("An error occurred when allocating memory");
+	}
+	pthread_once(&traceForkOnce, register_fork_handler);
+	traceEvents = traceBuffer->events;
+	traceCapacity = capacity;
+	atomic_store(&traceBuffer->count, 0);
+	traceOrigin = monotonic_ns();
+	traceEnabled = true;
+}
+
+void trace_disable(void) {
+	traceEnabled = false;
+}
+
+static int trace_tid(void) {
+	if (traceTid == 0) {
+		traceTid = (int)syscall(SYS_gettid);
+	}
+	return traceTid;
+}
+
+/*
+ * Stores one span, safe to call from several threads and forked processes; events beyond the capacity are dropped
+ */
+void trace_record(const char* name, uint64_t start, uint64_t end, uint64_t bytes) {
+	size_t index = atomic_fetch_add_explicit(&traceBuffer->count, 1, memory_order_relaxed);
+	if (index >= traceCapacity) {
+		return;
+	}
+	traceEvents[index] = (struct trace_event){ name, start, end, bytes, trace_tid() };
+}
+
+static size_t trace_size(void) {
+	size_t count = traceBuffer != NULL ? atomic_load(&traceBuffer->count) : 0;
+	return count < traceCapacity ? count : traceCapacity;
+}
+
+/*
+ * Prints total time, call count and share of the traced wall time for every phase name
+ * (phases are listed in order of their first occurrence)
+ */
+void trace_print_summary(void) {
+	const size_t count = trace_size();
+	if (count == 0) {
+		return;
+	}
+
+	uint64_t first = traceEvents[0].start;
+	uint64_t last = traceEvents[0].end;
+	for (size_t i = 1; i < count; i++) {
+		if (traceEvents[i].start < first) first = traceEvents[i].start;
+		if (traceEvents[i].end > last) last = traceEvents[i].end;
+	}
+	const double wall = (double)(last - first);
+
+	printf("%-14s %8s %12s %8s %12s\n", "phase", "count", "total ms", "share", "MB/s");
+	bool* printed = (bool*)calloc(count, sizeof(bool));
+	if (printed == NULL) {
+		throw_perror("An error occurred when allocating memory");
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (printed[i]) {
+			continue;
+		}
+		uint64_t total = 0;
+		uint64_t bytes = 0;
+		size_t calls = 0;
+		for (size_t j = i; j < count; j++) {
+			if (!printed[j] && strcmp(traceEvents[i].name, traceEvents[j].name) == 0) {
+				total += traceEvents[j].end - traceEvents[j].start;
+				bytes += traceEvents[j].bytes;
+				calls++;
+				printed[j] = true;
+			}
+		}
+		if (bytes > 0 && total > 0) {
+			printf("%-14s %8zu %12.3f %7.1f%% %12.1f\n", traceEvents[i].name, calls, total * 1e-6, 100.0 * total / wall, bytes * 1e3 / total);
+		}
+		else {
+			printf("%-14s %8zu %12.3f %7.1f%% %12s\n", traceEvents[i].name, calls, total * 1e-6, 100.0 * total / wall, "-");
+		}
+	}
+	printf("%-14s %8s %12.3f\n", "wall", "", wall * 1e-6);
+	if (atomic_load(&traceBuffer->count) > traceCapacity) {
+		printf("(%zu events dropped)\n", atomic_load(&traceBuffer->count) - traceCapacity);
+	}
+	free(printed);
+}
+
+/*
+ * Writes all recorded spans as complete ("X") events of the Chrome trace-event format
+ */
+int trace_write_chrome(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL) {
+		return -1;
+	}
+	const size_t count = trace_size();
+	const int pid = (int)getpid();
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (size_t i = 0; i < count; i++) {
+		const struct trace_event* event = &traceEvents[i];
+		fprintf(file, "{\"name\":\"%s\",\"cat\":\"salsa20\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"bytes\":%llu}}%s\n",
+			event->name, (event->start - traceOrigin) * 1e-3, (event->end - event->start) * 1e-3, pid, event->tid,
+			(unsigned long long)event->bytes, i + 1 < count ? "," : "");
+	}
+	fprintf(file, "]}\n");
+	return fclose(file);
+}
@@ -0,0 +1,23 @@
+#ifndef TEAM152_TRACE_H
+#define TEAM152_TRACE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "utils.h" // monotonic_ns
+
+// set by trace_enable, every macro below is a single predictable branch while it is false
+extern bool traceEnabled;
+
+void trace_enable(size_t capacity);
+void trace_disable(void);
+void trace_record(const char* name, uint64_t start, uint64_t end, uint64_t bytes);
+void trace_print_summary(void);
+int trace_write_chrome(const char* path);
+
+#define TRACE_BEGIN(var) uint64_t var = __builtin_expect(traceEnabled, 0) ? monotonic_ns() : 0
+#define TRACE_END(name, var, bytes) \
+	do { \
+		if (__builtin_expect(traceEnabled, 0)) trace_record(name, var, monotonic_ns(), bytes); \
+	} while (0)
+#endif
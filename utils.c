@@ -1,3 +1,5 @@
+#include <time.h> // clock_gettime
+#include <unistd.h> // pread, pwrite
 #include "utils.h"
 
 unsigned long long get_unsigned_long_long(char* charPointer, const char* errorMessage) {
@@ -28,6 +30,16 @@ long long get_long_long(char* charPointer, const char* errorMessage) {
 	return number;
 }
 
+double get_double(char* charPointer, const char* errorMessage) {
+	errno = 0;
+	char* endPointer;
+	double number = strtod(charPointer, &endPointer);
+	if (charPointer == endPointer || *endPointer != '\0' || errno != 0) {
+		throw_error(errorMessage);
+	}
+	return number;
+}
+
 void throw_error(const char* msg) {
 	fprintf(stderr, "Error: %s\n", msg);
 	exit(1);
@@ -91,24 +103,140 @@ uint64_t parseNonce(char* noncePtr) {
 	return nonce;
 }
 
+/*
+ * Reads exactly 'length' bytes at 'offset', false on error or end of file
+ */
+bool pread_all(int fd, void* buffer, size_t length, uint64_t offset) {
+	uint8_t* position = (uint8_t*)buffer;
+	while (length > 0) {
+		ssize_t count = pread(fd, position, length, offset);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		position += count;
+		length -= count;
+		offset += count;
+	}
+	return true;
+}
+
+/*
+ * Writes exactly 'length' bytes at 'offset'
+ */
+bool pwrite_all(int fd, const void* buffer, size_t length, uint64_t offset) {
+	const uint8_t* position = (const uint8_t*)buffer;
+	while (length > 0) {
+		ssize_t count = pwrite(fd, position, length, offset);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		position += count;
+		length -= count;
+		offset += count;
+	}
+	return true;
+}
+
+/*
+ * Writes exactly 'length' bytes at the current file position (works on pipes)
+ */
+bool write_all(int fd, const void* buffer, size_t length) {
+	const uint8_t* position = (const uint8_t*)buffer;
+	while (length > 0) {
+		ssize_t count = write(fd, position, length);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		position += count;
+		length -= count;
+	}
+	return true;
+}
+
+/*
+ * Monotonic clock in nanoseconds, for timing measurements
+ */
+uint64_t monotonic_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
 void print_help() {
-	char* help =
+	fputs(
 		"salsa20\n\n"
 		"NAME\n\n"
 		"\tsalsa20 - stream cypher algorithm used to encrypt/decrypt a message\n\n"
 		"SYNOPSIS\n\n"
-		"\tsalsa20 [-V=<DEFINED_VERSION>] [-B=<NUMBER_OF_FUNCTION_REPETITIONS>] [-o=<OUTPUT_FILE>] [-k=<KEY>] [-iv=<NONCE>] <INPUT_FILE> [-h]\n\n"
+		"\tsalsa20 [-V=<DEFINED_VERSION>] [-B=<NUMBER_OF_FUNCTION_REPETITIONS>] [-o=<OUTPUT_FILE>] [-k=<KEY>] [-iv=<NONCE>] <INPUT_FILE> [-h]\n\n", stdout);
+
+	// options
+	fputs(
 		"OPTIONS\n\n"
-		"\t-V\tUsed version, default version is 0\n\n"
+		"\t-V\tUsed version, default version is 0 (or the tuned plan, see --tune)\n\n"
 		"\t-B\tAmount of repetitions of salsa20_crypt function, default amount is 0\n\n"
 		"\t-o\tPath to output file, default path is out.txt\n\n"
 		"\t-h, --help\t Display help\n\n"
 		"\t-T\t Executes testcases in tests.c for all the Versions with different Inputs\n\n"
+		"\t-P\t Prints a time breakdown of every phase (open, stat, alloc, read, crypt, write, close)\n\n"
+		"\t--trace=<FILE>\t Writes the phase timestamps as Chrome trace-event JSON (viewable in Perfetto)\n\n", stdout);
+
+	// daemon and parallel modes
+	fputs(
+		"\t--serve=<SOCKET>\t Runs as daemon on a Unix domain socket (wire format in server.h), see --threads\n\n"
+		"\t--threads=<N>\t Number of worker threads, default is the number of online CPUs\n\n"
+		"\t--loadgen=<SOCKET>\t Sends requests to a running daemon and reports requests/sec and p50/p99 latency\n"
+		"\t\t--connections=<N> (default 4), --depth=<N> requests in flight per connection (default 1),\n"
+		"\t\t--size=<BYTES> payload size (default 1024), --duration=<SECONDS> (default 5)\n\n"
+		"\t--numa\t Encrypts in parallel with --threads workers pinned per NUMA node, chunk pages are first-touched\n"
+		"\t\ton the worker's node; prints throughput per node (-B repeats the crypt step on the placed buffers)\n\n"
+		"\t--chunk-size=<BYTES>\t Chunk size of the parallel modes (multiple of 64), default is 1048576\n\n", stdout);
+
+	// file modes
+	fputs(
+		"\t--pack\t Writes the input (\"-\" for stdin) as chunked container: header with nonce and chunk size,\n"
+		"\t\tchunks of --chunk-size bytes encrypted in parallel, index with CRC32C per chunk and footer\n\n"
+		"\t--unpack\t Decrypts a container in parallel (the nonce is taken from its header, -i is not needed)\n\n"
+		"\t--unpack-chunk=<N>\t Decrypts only chunk N of a container\n\n"
+		"\t--tune\t Measures all kernels, thread counts and chunk sizes on this machine and stores the fastest\n"
+		"\t\tplan per message size in the profile ($SALSA20_PROFILE or ~/.cache/salsa20/profile)\n\n"
+		"\t--plan\t Prints the plan chosen for the input file (without input: the stored profile)\n"
+		"\t\tWithout -V the plan is taken from the profile, -V always selects that version single-threaded\n\n"
+		"\t--offset=<BYTES>, --length=<BYTES>\t Encrypts only this byte range (default: up to the end of the file) and\n"
+		"\t\twrites it at the same offset into the output file without truncating it (pwrite)\n\n"
+		"\t--shards=<N>\t Splits the file (or the range) into N parts and encrypts each in its own worker process;\n"
+		"\t\tthe boundaries between the parts are multiples of 64 bytes\n\n"
+		"\t--follow\t Encrypts what was appended to the input since the last run (the output length is the offset),\n"
+		"\t\tthen waits for appends (inotify) until the input is moved or deleted\n\n", stdout);
+
+	// instrumentation and benchmarks
+	fputs(
+		"\t--stats\t Prints the crypt statistics (calls, bytes, tail bytes, cycles per kernel) at exit,\n"
+		"\t\tneeds a build with statistics (make STATS=1)\n\n"
+		"\t--bench-stats\t Measures the overhead of the instrumentation per crypt call (make bench-stats)\n\n"
+		"\t--bench-cache[=<READS>]\t Zipfian page reads of a large object with and without the keystream cache\n"
+		"\t\t(keystream_cache.h), default is 200000 reads\n\n"
+		"\t--recipient=<KEY>:<NONCE>:<OUTPUT>\t Encrypts the input for this recipient, may be repeated (up to 1024);\n"
+		"\t\tevery chunk is read once and encrypted for all recipients, -k, -i and -o are not used\n\n"
+		"\t--new-key=<KEY> --new-nonce=<NONCE>\t Re-encrypts an input encrypted with -k/-i under the new key and nonce\n"
+		"\t\tin one pass without writing the plaintext; works with --numa, --offset, --length and --shards\n\n"
+		"\t--bench-fanout[=<N>]\t N independent runs against one fan-out run for N recipients, default is 8\n\n"
+		"\t--bench-gather[=<ROWS>]\t Decrypts 1%, 10% and 100% of the rows of a column (64 to 512 byte cells)\n"
+		"\t\twith a crypt call per row and with one gather call (rows per second), default is 65536 rows\n\n"
+		"\t--bench-save=<FILE>\t Measures every kernel at 64 B, 1 KiB, 16 KiB and 1 MiB and stores the throughput samples\n"
+		"\t\tas a JSON baseline\n\n"
+		"\t--bench-compare=<FILE>\t Measures again and compares with the baseline (Mann-Whitney U test per kernel and size),\n"
+		"\t\texits with 1 if a median throughput dropped by more than the threshold with p < 0.05\n\n"
+		"\t--bench-threshold=<PERCENT>\t Threshold of --bench-compare, default is 5\n\n"
+		"\t--bench-crc\t Encryption plus CRC32C of the output in separate passes against the fused single pass\n\n"
+		"\t--bench-async\t Submission overhead and throughput of the async engine (async.h) with 1 to 16 submitters,\n"
+		"\t\tthe number of workers is set with --threads\n\n"
+		"\t--bench-core[=<BLOCKS>]\t Measures latency and throughput of every salsa20_core in cycles per block,\n"
+		"\t\tthen the throughput of the SIMD crypt kernels (V1, V4, x4, hybrid)\n"
+		"\t\tand of a key rotation in two passes and with transcrypt in cycles per byte\n\n", stdout);
+
+	// execution and examples
+	fputs(
 		"EXECUTION\n\n"
 		"\tmake - Compiles and creates an Executable\n\n"
 		"EXAMPLES\n\n"
 		"\t./salsa20 -k 1,2,3,4,5,6,7,8 -iv 12345 ./example/klartext.txt\n"
-		"\t./salsa20 -V0 -B10 -k 94967295,42967294,42949672,4294967292,429496791,42496720,429496,1 -iv 12345 -o ./geheimtext.txt ./examples/klartext.txt\n\n";
-
-	fprintf(stdout, "%s", help);
+		"\t./salsa20 -V0 -B10 -k 94967295,42967294,42949672,4294967292,429496791,42496720,429496,1 -iv 12345 -o ./geheimtext.txt ./examples/klartext.txt\n\n", stdout);
 }
@@ -6,15 +6,21 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h> // EXIT_SUCCESS
+#include <stdbool.h>
 
 unsigned long long get_unsigned_long_long(char* charPointer, const char* errorMessage) ;
 unsigned long get_unsigned_long(char* charPointer, const char* errorMessage);
 long long get_long_long(char* charPointer, const char* errorMessage);
+double get_double(char* charPointer, const char* errorMessage);
 void throw_error(const char* msg) ;
 void throw_perror(const char* msg);
 void throw_file_error(const char* msg, FILE* file);
 void throw_file_perror(const char* msg, FILE* file);
 void parseKey(char* keyPtr, uint32_t key[8]);
 uint64_t parseNonce(char* noncePtr);
+bool pread_all(int fd, void* buffer, size_t length, uint64_t offset);
+bool pwrite_all(int fd, const void* buffer, size_t length, uint64_t offset);
+bool write_all(int fd, const void* buffer, size_t length);
+uint64_t monotonic_ns(void);
 void print_help();
 #endif